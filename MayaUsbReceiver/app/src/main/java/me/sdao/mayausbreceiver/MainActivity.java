@@ -45,13 +45,85 @@ public class MainActivity extends AppCompatActivity {
     private static final String ACTION_USB_PERMISSION =
             "com.android.example.USB_PERMISSION";
 
+    // Capability exchange: we send a hello, the host answers with its choices.
+    // All fields are big-endian; see MayaUsbDevice.h on the host.
+    private static final int PROTOCOL_MAGIC = 0x4D555342; // "MUSB"
+    private static final int PROTOCOL_VERSION = 1;
+    private static final int HELLO_LEN = 32;
+    private static final int REPLY_LEN = 16;
+    private static final int CODEC_JPEG = 1;
+    private static final int EYE_LAYOUT_SIDE_BY_SIDE = 0;
+    private static final int EYE_LAYOUT_TOP_BOTTOM = 1;
+    private static final int FEATURE_CREDITS = 1;
+    private static final int FEATURE_CLOCK_SYNC = 2;
+    private static final int FEATURE_FRAME_ABORT = 4;
+    private static final int FEATURE_SLICED_FRAMES = 8;
+    private static final int FEATURE_PANORAMA = 16;
+    private static final int FEATURE_FRAME_POSE = 32;
+    private static final int FEATURE_FRAME_TIME = 64;
+    private static final int MAX_FRAME_SIZE = 1024 * 1024 * 4; // 4 MB.
+
+    // Messages to the host: a 32-bit type, then a 16-byte payload.
+    private static final int MESSAGE_LEN = 20;
+    private static final int MESSAGE_POSE = 1; // Four floats (a quaternion).
+    private static final int MESSAGE_CREDIT = 2; // Frames we have room for.
+    private static final int MESSAGE_PONG = 3; // Answers a host clock ping.
+
+    // Sent by the host in place of a frame size, followed by a sequence number.
+    private static final int PING_MARKER = 0xFFFFFFFF;
+    // Sent in place of a frame size, followed by a length and data to discard.
+    private static final int PROBE_MARKER = 0xFFFFFFFE;
+    // With FEATURE_FRAME_ABORT, sent in place of a chunk length to drop a frame.
+    private static final int ABORT_MARKER = 0xFFFFFFFF;
+    // Sent in place of a frame size, followed by a slice count. Each slice is a
+    // JPEG of a band of the frame, in chunks; its last chunk is marked.
+    private static final int SLICED_MARKER = 0xFFFFFFFC;
+    private static final int LAST_CHUNK = 0x80000000;
+    private static final int MAX_SLICES = 16;
+    // Sent in place of a frame size, followed by a cube face index; the next
+    // frame is that face of a panorama. See PanoramaCube.
+    private static final int PANORAMA_MARKER = 0xFFFFFFFB;
+    // With FEATURE_FRAME_POSE, sent in place of a frame size, followed by the
+    // pose the next frame was rendered from: ScreenQuad.POSE_LENGTH floats.
+    private static final int POSE_MARKER = 0xFFFFFFFA;
+    // With FEATURE_FRAME_TIME, sent in place of a frame size, followed by when
+    // the next frame was captured, in System.nanoTime() terms.
+    private static final int TIME_MARKER = 0xFFFFFFF9;
+
+    private static final float Z_NEAR = 0.1f;
+    private static final float Z_FAR = 10.0f;
+
+    // Frames the host may have in flight to us: one decoding, one queued.
+    private static final int FRAME_CREDITS = 2;
+    private static final long POSE_INTERVAL_NS = 10000000; // 100 Hz.
+
     final private Object mBitmapLock = new Object();
-    private Bitmap mBitmap = null;
+    private Bitmap[] mSlices = new Bitmap[MAX_SLICES]; // Top to bottom.
+    private int mSliceCount = 0;
     private boolean mBitmapNew = false;
+    private float[] mFramePose = new float[ScreenQuad.POSE_LENGTH];
+    private boolean mHasFramePose = false; // Whether mSlices came with one.
+    private Bitmap[] mFaces = new Bitmap[PanoramaCube.FACES];
+    private boolean[] mFaceNew = new boolean[PanoramaCube.FACES];
+    private boolean mPanorama = false; // Showing faces rather than a frame.
 
     final private Object mRotationLock = new Object();
     private float[] mRotation = new float[4];
 
+    // Guards everything the write thread has yet to send to the host.
+    final private Object mCreditLock = new Object();
+    private int mPendingCredits = 0; // Not yet sent to the host.
+    private boolean mPongPending = false;
+    private int mPongSequence;
+    private long mPongReceived; // System.nanoTime() when the ping arrived.
+
+    // Largest texture we can decode into; known once the surface is created.
+    private volatile int mMaxTextureSize = 2048;
+    // Whether the host sends the eyes top-bottom rather than side by side.
+    private volatile boolean mTopBottom = false;
+    // Whether frames arrive in framed chunks; only touched by the read thread.
+    private boolean mFramedChunks = false;
+
     private AtomicBoolean mCancel = new AtomicBoolean();
     private PendingIntent mPermissionIntent;
 
@@ -86,28 +158,52 @@ public class MainActivity extends AppCompatActivity {
         CardboardView cardboardView = (CardboardView) findViewById(R.id.cardboard_view);
         cardboardView.setRenderer(new CardboardView.StereoRenderer() {
             ScreenQuad screenQuad = new ScreenQuad(MainActivity.this);
+            PanoramaCube panoramaCube = new PanoramaCube(MainActivity.this);
+            float[] headRotation = new float[4];
+            float[] boundPose = new float[ScreenQuad.POSE_LENGTH];
+            boolean hasBoundPose = false;
 
             @Override
             public void onNewFrame(HeadTransform headTransform) {
+                // Where the head is now, to reproject the frame to.
+                headTransform.getQuaternion(headRotation, 0);
                 if (!mCancel.get()) {
                     synchronized (mRotationLock) {
-                        headTransform.getQuaternion(mRotation, 0);
+                        System.arraycopy(headRotation, 0, mRotation, 0, 4);
                     }
                 }
             }
 
             @Override
             public void onDrawEye(Eye eye) {
+                boolean panorama;
                 synchronized (mBitmapLock) {
                     if (mBitmapNew) {
-                        screenQuad.bindBitmap(mBitmap);
+                        screenQuad.bindBitmaps(mSlices, mSliceCount);
+                        System.arraycopy(mFramePose, 0, boundPose, 0, boundPose.length);
+                        hasBoundPose = mHasFramePose;
                         mBitmapNew = false;
                     }
+                    for (int i = 0; i < PanoramaCube.FACES; ++i) {
+                        if (mFaceNew[i]) {
+                            panoramaCube.bindFace(i, mFaces[i]);
+                            mFaceNew[i] = false;
+                        }
+                    }
+                    panorama = mPanorama;
                 }
 
                 GLES20.glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
                 GLES20.glClear(GLES20.GL_COLOR_BUFFER_BIT);
-                screenQuad.draw(eye.getType() == Eye.Type.LEFT);
+                boolean left = eye.getType() == Eye.Type.LEFT;
+                if (panorama) {
+                    // Turned here, so the view follows the head right away.
+                    panoramaCube.draw(eye.getEyeView(), eye.getPerspective(Z_NEAR, Z_FAR),
+                            left, mTopBottom);
+                } else {
+                    screenQuad.draw(left, mTopBottom, hasBoundPose ? boundPose : null,
+                            headRotation);
+                }
             }
 
             @Override
@@ -122,12 +218,19 @@ public class MainActivity extends AppCompatActivity {
 
             @Override
             public void onSurfaceCreated(EGLConfig eglConfig) {
+                int[] maxTextureSize = new int[1];
+                GLES20.glGetIntegerv(GLES20.GL_MAX_TEXTURE_SIZE, maxTextureSize, 0);
+                if (maxTextureSize[0] > 0) {
+                    mMaxTextureSize = maxTextureSize[0];
+                }
                 screenQuad.setup();
+                panoramaCube.setup();
             }
 
             @Override
             public void onRendererShutdown() {
                 screenQuad.shutdown();
+                panoramaCube.shutdown();
             }
         });
     }
@@ -243,18 +346,36 @@ public class MainActivity extends AppCompatActivity {
 
         hideSystemUi();
         mCancel.set(false);
+        synchronized (mCreditLock) {
+            mPendingCredits = FRAME_CREDITS;
+            mPongPending = false;
+        }
         runReadThread(mParcelFileDescriptor, callback);
         runWriteThread(mParcelFileDescriptor, callback);
     }
 
     private boolean sendHandshake(@NonNull ParcelFileDescriptor parcelFileDescriptor) {
+        // Tell the host what we can show, so that it can fit the stream to us.
+        int maxDecodeSize = Math.min(mMaxTextureSize, 0xFFFF);
+        ByteBuffer hello = ByteBuffer.allocate(HELLO_LEN).order(ByteOrder.BIG_ENDIAN);
+        hello.putInt(PROTOCOL_MAGIC)
+                .putShort((short) PROTOCOL_VERSION)
+                .putShort((short) HELLO_LEN)
+                .putInt(CODEC_JPEG)
+                .putShort((short) maxDecodeSize)
+                .putShort((short) maxDecodeSize)
+                .putFloat(getWindowManager().getDefaultDisplay().getRefreshRate())
+                .put((byte) ((1 << EYE_LAYOUT_SIDE_BY_SIDE) | (1 << EYE_LAYOUT_TOP_BOTTOM)))
+                .put((byte) EYE_LAYOUT_SIDE_BY_SIDE)
+                .putShort((short) 0)
+                .putInt(MAX_FRAME_SIZE)
+                .putInt(FEATURE_CREDITS | FEATURE_CLOCK_SYNC | FEATURE_FRAME_ABORT
+                        | FEATURE_SLICED_FRAMES | FEATURE_PANORAMA | FEATURE_FRAME_POSE
+                        | FEATURE_FRAME_TIME);
+
         FileDescriptor fd = parcelFileDescriptor.getFileDescriptor();
         try (OutputStream os = new FileOutputStream(fd)) {
-            byte[] handshake = new byte[16384];
-            for (int i = 0; i < 16384; ++i) {
-                handshake[i] = (byte) i;
-            }
-            os.write(handshake);
+            os.write(hello.array());
             return true;
         } catch (IOException e) {
             return false;
@@ -268,38 +389,123 @@ public class MainActivity extends AppCompatActivity {
             @Override
             public void run() {
                 byte[] buffer = new byte[1024 * 1024]; // Initialize 1 MB at first.
-                Bitmap backBitmap = null;
+                Bitmap[] backSlices = new Bitmap[MAX_SLICES];
+                float[] backPose = new float[ScreenQuad.POSE_LENGTH];
                 BitmapFactory.Options options = new BitmapFactory.Options();
                 options.inMutable = true;
 
                 try (InputStream is = new FileInputStream(fd)) {
                     DataInputStream dis = new DataInputStream(is);
+                    readReply(dis);
 
+                    int face = -1; // Of the next frame, if it's a panorama face.
+                    boolean hasPose = false; // Whether backPose is the next frame's.
+                    long captureTime = 0; // Of the next frame, if the host sent it.
+                    boolean hasCaptureTime = false;
                     boolean cancelled;
                     while (!(cancelled = mCancel.get())) {
                         int size = dis.readInt();
+                        if (size == PING_MARKER) {
+                            // Stamped before anything else, for the host's clock sync.
+                            long received = System.nanoTime();
+                            queuePong(dis.readInt(), received);
+                            continue;
+                        } else if (size == PROBE_MARKER) {
+                            // The host is measuring the link; just drain it.
+                            int length = dis.readInt();
+                            if (length < 0 || length > buffer.length) {
+                                throw new IndexOutOfBoundsException();
+                            }
+                            dis.readFully(buffer, 0, length);
+                            continue;
+                        } else if (size == PANORAMA_MARKER) {
+                            face = dis.readInt();
+                            if (face < 0 || face >= PanoramaCube.FACES) {
+                                throw new IndexOutOfBoundsException();
+                            }
+                            continue;
+                        } else if (size == POSE_MARKER) {
+                            for (int i = 0; i < backPose.length; ++i) {
+                                backPose[i] = dis.readFloat();
+                            }
+                            hasPose = true;
+                            continue;
+                        } else if (size == TIME_MARKER) {
+                            captureTime = dis.readLong();
+                            hasCaptureTime = true;
+                            continue;
+                        }
                         Log.i("SIZE", "size=" + size);
 
-                        if (size < 0 || size > 1024 * 1024 * 4 /* 4 MB */) {
+                        boolean sliced = size == SLICED_MARKER;
+                        int sliceCount = 1;
+                        if (sliced) {
+                            sliceCount = dis.readInt();
+                            if (sliceCount < 1 || sliceCount > MAX_SLICES
+                                    || (face >= 0 && sliceCount > 1)) {
+                                throw new IndexOutOfBoundsException();
+                            }
+                            // A slice's size isn't known until it has arrived.
+                            if (buffer.length < MAX_FRAME_SIZE) {
+                                buffer = new byte[MAX_FRAME_SIZE];
+                            }
+                        } else if (size < 0 || size > MAX_FRAME_SIZE) {
                             throw new IndexOutOfBoundsException();
                         } else if (size == 0) {
                             break;
-                        }
-
-                        if (buffer.length < size) {
+                        } else if (buffer.length < size) {
                             buffer = new byte[size];
                         }
 
-                        dis.readFully(buffer, 0, size);
-
-                        backBitmap = BitmapFactory.decodeByteArray(buffer, 0, size, options);
+                        // Each slice is decoded as soon as it arrives, while the host is
+                        // still compressing and sending the next one.
+                        boolean complete = true;
+                        long arrived = 0;
+                        for (int i = 0; i < sliceCount && complete; ++i) {
+                            int length = sliced ? readSlice(dis, buffer)
+                                    : readFrame(dis, buffer, size) ? size : -1;
+                            arrived = System.nanoTime();
+                            if (length < 0) {
+                                complete = false; // The host gave up on it for a newer one.
+                            } else {
+                                backSlices[i] = decodeInto(backSlices[i], buffer, length, options);
+                            }
+                        }
+                        grantCredit(); // Ready for the next frame.
+                        int frameFace = face;
+                        boolean framePose = hasPose;
+                        boolean frameTime = hasCaptureTime;
+                        face = -1;
+                        hasPose = false;
+                        hasCaptureTime = false;
+                        if (!complete) {
+                            continue;
+                        }
+                        if (frameTime) {
+                            // From the host's capture to the last byte here, in our clock.
+                            Log.i("LATENCY", "arrival=" + (arrived - captureTime) / 1e6 + " ms");
+                        }
 
                         synchronized (mBitmapLock) {
-                            Bitmap temp = mBitmap;
-                            mBitmap = backBitmap;
-                            mBitmapNew = true;
-                            backBitmap = temp;
-                            options.inBitmap = temp;
+                            if (frameFace >= 0) {
+                                // Kept until the host sends this face again.
+                                Bitmap temp = mFaces[frameFace];
+                                mFaces[frameFace] = backSlices[0];
+                                mFaceNew[frameFace] = true;
+                                mPanorama = true;
+                                backSlices[0] = temp;
+                            } else {
+                                Bitmap[] temp = mSlices;
+                                mSlices = backSlices;
+                                mSliceCount = sliceCount;
+                                float[] tempPose = mFramePose;
+                                mFramePose = backPose;
+                                mHasFramePose = framePose;
+                                backPose = tempPose;
+                                mBitmapNew = true;
+                                mPanorama = false;
+                                backSlices = temp;
+                            }
                         }
                     }
 
@@ -320,8 +526,10 @@ public class MainActivity extends AppCompatActivity {
                         }
                     });
                 } finally {
-                    if (backBitmap != null) {
-                        backBitmap.recycle();
+                    for (Bitmap slice : backSlices) {
+                        if (slice != null) {
+                            slice.recycle();
+                        }
                     }
                 }
 
@@ -337,27 +545,66 @@ public class MainActivity extends AppCompatActivity {
         new Thread(null, new Runnable() {
             @Override
             public void run() {
-                ByteBuffer bytes = ByteBuffer.allocate(Float.SIZE / Byte.SIZE * 4)
+                ByteBuffer bytes = ByteBuffer.allocate(3 * MESSAGE_LEN)
                         .order(ByteOrder.BIG_ENDIAN);
-                bytes.putFloat(0.04f)
-                    .putFloat(0.08f)
-                    .putFloat(0.15f)
-                    .putFloat(0.16f);
 
                 try (OutputStream os = new FileOutputStream(fd)) {
                     DataOutputStream dos = new DataOutputStream(os);
+                    long nextPose = System.nanoTime();
 
                     while (!mCancel.get()) {
-                        dos.write(bytes.array());
+                        // Wake for the next pose, or sooner to return credits or
+                        // answer a ping.
+                        int credits;
+                        boolean pong;
+                        int pongSequence;
+                        long pongReceived;
+                        synchronized (mCreditLock) {
+                            long waitNs = nextPose - System.nanoTime();
+                            if (mPendingCredits == 0 && !mPongPending && waitNs > 0) {
+                                mCreditLock.wait(waitNs / 1000000,
+                                        (int) (waitNs % 1000000));
+                            }
+                            credits = mPendingCredits;
+                            mPendingCredits = 0;
+                            pong = mPongPending;
+                            pongSequence = mPongSequence;
+                            pongReceived = mPongReceived;
+                            mPongPending = false;
+                        }
 
-                        synchronized (mRotationLock) {
-                            bytes.position(0);
-                            for (int i = 0; i < 4; ++i) {
-                                bytes.putFloat(mRotation[i]);
+                        // All messages go out in one write, so one USB transfer.
+                        bytes.clear();
+                        if (credits > 0) {
+                            bytes.putInt(MESSAGE_CREDIT)
+                                .putInt(credits)
+                                .putInt(0)
+                                .putInt(0)
+                                .putInt(0);
+                        }
+
+                        long now = System.nanoTime();
+                        if (now >= nextPose) {
+                            bytes.putInt(MESSAGE_POSE);
+                            synchronized (mRotationLock) {
+                                for (int i = 0; i < 4; ++i) {
+                                    bytes.putFloat(mRotation[i]);
+                                }
                             }
+                            nextPose = now + POSE_INTERVAL_NS;
+                        }
+
+                        // Last, so that the hold time runs until just before the write.
+                        if (pong) {
+                            bytes.putInt(MESSAGE_PONG)
+                                .putInt(pongSequence)
+                                .putInt((int) (System.nanoTime() - pongReceived))
+                                .putLong(pongReceived);
                         }
 
-                        Thread.sleep(10); // Throttle to 100 fps.
+                        if (bytes.position() > 0) {
+                            dos.write(bytes.array(), 0, bytes.position());
+                        }
                     }
                 } catch (final Exception e) {
                     MainActivity.this.runOnUiThread(new Runnable() {
@@ -374,6 +621,109 @@ public class MainActivity extends AppCompatActivity {
         }).start();
     }
 
+    /** Reads the host's answer to our hello, which precedes the first frame. */
+    private void readReply(DataInputStream dis) throws IOException {
+        int magic = dis.readInt();
+        int version = dis.readUnsignedShort();
+        int length = dis.readUnsignedShort();
+        if (magic != PROTOCOL_MAGIC || version < 1 || length < REPLY_LEN) {
+            throw new IOException("Invalid handshake reply");
+        }
+
+        dis.readUnsignedByte(); // Codec; JPEG is the only one we offer.
+        int eyeLayout = dis.readUnsignedByte();
+        dis.readUnsignedShort(); // Reserved.
+        int features = dis.readInt(); // Credits are always sent and may be ignored.
+        dis.skipBytes(length - REPLY_LEN); // Fields from later versions.
+
+        mTopBottom = eyeLayout == EYE_LAYOUT_TOP_BOTTOM;
+        mFramedChunks = (features & FEATURE_FRAME_ABORT) != 0;
+    }
+
+    /**
+     * Reads a frame's data into buffer. Returns false if the host aborted the
+     * frame, in which case the partial data is meaningless.
+     */
+    private boolean readFrame(DataInputStream dis, byte[] buffer, int size)
+            throws IOException {
+        if (!mFramedChunks) {
+            dis.readFully(buffer, 0, size);
+            return true;
+        }
+
+        int offset = 0;
+        while (offset < size) {
+            int chunk = dis.readInt();
+            if (chunk == ABORT_MARKER) {
+                return false;
+            } else if (chunk <= 0 || chunk > size - offset) {
+                throw new IndexOutOfBoundsException();
+            }
+            dis.readFully(buffer, offset, chunk);
+            offset += chunk;
+        }
+        return true;
+    }
+
+    /**
+     * Decodes a JPEG, reusing reuse's memory if it's large enough. The host
+     * shrinks frames while the head turns quickly, so sizes change.
+     */
+    private static Bitmap decodeInto(Bitmap reuse, byte[] buffer, int length,
+                                     BitmapFactory.Options options) {
+        options.inBitmap = reuse;
+        try {
+            return BitmapFactory.decodeByteArray(buffer, 0, length, options);
+        } catch (IllegalArgumentException e) {
+            // Too small to decode into.
+            if (reuse != null) {
+                reuse.recycle();
+            }
+            options.inBitmap = null;
+            return BitmapFactory.decodeByteArray(buffer, 0, length, options);
+        }
+    }
+
+    /**
+     * Reads one slice of a sliced frame into buffer and returns its length, or
+     * -1 if the host aborted the frame.
+     */
+    private int readSlice(DataInputStream dis, byte[] buffer) throws IOException {
+        int offset = 0;
+        while (true) {
+            int header = dis.readInt();
+            if (header == ABORT_MARKER) {
+                return -1;
+            }
+            int chunk = header & ~LAST_CHUNK;
+            if (chunk <= 0 || chunk > buffer.length - offset) {
+                throw new IndexOutOfBoundsException();
+            }
+            dis.readFully(buffer, offset, chunk);
+            offset += chunk;
+            if ((header & LAST_CHUNK) != 0) {
+                return offset;
+            }
+        }
+    }
+
+    private void queuePong(int sequence, long received) {
+        synchronized (mCreditLock) {
+            // Only the newest ping matters; the host ignores older pongs.
+            mPongPending = true;
+            mPongSequence = sequence;
+            mPongReceived = received;
+            mCreditLock.notify();
+        }
+    }
+
+    private void grantCredit() {
+        synchronized (mCreditLock) {
+            mPendingCredits++;
+            mCreditLock.notify();
+        }
+    }
+
     private interface ThreadCallback {
         void onCompleted(boolean success, Exception e);
     }
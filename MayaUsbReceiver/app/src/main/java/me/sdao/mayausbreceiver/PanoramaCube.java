@@ -0,0 +1,231 @@
+package me.sdao.mayausbreceiver;
+
+import android.content.Context;
+import android.graphics.Bitmap;
+import android.opengl.GLES20;
+import android.opengl.GLUtils;
+import android.opengl.Matrix;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.FloatBuffer;
+
+/**
+ * A panorama sent as the six faces of a cube around the head, drawn from the
+ * inside so that turning the head turns the view without waiting for the
+ * host. Each face is a stereo frame like the ones ScreenQuad shows.
+ */
+public class PanoramaCube {
+
+    public static final int FACES = 6;
+
+    private static final float H = 0.70710678f; // sqrt(1/2)
+
+    // Rotations (x, y, z, w) of the front face (-Z, +Y up) to each face, in
+    // the host's order: front, right, back, left, up, down.
+    private static final float mFaceRotations[][] = {
+            {0.0f, 0.0f, 0.0f, 1.0f},
+            {0.0f, -H, 0.0f, H},
+            {0.0f, 1.0f, 0.0f, 0.0f},
+            {0.0f, H, 0.0f, H},
+            {H, 0.0f, 0.0f, H},
+            {-H, 0.0f, 0.0f, H}
+    };
+
+    // Corners of the front face as a triangle strip, with where each one is
+    // in a side-by-side frame's left half; see ScreenQuad.
+    private static final float mCorners[][] = {
+            /* x, y, s, t */
+            {-1.0f, -1.0f, 0.0f, 1.0f},
+            {-1.0f, 1.0f, 0.0f, 0.0f},
+            {1.0f, -1.0f, 1.0f, 1.0f},
+            {1.0f, 1.0f, 1.0f, 0.0f}
+    };
+
+    private static final int DATA_LENGTH = 20;
+    private static final int LAYOUTS = 4; // Left, right, top, bottom.
+
+    private boolean mReady;
+    private Context mContext;
+    private int mProgram;
+    private int mProgramPositionParam;
+    private int mProgramTexCoordParam;
+    private int mProgramBitmapUniform;
+    private int mProgramMvpUniform;
+    private int[] mTextures = new int[FACES];
+    private boolean[] mHasFace = new boolean[FACES];
+    private int[] mBuffers = new int[FACES * LAYOUTS];
+    private float[] mView = new float[16];
+    private float[] mMvp = new float[16];
+
+    public PanoramaCube(Context context) {
+        mContext = context;
+    }
+
+    public void setup() {
+        int cubeVertex = GLShaderUtils.loadGLShader(mContext, GLES20.GL_VERTEX_SHADER,
+                R.raw.quad_vert);
+        int passthroughFrag = GLShaderUtils.loadGLShader(mContext, GLES20.GL_FRAGMENT_SHADER,
+                R.raw.quad_frag);
+
+        mProgram = GLES20.glCreateProgram();
+        GLES20.glAttachShader(mProgram, cubeVertex);
+        GLES20.glAttachShader(mProgram, passthroughFrag);
+        GLES20.glLinkProgram(mProgram);
+        GLES20.glUseProgram(mProgram);
+
+        mProgramPositionParam = GLES20.glGetAttribLocation(mProgram, "a_Position");
+        mProgramTexCoordParam = GLES20.glGetAttribLocation(mProgram, "a_TexCoord");
+        mProgramBitmapUniform = GLES20.glGetUniformLocation(mProgram, "u_Bitmap");
+        mProgramMvpUniform = GLES20.glGetUniformLocation(mProgram, "u_MVP");
+
+        GLES20.glGenTextures(FACES, mTextures, 0);
+        GLES20.glGenBuffers(FACES * LAYOUTS, mBuffers, 0);
+        for (int face = 0; face < FACES; ++face) {
+            for (int layout = 0; layout < LAYOUTS; ++layout) {
+                bufferData(mBuffers[face * LAYOUTS + layout], faceData(face, layout));
+            }
+            mHasFace[face] = false;
+        }
+
+        mReady = true;
+    }
+
+    public void shutdown() {
+        GLES20.glDeleteTextures(FACES, mTextures, 0);
+        GLES20.glDeleteBuffers(FACES * LAYOUTS, mBuffers, 0);
+
+        mReady = false;
+    }
+
+    /** A face's corners and texture coordinates for one eye's half of it. */
+    private static float[] faceData(int face, int layout) {
+        float[] q = mFaceRotations[face];
+        boolean topBottom = layout >= 2;
+        float offset = layout % 2 == 0 ? 0.0f : 0.5f;
+        float[] data = new float[DATA_LENGTH];
+        for (int i = 0; i < 4; ++i) {
+            float[] corner = mCorners[i];
+            float[] v = {corner[0], corner[1], -1.0f};
+
+            // v' = v + 2w (q x v) + 2 q x (q x v)
+            float[] c = cross(q, v);
+            float[] cc = cross(q, c);
+            for (int j = 0; j < 3; ++j) {
+                data[i * 5 + j] = v[j] + 2.0f * q[3] * c[j] + 2.0f * cc[j];
+            }
+
+            float s = corner[2];
+            float t = corner[3];
+            data[i * 5 + 3] = topBottom ? s : s * 0.5f + offset;
+            data[i * 5 + 4] = topBottom ? t * 0.5f + offset : t;
+        }
+        return data;
+    }
+
+    private static float[] cross(float[] a, float[] b) {
+        return new float[] {
+                a[1] * b[2] - a[2] * b[1],
+                a[2] * b[0] - a[0] * b[2],
+                a[0] * b[1] - a[1] * b[0]
+        };
+    }
+
+    private void bufferData(int buffer, float[] data) {
+        ByteBuffer dataByteBuffer = ByteBuffer.allocateDirect(DATA_LENGTH * 4); // 32 bits.
+        dataByteBuffer.order(ByteOrder.nativeOrder());
+        FloatBuffer dataFloatBuffer = dataByteBuffer.asFloatBuffer();
+        dataFloatBuffer.put(data);
+        dataFloatBuffer.position(0);
+
+        GLES20.glBindBuffer(GLES20.GL_ARRAY_BUFFER, buffer);
+
+        GLES20.glBufferData(GLES20.GL_ARRAY_BUFFER,
+                dataFloatBuffer.capacity() * 4 /* bytes per float */,
+                dataFloatBuffer,
+                GLES20.GL_STATIC_DRAW);
+
+        GLES20.glBindBuffer(GLES20.GL_ARRAY_BUFFER, 0);
+    }
+
+    /** Uploads one face; it's shown until the host sends that face again. */
+    public void bindFace(int face, Bitmap bitmap) {
+        if (bitmap == null || !mReady) {
+            return;
+        }
+
+        GLES20.glBindTexture(GLES20.GL_TEXTURE_2D, mTextures[face]);
+
+        GLES20.glTexParameteri(GLES20.GL_TEXTURE_2D,
+                GLES20.GL_TEXTURE_MIN_FILTER,
+                GLES20.GL_LINEAR);
+        GLES20.glTexParameteri(GLES20.GL_TEXTURE_2D,
+                GLES20.GL_TEXTURE_MAG_FILTER,
+                GLES20.GL_LINEAR);
+        // Don't wrap around at the cube's edges.
+        GLES20.glTexParameteri(GLES20.GL_TEXTURE_2D,
+                GLES20.GL_TEXTURE_WRAP_S,
+                GLES20.GL_CLAMP_TO_EDGE);
+        GLES20.glTexParameteri(GLES20.GL_TEXTURE_2D,
+                GLES20.GL_TEXTURE_WRAP_T,
+                GLES20.GL_CLAMP_TO_EDGE);
+
+        GLUtils.texImage2D(GLES20.GL_TEXTURE_2D, 0, bitmap, 0);
+        mHasFace[face] = true;
+    }
+
+    /**
+     * Draws one eye's half of each face that has arrived, as seen through
+     * eyeView (only its rotation; the panorama is infinitely far away) and
+     * perspective.
+     */
+    public void draw(float[] eyeView, float[] perspective, boolean left, boolean topBottom) {
+        if (!mReady) {
+            return;
+        }
+
+        System.arraycopy(eyeView, 0, mView, 0, 16);
+        mView[12] = 0.0f;
+        mView[13] = 0.0f;
+        mView[14] = 0.0f;
+        Matrix.multiplyMM(mMvp, 0, perspective, 0, mView, 0);
+
+        GLES20.glUseProgram(mProgram);
+        GLES20.glUniformMatrix4fv(mProgramMvpUniform, 1, false, mMvp, 0);
+        GLES20.glActiveTexture(GLES20.GL_TEXTURE0);
+        GLES20.glUniform1i(mProgramBitmapUniform, 0);
+
+        int layout = (topBottom ? 2 : 0) + (left ? 0 : 1);
+        for (int face = 0; face < FACES; ++face) {
+            if (!mHasFace[face]) {
+                continue;
+            }
+
+            GLES20.glBindTexture(GLES20.GL_TEXTURE_2D, mTextures[face]);
+            GLES20.glBindBuffer(GLES20.GL_ARRAY_BUFFER, mBuffers[face * LAYOUTS + layout]);
+
+            GLES20.glEnableVertexAttribArray(mProgramPositionParam);
+            GLES20.glVertexAttribPointer(
+                    mProgramPositionParam,
+                    3 /* coordinates per vertex */,
+                    GLES20.GL_FLOAT,
+                    false /* normalized */,
+                    5 * 4 /* stride */,
+                    0 /* offset */);
+
+            GLES20.glEnableVertexAttribArray(mProgramTexCoordParam);
+            GLES20.glVertexAttribPointer(
+                    mProgramTexCoordParam,
+                    2 /* coordinates per vertex */,
+                    GLES20.GL_FLOAT,
+                    false /* normalized */,
+                    5 * 4 /* stride */,
+                    3 * 4 /* offset */);
+
+            GLES20.glBindBuffer(GLES20.GL_ARRAY_BUFFER, 0);
+
+            GLES20.glDrawArrays(GLES20.GL_TRIANGLE_STRIP, 0, DATA_LENGTH / 5);
+        }
+    }
+
+}
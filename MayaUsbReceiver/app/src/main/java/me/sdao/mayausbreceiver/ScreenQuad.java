@@ -5,6 +5,7 @@ import android.graphics.Bitmap;
 import android.opengl.GLES10;
 import android.opengl.GLES20;
 import android.opengl.GLUtils;
+import android.opengl.Matrix;
 
 import java.nio.ByteBuffer;
 import java.nio.ByteOrder;
@@ -28,16 +29,47 @@ public class ScreenQuad {
             1.0f, 1.0f, 0.0f, 1.0f, 0.0f
     };
 
+    private static final float mTopData[] = {
+            /* x, y, z, s, t */
+            -1.0f, -1.0f, 0.0f, 0.0f, 0.5f,
+            -1.0f, 1.0f, 0.0f, 0.0f, 0.0f,
+            1.0f, -1.0f, 0.0f, 1.0f, 0.5f,
+            1.0f, 1.0f, 0.0f, 1.0f, 0.0f
+    };
+
+    private static final float mBottomData[] = {
+            /* x, y, z, s, t */
+            -1.0f, -1.0f, 0.0f, 0.0f, 1.0f,
+            -1.0f, 1.0f, 0.0f, 0.0f, 0.5f,
+            1.0f, -1.0f, 0.0f, 1.0f, 1.0f,
+            1.0f, 1.0f, 0.0f, 1.0f, 0.5f
+    };
+
     private static final int DATA_LENGTH = 20;
 
+    // A frame's pose: its head rotation (x, y, z, w), the fields of view,
+    // then the eye offsets; see MainActivity.POSE_MARKER.
+    public static final int POSE_LENGTH = 8;
+
+    private static final float Z_NEAR = 0.1f;
+    private static final float Z_FAR = 10.0f;
+
     private boolean mReady;
     private Context mContext;
     private int mProgram;
     private int mProgramPositionParam;
     private int mProgramTexCoordParam;
     private int mProgramBitmapUniform;
+    private int mProgramMvpUniform;
     private int[] mTextures = new int[1];
-    private int[] mBuffers = new int[2];
+    private int mTextureWidth = 0;
+    private int mTextureHeight = 0;
+    private int[] mBuffers = new int[4]; // Left, right, top, bottom.
+    private float[] mScreen = new float[16];
+    private float[] mRotation = new float[16];
+    private float[] mPerspective = new float[16];
+    private float[] mMvp = new float[16];
+    private float[] mTemp = new float[16];
 
     public ScreenQuad(Context context) {
         mContext = context;
@@ -58,30 +90,33 @@ public class ScreenQuad {
         mProgramPositionParam = GLES20.glGetAttribLocation(mProgram, "a_Position");
         mProgramTexCoordParam = GLES20.glGetAttribLocation(mProgram, "a_TexCoord");
         mProgramBitmapUniform = GLES20.glGetUniformLocation(mProgram, "u_Bitmap");
+        mProgramMvpUniform = GLES20.glGetUniformLocation(mProgram, "u_MVP");
 
         GLES20.glGenTextures(1, mTextures, 0);
-        GLES20.glGenBuffers(2, mBuffers, 0);
-        bufferData(true);
-        bufferData(false);
+        GLES20.glGenBuffers(4, mBuffers, 0);
+        bufferData(mBuffers[0], mLeftData);
+        bufferData(mBuffers[1], mRightData);
+        bufferData(mBuffers[2], mTopData);
+        bufferData(mBuffers[3], mBottomData);
 
         mReady = true;
     }
 
     public void shutdown() {
         GLES20.glDeleteTextures(1, mTextures, 0);
-        GLES20.glDeleteBuffers(2, mBuffers, 0);
+        GLES20.glDeleteBuffers(4, mBuffers, 0);
 
         mReady = false;
     }
 
-    private void bufferData(boolean left) {
+    private void bufferData(int buffer, float[] data) {
         ByteBuffer dataByteBuffer = ByteBuffer.allocateDirect(DATA_LENGTH * 4); // 32 bits.
         dataByteBuffer.order(ByteOrder.nativeOrder());
         FloatBuffer dataFloatBuffer = dataByteBuffer.asFloatBuffer();
-        dataFloatBuffer.put(left ? mLeftData : mRightData);
+        dataFloatBuffer.put(data);
         dataFloatBuffer.position(0);
 
-        GLES20.glBindBuffer(GLES20.GL_ARRAY_BUFFER, left ? mBuffers[0] : mBuffers[1]);
+        GLES20.glBindBuffer(GLES20.GL_ARRAY_BUFFER, buffer);
 
         GLES20.glBufferData(GLES20.GL_ARRAY_BUFFER,
                 dataFloatBuffer.capacity() * 4 /* bytes per float */,
@@ -91,11 +126,25 @@ public class ScreenQuad {
         GLES20.glBindBuffer(GLES20.GL_ARRAY_BUFFER, 0);
     }
 
-    public void bindBitmap(Bitmap bitmap) {
-        if (bitmap == null || !mReady) {
+    /**
+     * Uploads a frame made of count horizontal slices, top to bottom. A frame
+     * of one slice is just that bitmap.
+     */
+    public void bindBitmaps(Bitmap[] slices, int count) {
+        if (count == 0 || !mReady) {
             return;
         }
 
+        int width = 0;
+        int height = 0;
+        for (int i = 0; i < count; ++i) {
+            if (slices[i] == null) {
+                return;
+            }
+            width = slices[i].getWidth();
+            height += slices[i].getHeight();
+        }
+
         GLES20.glBindTexture(GLES20.GL_TEXTURE_2D, mTextures[0]);
 
         GLES20.glTexParameteri(GLES20.GL_TEXTURE_2D,
@@ -105,21 +154,108 @@ public class ScreenQuad {
                 GLES20.GL_TEXTURE_MAG_FILTER,
                 GLES20.GL_LINEAR);
 
-        GLUtils.texImage2D(GLES20.GL_TEXTURE_2D, 0, bitmap, 0);
+        if (count == 1) {
+            GLUtils.texImage2D(GLES20.GL_TEXTURE_2D, 0, slices[0], 0);
+        } else {
+            // Only reallocate the texture when the frame size changes.
+            if (width != mTextureWidth || height != mTextureHeight) {
+                GLES20.glTexImage2D(GLES20.GL_TEXTURE_2D, 0, GLES20.GL_RGBA, width, height, 0,
+                        GLES20.GL_RGBA, GLES20.GL_UNSIGNED_BYTE, null);
+            }
+            int y = 0;
+            for (int i = 0; i < count; ++i) {
+                GLUtils.texSubImage2D(GLES20.GL_TEXTURE_2D, 0, 0, y, slices[i]);
+                y += slices[i].getHeight();
+            }
+        }
+        mTextureWidth = width;
+        mTextureHeight = height;
+    }
+
+    /**
+     * Where to draw a frame rendered with pose, now that the head is turned to
+     * headRotation: the frame is a screen at the far end of the host's view
+     * frustum, turned by the head's rotation since, so that it stays put in
+     * the scene while a newer frame is on its way. Only the rotation is
+     * corrected; the eyes' offsets matter little for a scene that isn't close
+     * up. Without a pose, the frame fills the view as sent.
+     */
+    private float[] reprojection(float[] pose, float[] headRotation) {
+        if (pose == null) {
+            Matrix.setIdentityM(mMvp, 0);
+            return mMvp;
+        }
+
+        float tanX = (float) Math.tan(pose[4] * 0.5f);
+        float tanY = (float) Math.tan(pose[5] * 0.5f);
+
+        // The frame's quad, at z = -1 in the host's eye space.
+        Matrix.setIdentityM(mScreen, 0);
+        mScreen[0] = tanX;
+        mScreen[5] = tanY;
+        mScreen[14] = -1.0f;
+
+        // From the host's eye space to ours: inverse(now) * rendered.
+        float[] now = headRotation;
+        float[] delta = multiply(
+                new float[] {-now[0], -now[1], -now[2], now[3]}, pose);
+        rotationMatrix(delta, mRotation);
+
+        // The host's own projection, so that an unturned frame fills the view.
+        Matrix.frustumM(mPerspective, 0, -tanX * Z_NEAR, tanX * Z_NEAR,
+                -tanY * Z_NEAR, tanY * Z_NEAR, Z_NEAR, Z_FAR);
+
+        Matrix.multiplyMM(mTemp, 0, mRotation, 0, mScreen, 0);
+        Matrix.multiplyMM(mMvp, 0, mPerspective, 0, mTemp, 0);
+        return mMvp;
+    }
+
+    /** The Hamilton product a * b of two quaternions (x, y, z, w). */
+    private static float[] multiply(float[] a, float[] b) {
+        return new float[] {
+                a[3] * b[0] + a[0] * b[3] + a[1] * b[2] - a[2] * b[1],
+                a[3] * b[1] - a[0] * b[2] + a[1] * b[3] + a[2] * b[0],
+                a[3] * b[2] + a[0] * b[1] - a[1] * b[0] + a[2] * b[3],
+                a[3] * b[3] - a[0] * b[0] - a[1] * b[1] - a[2] * b[2]
+        };
+    }
+
+    /** The column-major rotation matrix of a unit quaternion (x, y, z, w). */
+    private static void rotationMatrix(float[] q, float[] m) {
+        float x = q[0], y = q[1], z = q[2], w = q[3];
+        Matrix.setIdentityM(m, 0);
+        m[0] = 1.0f - 2.0f * (y * y + z * z);
+        m[1] = 2.0f * (x * y + z * w);
+        m[2] = 2.0f * (x * z - y * w);
+        m[4] = 2.0f * (x * y - z * w);
+        m[5] = 1.0f - 2.0f * (x * x + z * z);
+        m[6] = 2.0f * (y * z + x * w);
+        m[8] = 2.0f * (x * z + y * w);
+        m[9] = 2.0f * (y * z - x * w);
+        m[10] = 1.0f - 2.0f * (x * x + y * y);
     }
 
-    public void draw(boolean left) {
+    /**
+     * Draws one eye's half of the frame: the left or right half, or the top
+     * or bottom half if the host sends the eyes top-bottom. If the host sent
+     * the pose the frame was rendered with (null if not), it's reprojected to
+     * headRotation; see reprojection.
+     */
+    public void draw(boolean left, boolean topBottom, float[] pose, float[] headRotation) {
         if (!mReady) {
             return;
         }
 
         GLES20.glUseProgram(mProgram);
+        GLES20.glUniformMatrix4fv(mProgramMvpUniform, 1, false,
+                reprojection(pose, headRotation), 0);
 
         GLES20.glActiveTexture(GLES20.GL_TEXTURE0);
         GLES20.glBindTexture(GLES20.GL_TEXTURE_2D, mTextures[0]);
         GLES20.glUniform1i(mProgramBitmapUniform, 0);
 
-        GLES20.glBindBuffer(GLES20.GL_ARRAY_BUFFER, left ? mBuffers[0] : mBuffers[1]);
+        int buffer = (topBottom ? 2 : 0) + (left ? 0 : 1);
+        GLES20.glBindBuffer(GLES20.GL_ARRAY_BUFFER, mBuffers[buffer]);
 
         GLES20.glEnableVertexAttribArray(mProgramPositionParam);
         GLES20.glVertexAttribPointer(
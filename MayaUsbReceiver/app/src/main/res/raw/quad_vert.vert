@@ -1,3 +1,5 @@
+uniform mat4 u_MVP;
+
 attribute vec4 a_Position;
 attribute vec2 a_TexCoord;
 
@@ -7,5 +9,5 @@ varying vec2 v_TexCoord;
 void main() {
     //v_Color = vec4(a_TexCoord.x, a_TexCoord.y, 1, 1);
     v_TexCoord = a_TexCoord;
-    gl_Position = a_Position;
+    gl_Position = u_MVP * a_Position;
 }
\ No newline at end of file
@@ -0,0 +1,151 @@
+#include "ClockSync.h"
+#include <cmath>
+
+ClockSync::ClockSync() {
+  reset();
+}
+
+void ClockSync::reset() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _sequence = 0;
+  _pingPending = false;
+  _pingSent = Clock::time_point();
+  _lastPing = Clock::time_point::min();
+  _roundSamples = 0;
+  _roundBest = Point{0, 0};
+  _roundBestDelayNs = 0;
+  _historyCount = 0;
+  _historyNext = 0;
+  _valid = false;
+  _referenceNs = 0;
+  _offsetNs = 0;
+  _drift = 0.0;
+  _roundTripNs = 0;
+  _samples = 0;
+  _lostPings = 0;
+}
+
+ClockSync::Clock::time_point ClockSync::nextPingTime() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_lastPing == Clock::time_point::min()) {
+    return _lastPing;
+  }
+
+  // Burst until the first round completes so that the estimate is usable
+  // right after connecting, then just keep up with the drift.
+  return _lastPing + std::chrono::milliseconds(
+      _historyCount == 0 ? BURST_INTERVAL_MS : PING_INTERVAL_MS);
+}
+
+uint32_t ClockSync::pingSent(Clock::time_point sent) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_pingPending) {
+    _lostPings++;
+  }
+  _sequence++;
+  _pingPending = true;
+  _pingSent = sent;
+  _lastPing = sent;
+  return _sequence;
+}
+
+void ClockSync::pongReceived(uint32_t sequence, int64_t deviceReceived,
+    int64_t deviceHold, Clock::time_point received) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!_pingPending || sequence != _sequence) {
+    return;
+  }
+  _pingPending = false;
+
+  int64_t t1 = toNs(_pingSent);
+  int64_t t4 = toNs(received);
+  int64_t delay = (t4 - t1) - deviceHold;
+  if (deviceHold < 0 || delay < 0) {
+    return; // Impossible unless the device's clock jumped.
+  }
+
+  // Assumes the two legs took equally long; the fastest round trip is the
+  // one where that's most nearly true.
+  Point sample;
+  sample.hostNs = t1 + (t4 - t1) / 2;
+  sample.offsetNs =
+      ((deviceReceived - t1) + (deviceReceived + deviceHold - t4)) / 2;
+  _samples++;
+
+  if (_roundSamples == 0 || delay < _roundBestDelayNs) {
+    _roundBest = sample;
+    _roundBestDelayNs = delay;
+  }
+  if (++_roundSamples < ROUND_SAMPLES) {
+    return;
+  }
+
+  _history[_historyNext] = _roundBest;
+  _historyNext = (_historyNext + 1) % HISTORY_ROUNDS;
+  if (_historyCount < HISTORY_ROUNDS) {
+    _historyCount++;
+  }
+  _roundTripNs = _roundBestDelayNs;
+  _roundSamples = 0;
+  fit();
+}
+
+void ClockSync::fit() {
+  // Work relative to the newest round so that the doubles stay precise.
+  const Point& newest =
+      _history[(_historyNext + HISTORY_ROUNDS - 1) % HISTORY_ROUNDS];
+  double meanX = 0.0;
+  double meanY = 0.0;
+  for (size_t i = 0; i < _historyCount; ++i) {
+    meanX += (double) (_history[i].hostNs - newest.hostNs);
+    meanY += (double) (_history[i].offsetNs - newest.offsetNs);
+  }
+  meanX /= _historyCount;
+  meanY /= _historyCount;
+
+  double sxx = 0.0;
+  double sxy = 0.0;
+  for (size_t i = 0; i < _historyCount; ++i) {
+    double x = (double) (_history[i].hostNs - newest.hostNs) - meanX;
+    double y = (double) (_history[i].offsetNs - newest.offsetNs) - meanY;
+    sxx += x * x;
+    sxy += x * y;
+  }
+
+  _drift = sxx > 0.0 ? sxy / sxx : 0.0;
+  _referenceNs = newest.hostNs;
+  _offsetNs = newest.offsetNs + std::llround(meanY - _drift * meanX);
+  _valid = true;
+}
+
+int64_t ClockSync::offsetAt(int64_t hostNs) const {
+  return _offsetNs + std::llround(_drift * (double) (hostNs - _referenceNs));
+}
+
+int64_t ClockSync::toNs(Clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      time.time_since_epoch()).count();
+}
+
+ClockSync::Estimate ClockSync::getEstimate() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  Estimate estimate;
+  estimate.valid = _valid;
+  estimate.offsetNs = _valid ? offsetAt(toNs(Clock::now())) : 0;
+  estimate.driftPpm = _drift * 1e6;
+  estimate.roundTripNs = _roundTripNs;
+  estimate.samples = _samples;
+  estimate.lostPings = _lostPings;
+  return estimate;
+}
+
+bool ClockSync::toDeviceTime(Clock::time_point hostTime,
+    int64_t& deviceTimeNs) const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!_valid) {
+    return false;
+  }
+  int64_t hostNs = toNs(hostTime);
+  deviceTimeNs = hostNs + offsetAt(hostNs);
+  return true;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * Estimates the offset and drift between the host's steady clock and a
+ * device's clock from NTP-style pings. Each ping is stamped when the host
+ * sends it (t1), when the device receives it (t2) and replies (t3), and when
+ * the host reads the reply (t4). Queuing on either side only ever delays a
+ * sample, so each round of pings keeps only its fastest round trip, and the
+ * drift is a least-squares fit through the recent rounds' offsets.
+ */
+class ClockSync {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Estimate {
+    bool valid;          /* False until the first round of pings completes. */
+    int64_t offsetNs;    /* Device clock minus host clock, now. */
+    double driftPpm;     /* How fast the device clock gains on the host's. */
+    int64_t roundTripNs; /* Fastest round trip of the latest round. */
+    uint64_t samples;
+    uint64_t lostPings;  /* Pings that were never answered. */
+  };
+
+  ClockSync();
+
+  /** Forgets all samples, e.g. for a new connection. */
+  void reset();
+
+  /** When the next ping should be sent; quickly at first, then slowly. */
+  Clock::time_point nextPingTime() const;
+
+  /** Records a ping about to be sent at t1; returns its sequence number. */
+  uint32_t pingSent(Clock::time_point sent);
+
+  /**
+   * Records the device's reply to ping sequence, read at t4. deviceReceived
+   * is t2 in device nanoseconds and deviceHold is t3 - t2. Replies to any but
+   * the latest ping are ignored.
+   */
+  void pongReceived(uint32_t sequence, int64_t deviceReceived,
+      int64_t deviceHold, Clock::time_point received);
+
+  Estimate getEstimate() const;
+
+  /**
+   * Converts a host time to the device's clock, e.g. to stamp a frame with
+   * its capture time; false until the estimate is valid.
+   */
+  bool toDeviceTime(Clock::time_point hostTime, int64_t& deviceTimeNs) const;
+
+private:
+  static constexpr size_t ROUND_SAMPLES = 4;
+  static constexpr size_t HISTORY_ROUNDS = 32;
+  static constexpr int64_t BURST_INTERVAL_MS = 20;
+  static constexpr int64_t PING_INTERVAL_MS = 500;
+
+  /* Offset at a host time, both in nanoseconds since the host clock's epoch. */
+  struct Point {
+    int64_t hostNs;
+    int64_t offsetNs;
+  };
+
+  static int64_t toNs(Clock::time_point time);
+  void fit();
+  int64_t offsetAt(int64_t hostNs) const;
+
+  mutable std::mutex _mutex;
+  uint32_t _sequence;
+  bool _pingPending;
+  Clock::time_point _pingSent;
+  Clock::time_point _lastPing;
+
+  /* Fastest sample of the round in progress. */
+  size_t _roundSamples;
+  Point _roundBest;
+  int64_t _roundBestDelayNs;
+
+  Point _history[HISTORY_ROUNDS]; /* Ring of each round's fastest sample. */
+  size_t _historyCount;
+  size_t _historyNext;
+
+  /* offset(t) = _offsetNs + _drift * (t - _referenceNs), once fitted. */
+  bool _valid;
+  int64_t _referenceNs;
+  int64_t _offsetNs;
+  double _drift;
+  int64_t _roundTripNs;
+  uint64_t _samples;
+  uint64_t _lostPings;
+};
@@ -8,6 +8,11 @@ namespace EndianUtils {
     return boost::endian::native_to_big(x);
   }
 
+  template <typename T>
+  inline T bigToNative(T x) {
+    return boost::endian::big_to_native(x);
+  }
+
   inline float bigToNativeFloat(float x) {
     if (boost::endian::order::native == boost::endian::order::big) {
       return x;
@@ -25,4 +30,8 @@ namespace EndianUtils {
     return swapped;
   }
 
+  inline float nativeToBigFloat(float x) {
+    return bigToNativeFloat(x); // Swapping is its own inverse.
+  }
+
 }
\ No newline at end of file
@@ -0,0 +1,276 @@
+#include "FrameBuffer.h"
+#include <utility>
+#include <cstdint>
+#include <cstdlib>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <malloc.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#endif
+
+static size_t roundUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+FrameBuffer::FrameBuffer()
+    : _data(nullptr), _size(0), _mappedSize(0), _hugePage(false),
+      _heap(false), _numaNode(-1) {}
+
+FrameBuffer::~FrameBuffer() {
+  release();
+}
+
+FrameBuffer::FrameBuffer(FrameBuffer&& other) : FrameBuffer() {
+  *this = std::move(other);
+}
+
+FrameBuffer& FrameBuffer::operator=(FrameBuffer&& other) {
+  if (this != &other) {
+    release();
+    std::swap(_data, other._data);
+    std::swap(_size, other._size);
+    std::swap(_mappedSize, other._mappedSize);
+    std::swap(_hugePage, other._hugePage);
+    std::swap(_heap, other._heap);
+    std::swap(_numaNode, other._numaNode);
+  }
+  return *this;
+}
+
+/**
+ * Buffers smaller than a huge page (e.g. USB reads and chunk staging) would
+ * waste most of a mapping of their own, and a syscall or two per allocation.
+ */
+bool FrameBuffer::allocateHeap(size_t size) {
+  size_t rounded = roundUp(size, CACHE_LINE_SIZE);
+#if defined(_WIN32)
+  void* data = _aligned_malloc(rounded, CACHE_LINE_SIZE);
+  if (data == nullptr) {
+    return false;
+  }
+#else
+  void* data = nullptr;
+  if (posix_memalign(&data, CACHE_LINE_SIZE, rounded) != 0) {
+    return false;
+  }
+#endif
+
+  _data = static_cast<unsigned char*>(data);
+  _size = size;
+  _mappedSize = rounded;
+  _heap = true;
+  _numaNode = currentNumaNode();
+  return true;
+}
+
+void FrameBuffer::releaseHeap() {
+#if defined(_WIN32)
+  _aligned_free(_data);
+#else
+  std::free(_data);
+#endif
+}
+
+#if defined(_WIN32)
+
+int FrameBuffer::currentNumaNode() {
+  PROCESSOR_NUMBER processor;
+  GetCurrentProcessorNumberEx(&processor);
+
+  USHORT node;
+  if (!GetNumaProcessorNodeEx(&processor, &node)) {
+    return -1;
+  }
+  return node;
+}
+
+bool FrameBuffer::allocate(size_t size) {
+  release();
+  if (size == 0) {
+    return true;
+  }
+
+  if (size < HUGE_PAGE_SIZE) {
+    return allocateHeap(size);
+  }
+
+  int node = currentNumaNode();
+  DWORD preferred = node >= 0 ? (DWORD) node : NUMA_NO_PREFERRED_NODE;
+
+  // Large pages need SeLockMemoryPrivilege; quietly fall back without it.
+  size_t largePage = GetLargePageMinimum();
+  void* data = nullptr;
+  size_t mapped = 0;
+  if (largePage != 0) {
+    mapped = roundUp(size, largePage);
+    data = VirtualAllocExNuma(GetCurrentProcess(), nullptr, mapped,
+        MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, preferred);
+    _hugePage = data != nullptr;
+  }
+  if (data == nullptr) {
+    mapped = roundUp(size, CACHE_LINE_SIZE);
+    data = VirtualAllocExNuma(GetCurrentProcess(), nullptr, mapped,
+        MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, preferred);
+  }
+  if (data == nullptr) {
+    return false;
+  }
+
+  _data = static_cast<unsigned char*>(data);
+  _size = size;
+  _mappedSize = mapped;
+  _numaNode = node;
+
+  // Fault the pages in now, from the thread that will use them.
+  for (size_t i = 0; i < _mappedSize; i += 4096) {
+    _data[i] = 0;
+  }
+  return true;
+}
+
+void FrameBuffer::release() {
+  if (_heap) {
+    releaseHeap();
+  } else if (_data != nullptr) {
+    VirtualFree(_data, 0, MEM_RELEASE);
+  }
+  _data = nullptr;
+  _size = 0;
+  _mappedSize = 0;
+  _hugePage = false;
+  _heap = false;
+  _numaNode = -1;
+}
+
+#elif defined(__linux__)
+
+int FrameBuffer::currentNumaNode() {
+  unsigned cpu;
+  unsigned node;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+    return -1;
+  }
+  return (int) node;
+}
+
+/**
+ * Maps size bytes aligned to alignment by over-mapping and trimming the ends,
+ * so that transparent huge pages can cover the whole buffer.
+ */
+static void* mapAligned(size_t size, size_t alignment) {
+  size_t padded = size + alignment;
+  void* base = mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    return nullptr;
+  }
+
+  uintptr_t start = reinterpret_cast<uintptr_t>(base);
+  uintptr_t aligned = roundUp(start, alignment);
+  size_t head = aligned - start;
+  size_t tail = padded - head - size;
+  if (head > 0) {
+    munmap(base, head);
+  }
+  if (tail > 0) {
+    munmap(reinterpret_cast<void*>(aligned + size), tail);
+  }
+  return reinterpret_cast<void*>(aligned);
+}
+
+bool FrameBuffer::allocate(size_t size) {
+  release();
+  if (size == 0) {
+    return true;
+  }
+
+  if (size < HUGE_PAGE_SIZE) {
+    return allocateHeap(size);
+  }
+
+  // Explicit huge pages only work if the admin has reserved some
+  // (vm.nr_hugepages); otherwise ask for transparent huge pages.
+  size_t mapped = roundUp(size, HUGE_PAGE_SIZE);
+  void* data = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (data != MAP_FAILED) {
+    _hugePage = true;
+  } else {
+    data = mapAligned(mapped, HUGE_PAGE_SIZE);
+    if (data != nullptr) {
+      _hugePage = madvise(data, mapped, MADV_HUGEPAGE) == 0;
+    }
+  }
+  if (data == nullptr || data == MAP_FAILED) {
+    _hugePage = false;
+    return false;
+  }
+
+  // Prefer the calling thread's node (rather than binding strictly, which
+  // would fail allocations on a full node). This must precede the first touch.
+  int node = currentNumaNode();
+  if (node >= 0 && node < (int) (sizeof(unsigned long) * 8)) {
+    unsigned long nodeMask = 1UL << node;
+    syscall(SYS_mbind, data, mapped, MPOL_PREFERRED, &nodeMask,
+        sizeof(nodeMask) * 8, 0);
+  }
+
+  _data = static_cast<unsigned char*>(data);
+  _size = size;
+  _mappedSize = mapped;
+  _numaNode = node;
+
+  // Fault the pages in now, from the thread that will use them.
+  for (size_t i = 0; i < _mappedSize; i += 4096) {
+    _data[i] = 0;
+  }
+  return true;
+}
+
+void FrameBuffer::release() {
+  if (_heap) {
+    releaseHeap();
+  } else if (_data != nullptr) {
+    munmap(_data, _mappedSize);
+  }
+  _data = nullptr;
+  _size = 0;
+  _mappedSize = 0;
+  _hugePage = false;
+  _heap = false;
+  _numaNode = -1;
+}
+
+#else
+
+int FrameBuffer::currentNumaNode() {
+  return -1;
+}
+
+bool FrameBuffer::allocate(size_t size) {
+  release();
+  if (size == 0) {
+    return true;
+  }
+  return allocateHeap(size);
+}
+
+void FrameBuffer::release() {
+  if (_heap) {
+    releaseHeap();
+  }
+  _data = nullptr;
+  _size = 0;
+  _mappedSize = 0;
+  _hugePage = false;
+  _heap = false;
+  _numaNode = -1;
+}
+
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+
+/**
+ * An allocator for per-frame data. Buffers of at least a huge page are mapped
+ * on their own, backed by 2 MB pages where the OS allows it (falling back to
+ * transparent huge pages or normal pages), and placed on the NUMA node of the
+ * thread that allocates them. Smaller buffers come from the heap, aligned to
+ * a cache line, and land on that node by first touch. Nothing is pooled: each
+ * buffer is freed when it's released, so allocate buffers once per stream,
+ * from the thread that is going to fill them.
+ */
+class FrameBuffer {
+public:
+  static constexpr size_t CACHE_LINE_SIZE = 64;
+  static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+  FrameBuffer();
+  ~FrameBuffer();
+
+  FrameBuffer(FrameBuffer&& other);
+  FrameBuffer& operator=(FrameBuffer&& other);
+  FrameBuffer(const FrameBuffer&) = delete;
+  FrameBuffer& operator=(const FrameBuffer&) = delete;
+
+  /**
+   * Replaces any existing allocation with one of at least size bytes. The
+   * pages are faulted in immediately so that the first frame doesn't pay for
+   * them. Returns false if the allocation fails.
+   */
+  bool allocate(size_t size);
+  void release();
+
+  unsigned char* data() const { return _data; }
+  size_t size() const { return _size; }
+  bool isHugePage() const { return _hugePage; }
+  int numaNode() const { return _numaNode; }
+
+  /** The NUMA node of the calling thread's current CPU, or -1 if unknown. */
+  static int currentNumaNode();
+
+private:
+  unsigned char* _data;
+  size_t _size;
+  size_t _mappedSize;
+  bool _hugePage;
+  bool _heap; /* From allocateHeap rather than mapped. */
+  int _numaNode;
+
+  bool allocateHeap(size_t size);
+  void releaseHeap();
+};
@@ -0,0 +1,127 @@
+#include "FramePacer.h"
+#include <algorithm>
+#include <cmath>
+
+FramePacer::FramePacer(double targetRate)
+    : _targetRate(0.0),
+      _interval(Clock::duration::zero()),
+      _started(false),
+      _transmitEstimate(Clock::duration::zero()),
+      _frames(0),
+      _intervals(0),
+      _idleGaps(0),
+      _lateFrames(0),
+      _meanIntervalMs(0.0),
+      _intervalM2(0.0),
+      _maxDeviationMs(0.0) {
+  setTargetRate(targetRate);
+}
+
+void FramePacer::setTargetRate(double targetRate) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _targetRate = std::max(targetRate, 0.0);
+  _interval = _targetRate > 0.0
+      ? std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(1.0 / _targetRate))
+      : Clock::duration::zero();
+  _started = false;
+}
+
+double FramePacer::getTargetRate() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _targetRate;
+}
+
+FramePacer::Clock::time_point FramePacer::nextSendTime() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!_started || _interval == Clock::duration::zero()) {
+    return Clock::time_point::min();
+  }
+  return _nextArrival - _transmitEstimate;
+}
+
+void FramePacer::frameSent(Clock::time_point start, Clock::time_point end) {
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  // Exponentially-weighted estimate of how long a transmit takes.
+  Clock::duration transmit = end - start;
+  if (_transmitEstimate == Clock::duration::zero()) {
+    _transmitEstimate = transmit;
+  } else {
+    _transmitEstimate += std::chrono::duration_cast<Clock::duration>(
+        (transmit - _transmitEstimate) * TRANSMIT_SMOOTHING);
+  }
+
+  double intervalMs = std::chrono::duration<double, std::milli>(
+      end - _lastArrival).count();
+  double idleMs = _interval != Clock::duration::zero()
+      ? IDLE_INTERVALS *
+          std::chrono::duration<double, std::milli>(_interval).count()
+      : IDLE_GAP_MS;
+  bool idle = _frames > 0 && intervalMs > idleMs;
+  if (idle) {
+    _idleGaps++;
+  } else if (_frames > 0) {
+    // Welford's online mean/variance of the arrival interval.
+    uint64_t n = ++_intervals;
+    double delta = intervalMs - _meanIntervalMs;
+    _meanIntervalMs += delta / n;
+    _intervalM2 += delta * (intervalMs - _meanIntervalMs);
+
+    if (_interval != Clock::duration::zero()) {
+      double targetMs =
+          std::chrono::duration<double, std::milli>(_interval).count();
+      _maxDeviationMs =
+          std::max(_maxDeviationMs, std::abs(intervalMs - targetMs));
+    }
+  }
+  _frames++;
+  _lastArrival = end;
+
+  if (_interval == Clock::duration::zero()) {
+    return;
+  }
+
+  // After a pause, the schedule starts over from this frame.
+  if (idle) {
+    _started = false;
+  }
+  if (_started && end > _nextArrival + _interval / 2) {
+    _lateFrames++;
+  }
+
+  // Keep to the schedule, but don't burst to catch up after falling behind
+  // (e.g. when Maya didn't produce a frame in time); restart from now.
+  if (_started && end <= _nextArrival + _interval / 2) {
+    _nextArrival += _interval;
+  } else {
+    _nextArrival = end + _interval;
+  }
+  _started = true;
+}
+
+FramePacer::Stats FramePacer::getStats() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  Stats stats;
+  stats.frames = _frames;
+  stats.idleGaps = _idleGaps;
+  stats.lateFrames = _lateFrames;
+  stats.meanIntervalMs = _meanIntervalMs;
+  stats.jitterMs =
+      _intervals > 1 ? std::sqrt(_intervalM2 / (_intervals - 1)) : 0.0;
+  stats.maxDeviationMs = _maxDeviationMs;
+  return stats;
+}
+
+void FramePacer::reset() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _started = false;
+  _transmitEstimate = Clock::duration::zero();
+  _frames = 0;
+  _intervals = 0;
+  _idleGaps = 0;
+  _lateFrames = 0;
+  _meanIntervalMs = 0.0;
+  _intervalM2 = 0.0;
+  _maxDeviationMs = 0.0;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * Schedules frame transmits at a fixed target rate. The pacer learns how long
+ * a transmit takes and starts each one early by that amount, so that frames
+ * finish arriving on the receiver at evenly-spaced times. It also keeps
+ * statistics on the actual arrival intervals. A gap of more than IDLE_INTERVALS
+ * target intervals (IDLE_GAP_MS when unpaced) means Maya had nothing to send,
+ * not that a frame was late, so it isn't counted; the next frame starts a new
+ * run of intervals.
+ */
+class FramePacer {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Stats {
+    uint64_t frames;
+    uint64_t idleGaps;     /* Pauses left out of the interval statistics. */
+    uint64_t lateFrames;   /* Arrived more than half an interval late. */
+    double meanIntervalMs;
+    double jitterMs;       /* Standard deviation of the arrival interval. */
+    double maxDeviationMs; /* Worst deviation from the target interval. */
+  };
+
+  /** A target rate of zero disables pacing; frames are sent immediately. */
+  explicit FramePacer(double targetRate = 0.0);
+
+  void setTargetRate(double targetRate);
+  double getTargetRate() const;
+
+  /** When the next transmit should start. */
+  Clock::time_point nextSendTime() const;
+
+  /** Records a completed transmit and schedules the next one. */
+  void frameSent(Clock::time_point start, Clock::time_point end);
+
+  Stats getStats() const;
+  void reset();
+
+private:
+  static constexpr double TRANSMIT_SMOOTHING = 0.125;
+  static constexpr int IDLE_INTERVALS = 4;
+  static constexpr double IDLE_GAP_MS = 250.0;
+
+  mutable std::mutex _mutex;
+  double _targetRate;
+  Clock::duration _interval;
+  bool _started;
+  Clock::time_point _nextArrival;
+  Clock::time_point _lastArrival;
+  Clock::duration _transmitEstimate;
+
+  uint64_t _frames;
+  uint64_t _intervals; /* Arrival intervals in the statistics. */
+  uint64_t _idleGaps;
+  uint64_t _lateFrames;
+  double _meanIntervalMs;
+  double _intervalM2;
+  double _maxDeviationMs;
+};
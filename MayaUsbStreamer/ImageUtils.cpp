@@ -0,0 +1,1403 @@
+#include "ImageUtils.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMAGEUTILS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace ImageUtils {
+
+  /*
+   * Each row kernel takes a pair of source rows and writes one row of each
+   * eye. In a 2x2 block, the left eye owns the top-left and bottom-right
+   * pixels and the right eye owns the other two; the eye's pixel is their
+   * average.
+   */
+  using DecomposeRowFunc = void(const unsigned char* row0,
+      const unsigned char* row1, size_t blocks, unsigned char* lDest,
+      unsigned char* rDest);
+
+  /* Sum of two samples in [0, 1] to a byte, saturating like the SIMD path. */
+  static inline unsigned char floatSumToByte(float sum) {
+    float value = sum * 127.999f;
+    if (!(value > 0.0f)) {
+      return 0; // Also catches NaN.
+    }
+    return value >= 255.0f ? 255 : (unsigned char) value;
+  }
+
+  /*
+   * sRGB encoding without a LUT, so the SIMD path needs no lookups. Works on
+   * the sum of two samples directly: in the linear toe the code is a multiple
+   * of the sum, and above it 255 (1.055 x^(1/2.4) - 0.055) is a smooth
+   * function of sqrt(sum) that a degree-4 minimax polynomial matches to within
+   * 0.2 of a code. The 0.5 that rounds is folded into both. Both paths
+   * evaluate it in the same order so they agree bit for bit.
+   */
+  static constexpr float SRGB_MAX_SUM = 2.0f;
+  static constexpr float SRGB_TOE_SUM = 2.0f * 0.0031308f;
+  static constexpr float SRGB_TOE_SLOPE = 255.0f * 12.92f / 2.0f;
+  static constexpr float SRGB_C0 = -8.936189696e+00f;
+  static constexpr float SRGB_C1 = 2.610739567e+02f;
+  static constexpr float SRGB_C2 = -1.204697670e+02f;
+  static constexpr float SRGB_C3 = 7.598277432e+01f;
+  static constexpr float SRGB_C4 = -1.973520613e+01f;
+
+  /* Sum of two linear samples to an sRGB-encoded byte. */
+  static inline unsigned char floatSumToSrgbByte(float sum) {
+    if (!(sum > SRGB_TOE_SUM)) {
+      // Also catches NaN.
+      return sum > 0.0f ? (unsigned char) (sum * SRGB_TOE_SLOPE + 0.5f) : 0;
+    }
+    float u = std::sqrt(std::min(sum, SRGB_MAX_SUM));
+    float value = SRGB_C4 * u + SRGB_C3;
+    value = value * u + SRGB_C2;
+    value = value * u + SRGB_C1;
+    value = value * u + SRGB_C0;
+    return (unsigned char) value; // At most 255.7.
+  }
+
+  /*
+   * Quantizers turn sums of two float samples into bytes for the float row
+   * kernels; the kernels are instantiated once per quantizer so the choice
+   * costs nothing per pixel.
+   */
+  struct LinearQuantizer {
+    LinearQuantizer() {}
+    unsigned char operator()(float sum) const { return floatSumToByte(sum); }
+  };
+
+  struct SrgbQuantizer {
+    SrgbQuantizer() {}
+    unsigned char operator()(float sum) const {
+      return floatSumToSrgbByte(sum);
+    }
+  };
+
+  static inline float loadFloat(const unsigned char* p) {
+    float value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  static inline uint16_t loadHalf(const unsigned char* p) {
+    uint16_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  static inline uint32_t loadUint32(const unsigned char* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  /*
+   * Half to float by rebiasing the exponent with a multiply, which also gets
+   * denormals right; infinities and NaNs are patched up separately.
+   */
+  static inline float halfToFloat(uint16_t h) {
+    static const float magic = [] {
+      uint32_t bits = (254 - 15) << 23;
+      float f;
+      std::memcpy(&f, &bits, sizeof(f));
+      return f;
+    }();
+
+    uint32_t expMant = h & 0x7fffu;
+    uint32_t bits = expMant << 13;
+    float scaled;
+    std::memcpy(&scaled, &bits, sizeof(scaled));
+    scaled *= magic;
+    std::memcpy(&bits, &scaled, sizeof(bits));
+    if (expMant > 0x7bffu) {
+      bits |= 255u << 23;
+    }
+    bits |= (uint32_t) (h & 0x8000u) << 16;
+
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+#ifdef IMAGEUTILS_SSE2
+
+  /* Four halves, zero-extended into 32-bit lanes, to floats. */
+  static inline __m128 halfToFloat(__m128i h) {
+    const __m128i maskNoSign = _mm_set1_epi32(0x7fff);
+    const __m128 magic = _mm_castsi128_ps(_mm_set1_epi32((254 - 15) << 23));
+    const __m128i wasInfNan = _mm_set1_epi32(0x7bff);
+    const __m128 expInfNan = _mm_castsi128_ps(_mm_set1_epi32(255 << 23));
+
+    __m128i expMant = _mm_and_si128(maskNoSign, h);
+    __m128i justSign = _mm_xor_si128(h, expMant);
+    __m128 scaled = _mm_mul_ps(
+        _mm_castsi128_ps(_mm_slli_epi32(expMant, 13)), magic);
+    __m128 infNan = _mm_and_ps(
+        _mm_castsi128_ps(_mm_cmpgt_epi32(expMant, wasInfNan)), expInfNan);
+    __m128 sign = _mm_castsi128_ps(_mm_slli_epi32(justSign, 16));
+    return _mm_or_ps(scaled, _mm_or_ps(sign, infNan));
+  }
+
+  /*
+   * Four pixels of summed float samples to 16 bytes, clamped the same way as
+   * floatSumToByte. The clamp comes before the conversion: _mm_cvttps_epi32
+   * turns infinities and anything from 2^31 up into 0x80000000, which the
+   * packs would saturate to 0. _mm_max_ps returns its second operand for
+   * NaN, mapping it to zero.
+   */
+  static inline __m128i floatSumToInts(__m128 p) {
+    const __m128 scale = _mm_set1_ps(127.999f);
+    const __m128 maxValue = _mm_set1_ps(255.0f);
+    return _mm_cvttps_epi32(_mm_min_ps(
+        _mm_max_ps(_mm_mul_ps(p, scale), _mm_setzero_ps()), maxValue));
+  }
+
+  static inline __m128i floatSumsToBytes(__m128 p0, __m128 p1, __m128 p2,
+      __m128 p3) {
+    return _mm_packus_epi16(
+        _mm_packs_epi32(floatSumToInts(p0), floatSumToInts(p1)),
+        _mm_packs_epi32(floatSumToInts(p2), floatSumToInts(p3)));
+  }
+
+  static inline __m128i toBytes(const LinearQuantizer&, __m128 p0, __m128 p1,
+      __m128 p2, __m128 p3) {
+    return floatSumsToBytes(p0, p1, p2, p3);
+  }
+
+  /* Four sums to sRGB codes, as floatSumToSrgbByte does one. */
+  static inline __m128i floatSumToSrgbInts(__m128 p) {
+    // _mm_max_ps returns its second operand for NaN, mapping it to zero.
+    __m128 sum = _mm_min_ps(_mm_max_ps(p, _mm_setzero_ps()),
+        _mm_set1_ps(SRGB_MAX_SUM));
+    __m128 toe = _mm_add_ps(_mm_mul_ps(sum, _mm_set1_ps(SRGB_TOE_SLOPE)),
+        _mm_set1_ps(0.5f));
+    __m128 u = _mm_sqrt_ps(sum);
+    __m128 value = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(SRGB_C4), u),
+        _mm_set1_ps(SRGB_C3));
+    value = _mm_add_ps(_mm_mul_ps(value, u), _mm_set1_ps(SRGB_C2));
+    value = _mm_add_ps(_mm_mul_ps(value, u), _mm_set1_ps(SRGB_C1));
+    value = _mm_add_ps(_mm_mul_ps(value, u), _mm_set1_ps(SRGB_C0));
+
+    __m128 inToe = _mm_cmple_ps(sum, _mm_set1_ps(SRGB_TOE_SUM));
+    return _mm_cvttps_epi32(_mm_or_ps(_mm_and_ps(inToe, toe),
+        _mm_andnot_ps(inToe, value)));
+  }
+
+  static inline __m128i toBytes(const SrgbQuantizer&, __m128 p0, __m128 p1,
+      __m128 p2, __m128 p3) {
+    return _mm_packus_epi16(
+        _mm_packs_epi32(floatSumToSrgbInts(p0), floatSumToSrgbInts(p1)),
+        _mm_packs_epi32(floatSumToSrgbInts(p2), floatSumToSrgbInts(p3)));
+  }
+
+  /*
+   * Store policies for the 16-byte destination writes. Streaming stores skip
+   * the read-for-ownership of each destination line, which is wasted traffic
+   * when the output is bigger than the cache; they need 16-byte alignment.
+   */
+  struct CachedStore {
+    static inline void store(unsigned char* p, __m128i v) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+    }
+    static inline void finish() {}
+  };
+
+  struct StreamingStore {
+    static inline void store(unsigned char* p, __m128i v) {
+      _mm_stream_si128(reinterpret_cast<__m128i*>(p), v);
+    }
+    static inline void finish() { _mm_sfence(); }
+  };
+
+  /*
+   * Requests the source bytes that a kernel will need PREFETCH_DISTANCE bytes
+   * from now, a line at a time. The hardware prefetcher tracks the two source
+   * streams too, but stops at 4 KB page boundaries.
+   */
+  static constexpr size_t PREFETCH_DISTANCE = 1024;
+
+  template <size_t bytes>
+  static inline void prefetchAhead(const unsigned char* p) {
+    for (size_t i = 0; i < bytes; i += 64) {
+      _mm_prefetch(reinterpret_cast<const char*>(p + PREFETCH_DISTANCE + i),
+          _MM_HINT_T0);
+    }
+  }
+
+  /*
+   * Given four 32-bit pixels of each source row (two blocks), pairs every
+   * pixel of row0 with the pixel of row1 that shares its eye.
+   */
+  static inline __m128i swapPixelPairs(__m128i row1) {
+    return _mm_shuffle_epi32(row1, _MM_SHUFFLE(2, 3, 0, 1));
+  }
+
+  /*
+   * Splits two vectors of per-block results laid out (L0, R0, L1, R1) and
+   * (L2, R2, L3, R3) into (L0..L3) and (R0..R3).
+   */
+  static inline void splitEyes(__m128i a, __m128i b, __m128i& l, __m128i& r) {
+    a = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+    b = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0));
+    l = _mm_unpacklo_epi64(a, b);
+    r = _mm_unpackhi_epi64(a, b);
+  }
+
+  static inline __m128i swapRedBlue(__m128i x) {
+    const __m128i ga = _mm_set1_epi32(0xff00ff00);
+    const __m128i rb = _mm_set1_epi32(0x00ff00ff);
+    __m128i redBlue = _mm_and_si128(x, rb);
+    return _mm_or_si128(_mm_and_si128(x, ga),
+        _mm_or_si128(_mm_slli_epi32(redBlue, 16),
+            _mm_srli_epi32(redBlue, 16)));
+  }
+
+#else
+
+  struct CachedStore {
+    static inline void finish() {}
+  };
+
+  struct StreamingStore {
+    static inline void finish() {}
+  };
+
+#endif
+
+  template <typename Quantizer, typename Store>
+  static void decomposeRowRgba32f(const unsigned char* row0,
+      const unsigned char* row1, size_t blocks, unsigned char* lDest,
+      unsigned char* rDest) {
+    const Quantizer quantize;
+    const size_t pixelBytes = 4 * sizeof(float);
+    size_t b = 0;
+
+#ifdef IMAGEUTILS_SSE2
+    for (; b + 4 <= blocks; b += 4) {
+      prefetchAhead<8 * 4 * sizeof(float)>(row0 + b * 2 * pixelBytes);
+      prefetchAhead<8 * 4 * sizeof(float)>(row1 + b * 2 * pixelBytes);
+
+      __m128 l[4];
+      __m128 r[4];
+      for (size_t i = 0; i < 4; ++i) {
+        const float* top = reinterpret_cast<const float*>(
+            row0 + (b + i) * 2 * pixelBytes);
+        const float* bottom = reinterpret_cast<const float*>(
+            row1 + (b + i) * 2 * pixelBytes);
+        l[i] = _mm_add_ps(_mm_loadu_ps(top), _mm_loadu_ps(bottom + 4));
+        r[i] = _mm_add_ps(_mm_loadu_ps(top + 4), _mm_loadu_ps(bottom));
+      }
+      Store::store(lDest + b * DEST_COMPS,
+          toBytes(quantize, l[0], l[1], l[2], l[3]));
+      Store::store(rDest + b * DEST_COMPS,
+          toBytes(quantize, r[0], r[1], r[2], r[3]));
+    }
+#endif
+
+    for (; b < blocks; ++b) {
+      const unsigned char* top = row0 + b * 2 * pixelBytes;
+      const unsigned char* bottom = row1 + b * 2 * pixelBytes;
+      for (size_t c = 0; c < 3; ++c) {
+        size_t offset = c * sizeof(float);
+        lDest[b * DEST_COMPS + c] = quantize(loadFloat(top + offset) +
+            loadFloat(bottom + pixelBytes + offset));
+        rDest[b * DEST_COMPS + c] = quantize(
+            loadFloat(top + pixelBytes + offset) + loadFloat(bottom + offset));
+      }
+    }
+  }
+
+  template <typename Quantizer, typename Store>
+  static void decomposeRowRgba16f(const unsigned char* row0,
+      const unsigned char* row1, size_t blocks, unsigned char* lDest,
+      unsigned char* rDest) {
+    const Quantizer quantize;
+    const size_t pixelBytes = 4 * sizeof(uint16_t);
+    size_t b = 0;
+
+#ifdef IMAGEUTILS_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; b + 4 <= blocks; b += 4) {
+      prefetchAhead<8 * 4 * sizeof(uint16_t)>(row0 + b * 2 * pixelBytes);
+      prefetchAhead<8 * 4 * sizeof(uint16_t)>(row1 + b * 2 * pixelBytes);
+
+      __m128 l[4];
+      __m128 r[4];
+      for (size_t i = 0; i < 4; ++i) {
+        // One load covers both pixels of the block in a row.
+        __m128i top = _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+            row0 + (b + i) * 2 * pixelBytes));
+        __m128i bottom = _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+            row1 + (b + i) * 2 * pixelBytes));
+        l[i] = _mm_add_ps(halfToFloat(_mm_unpacklo_epi16(top, zero)),
+            halfToFloat(_mm_unpackhi_epi16(bottom, zero)));
+        r[i] = _mm_add_ps(halfToFloat(_mm_unpackhi_epi16(top, zero)),
+            halfToFloat(_mm_unpacklo_epi16(bottom, zero)));
+      }
+      Store::store(lDest + b * DEST_COMPS,
+          toBytes(quantize, l[0], l[1], l[2], l[3]));
+      Store::store(rDest + b * DEST_COMPS,
+          toBytes(quantize, r[0], r[1], r[2], r[3]));
+    }
+#endif
+
+    for (; b < blocks; ++b) {
+      const unsigned char* top = row0 + b * 2 * pixelBytes;
+      const unsigned char* bottom = row1 + b * 2 * pixelBytes;
+      for (size_t c = 0; c < 3; ++c) {
+        size_t offset = c * sizeof(uint16_t);
+        lDest[b * DEST_COMPS + c] = quantize(
+            halfToFloat(loadHalf(top + offset)) +
+            halfToFloat(loadHalf(bottom + pixelBytes + offset)));
+        rDest[b * DEST_COMPS + c] = quantize(
+            halfToFloat(loadHalf(top + pixelBytes + offset)) +
+            halfToFloat(loadHalf(bottom + offset)));
+      }
+    }
+  }
+
+  template <typename Quantizer, typename Store>
+  static void decomposeRowRgb32f(const unsigned char* row0,
+      const unsigned char* row1, size_t blocks, unsigned char* lDest,
+      unsigned char* rDest) {
+    // 12-byte pixels don't map onto vector loads without reading past the end
+    // of the image, and this format is rare, so it stays scalar.
+    const Quantizer quantize;
+    const size_t pixelBytes = 3 * sizeof(float);
+    for (size_t b = 0; b < blocks; ++b) {
+      const unsigned char* top = row0 + b * 2 * pixelBytes;
+      const unsigned char* bottom = row1 + b * 2 * pixelBytes;
+      for (size_t c = 0; c < 3; ++c) {
+        size_t offset = c * sizeof(float);
+        lDest[b * DEST_COMPS + c] = quantize(loadFloat(top + offset) +
+            loadFloat(bottom + pixelBytes + offset));
+        rDest[b * DEST_COMPS + c] = quantize(
+            loadFloat(top + pixelBytes + offset) + loadFloat(bottom + offset));
+      }
+    }
+  }
+
+  template <bool swapRB, typename Store>
+  static void decomposeRow8(const unsigned char* row0,
+      const unsigned char* row1, size_t blocks, unsigned char* lDest,
+      unsigned char* rDest) {
+    const size_t pixelBytes = 4;
+    size_t b = 0;
+
+#ifdef IMAGEUTILS_SSE2
+    for (; b + 4 <= blocks; b += 4) {
+      const unsigned char* top = row0 + b * 2 * pixelBytes;
+      const unsigned char* bottom = row1 + b * 2 * pixelBytes;
+      prefetchAhead<32>(top);
+      prefetchAhead<32>(bottom);
+
+      __m128i avg[2];
+      for (size_t i = 0; i < 2; ++i) {
+        __m128i t = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(top + i * 16));
+        __m128i u = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(bottom + i * 16));
+        avg[i] = _mm_avg_epu8(t, swapPixelPairs(u));
+      }
+
+      __m128i l;
+      __m128i r;
+      splitEyes(avg[0], avg[1], l, r);
+      if (swapRB) {
+        l = swapRedBlue(l);
+        r = swapRedBlue(r);
+      }
+      Store::store(lDest + b * DEST_COMPS, l);
+      Store::store(rDest + b * DEST_COMPS, r);
+    }
+#endif
+
+    // Rounds like _mm_avg_epu8 so both paths give identical output.
+    for (; b < blocks; ++b) {
+      const unsigned char* top = row0 + b * 2 * pixelBytes;
+      const unsigned char* bottom = row1 + b * 2 * pixelBytes;
+      for (size_t c = 0; c < 3; ++c) {
+        size_t src = swapRB ? 2 - c : c;
+        lDest[b * DEST_COMPS + c] =
+            (top[src] + bottom[pixelBytes + src] + 1) / 2;
+        rDest[b * DEST_COMPS + c] =
+            (top[pixelBytes + src] + bottom[src] + 1) / 2;
+      }
+    }
+  }
+
+  static inline uint32_t sumRgb10ToRgbx(uint32_t a, uint32_t b) {
+    uint32_t red = ((a & 0x3ffu) + (b & 0x3ffu)) >> 3;
+    uint32_t green = (((a >> 10) & 0x3ffu) + ((b >> 10) & 0x3ffu)) >> 3;
+    uint32_t blue = (((a >> 20) & 0x3ffu) + ((b >> 20) & 0x3ffu)) >> 3;
+    return red | (green << 8) | (blue << 16);
+  }
+
+#ifdef IMAGEUTILS_SSE2
+
+  static inline __m128i sumRgb10ToRgbx(__m128i a, __m128i b) {
+    const __m128i mask = _mm_set1_epi32(0x3ff);
+    __m128i red = _mm_srli_epi32(_mm_add_epi32(
+        _mm_and_si128(a, mask), _mm_and_si128(b, mask)), 3);
+    __m128i green = _mm_srli_epi32(_mm_add_epi32(
+        _mm_and_si128(_mm_srli_epi32(a, 10), mask),
+        _mm_and_si128(_mm_srli_epi32(b, 10), mask)), 3);
+    __m128i blue = _mm_srli_epi32(_mm_add_epi32(
+        _mm_and_si128(_mm_srli_epi32(a, 20), mask),
+        _mm_and_si128(_mm_srli_epi32(b, 20), mask)), 3);
+    return _mm_or_si128(red, _mm_or_si128(
+        _mm_slli_epi32(green, 8), _mm_slli_epi32(blue, 16)));
+  }
+
+#endif
+
+  template <typename Store>
+  static void decomposeRowRgb10a2(const unsigned char* row0,
+      const unsigned char* row1, size_t blocks, unsigned char* lDest,
+      unsigned char* rDest) {
+    const size_t pixelBytes = 4;
+    size_t b = 0;
+
+#ifdef IMAGEUTILS_SSE2
+    for (; b + 4 <= blocks; b += 4) {
+      const unsigned char* top = row0 + b * 2 * pixelBytes;
+      const unsigned char* bottom = row1 + b * 2 * pixelBytes;
+      prefetchAhead<32>(top);
+      prefetchAhead<32>(bottom);
+
+      __m128i sum[2];
+      for (size_t i = 0; i < 2; ++i) {
+        __m128i t = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(top + i * 16));
+        __m128i u = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(bottom + i * 16));
+        sum[i] = sumRgb10ToRgbx(t, swapPixelPairs(u));
+      }
+
+      __m128i l;
+      __m128i r;
+      splitEyes(sum[0], sum[1], l, r);
+      Store::store(lDest + b * DEST_COMPS, l);
+      Store::store(rDest + b * DEST_COMPS, r);
+    }
+#endif
+
+    for (; b < blocks; ++b) {
+      const unsigned char* top = row0 + b * 2 * pixelBytes;
+      const unsigned char* bottom = row1 + b * 2 * pixelBytes;
+      uint32_t l = sumRgb10ToRgbx(loadUint32(top),
+          loadUint32(bottom + pixelBytes));
+      uint32_t r = sumRgb10ToRgbx(loadUint32(top + pixelBytes),
+          loadUint32(bottom));
+      std::memcpy(lDest + b * DEST_COMPS, &l, sizeof(l));
+      std::memcpy(rDest + b * DEST_COMPS, &r, sizeof(r));
+    }
+  }
+
+  size_t bytesPerPixel(PixelFormat format) {
+    switch (format) {
+      case PixelFormat::RGBA32F: return 4 * sizeof(float);
+      case PixelFormat::RGBA16F: return 4 * sizeof(uint16_t);
+      case PixelFormat::RGB32F: return 3 * sizeof(float);
+      case PixelFormat::RGBA8: return 4;
+      case PixelFormat::BGRA8: return 4;
+      case PixelFormat::RGB10A2: return 4;
+    }
+    return 0;
+  }
+
+  const char* formatName(PixelFormat format) {
+    switch (format) {
+      case PixelFormat::RGBA32F: return "RGBA32F";
+      case PixelFormat::RGBA16F: return "RGBA16F";
+      case PixelFormat::RGB32F: return "RGB32F";
+      case PixelFormat::RGBA8: return "RGBA8";
+      case PixelFormat::BGRA8: return "BGRA8";
+      case PixelFormat::RGB10A2: return "RGB10A2";
+    }
+    return "unknown";
+  }
+
+  template <typename Quantizer, typename Store>
+  static DecomposeRowFunc* floatRowFunc(PixelFormat format) {
+    switch (format) {
+      case PixelFormat::RGBA32F: return decomposeRowRgba32f<Quantizer, Store>;
+      case PixelFormat::RGBA16F: return decomposeRowRgba16f<Quantizer, Store>;
+      case PixelFormat::RGB32F: return decomposeRowRgb32f<Quantizer, Store>;
+      default: return nullptr;
+    }
+  }
+
+  template <typename Store>
+  static DecomposeRowFunc* rowFunc(PixelFormat format,
+      ColorTransform transform) {
+    switch (format) {
+      case PixelFormat::RGBA32F:
+      case PixelFormat::RGBA16F:
+      case PixelFormat::RGB32F:
+        return transform == ColorTransform::Srgb
+            ? floatRowFunc<SrgbQuantizer, Store>(format)
+            : floatRowFunc<LinearQuantizer, Store>(format);
+      case PixelFormat::RGBA8: return decomposeRow8<false, Store>;
+      case PixelFormat::BGRA8: return decomposeRow8<true, Store>;
+      case PixelFormat::RGB10A2: return decomposeRowRgb10a2<Store>;
+    }
+    return nullptr;
+  }
+
+  /*
+   * Full-range BT.601 as used by JFIF, in the same 16-bit fixed point as
+   * libjpeg. Chroma takes the sums of a 2x2 block of RGB, hence the extra two
+   * bits of shift.
+   */
+  static inline unsigned char rgbToY(int r, int g, int b) {
+    return (unsigned char) ((19595 * r + 38470 * g + 7471 * b + 32768) >> 16);
+  }
+
+  static inline unsigned char rgbSumToU(int r, int g, int b) {
+    return (unsigned char) ((-11059 * r - 21709 * g + 32768 * b +
+        (128 << 18) + (1 << 17) - 1) >> 18);
+  }
+
+  static inline unsigned char rgbSumToV(int r, int g, int b) {
+    return (unsigned char) ((32768 * r - 27439 * g - 5329 * b +
+        (128 << 18) + (1 << 17) - 1) >> 18);
+  }
+
+  /* Box-filters two RGBX rows of 2 * width pixels into one of width. */
+  static void downscaleRow2(const unsigned char* row0,
+      const unsigned char* row1, size_t width, unsigned char* out) {
+    for (size_t x = 0; x < width * DEST_COMPS; x += DEST_COMPS) {
+      for (size_t c = 0; c < DEST_COMPS; ++c) {
+        out[x + c] = (row0[2 * x + c] + row0[2 * x + DEST_COMPS + c] +
+            row1[2 * x + c] + row1[2 * x + DEST_COMPS + c] + 2) >> 2;
+      }
+    }
+  }
+
+  /*
+   * Writers copy finished RGBX eye rows into the destination planes. Chroma
+   * subsampled formats take two rows at a time (ROWS), starting at an even y.
+   */
+  template <DestFormat dest>
+  struct DestWriter;
+
+  template <>
+  struct DestWriter<DestFormat::RGBX> {
+    static constexpr size_t ROWS = 1;
+    static void write(const unsigned char* const* rows, size_t y,
+        size_t width, unsigned char* const* planes, const size_t* strides) {
+      std::memcpy(planes[0] + y * strides[0], rows[0], width * DEST_COMPS);
+    }
+  };
+
+  template <>
+  struct DestWriter<DestFormat::RGB> {
+    static constexpr size_t ROWS = 1;
+    static void write(const unsigned char* const* rows, size_t y,
+        size_t width, unsigned char* const* planes, const size_t* strides) {
+      const unsigned char* in = rows[0];
+      unsigned char* out = planes[0] + y * strides[0];
+      for (size_t x = 0; x < width; ++x) {
+        out[x * 3 + 0] = in[x * DEST_COMPS + 0];
+        out[x * 3 + 1] = in[x * DEST_COMPS + 1];
+        out[x * 3 + 2] = in[x * DEST_COMPS + 2];
+      }
+    }
+  };
+
+  /* Y for both rows, and the 2x2 chroma sums for the pair. */
+  template <typename ChromaFunc>
+  static inline void writeLumaAndChroma(const unsigned char* const* rows,
+      size_t y, size_t width, unsigned char* const* planes,
+      const size_t* strides, ChromaFunc chroma) {
+    const unsigned char* in0 = rows[0];
+    const unsigned char* in1 = rows[1];
+    unsigned char* y0 = planes[0] + y * strides[0];
+    unsigned char* y1 = y0 + strides[0];
+    for (size_t x = 0; x < width; ++x) {
+      const unsigned char* p0 = in0 + x * DEST_COMPS;
+      const unsigned char* p1 = in1 + x * DEST_COMPS;
+      y0[x] = rgbToY(p0[0], p0[1], p0[2]);
+      y1[x] = rgbToY(p1[0], p1[1], p1[2]);
+    }
+    for (size_t x = 0; x < width / 2; ++x) {
+      const unsigned char* p0 = in0 + 2 * x * DEST_COMPS;
+      const unsigned char* p1 = in1 + 2 * x * DEST_COMPS;
+      int r = p0[0] + p0[DEST_COMPS + 0] + p1[0] + p1[DEST_COMPS + 0];
+      int g = p0[1] + p0[DEST_COMPS + 1] + p1[1] + p1[DEST_COMPS + 1];
+      int b = p0[2] + p0[DEST_COMPS + 2] + p1[2] + p1[DEST_COMPS + 2];
+      chroma(x, rgbSumToU(r, g, b), rgbSumToV(r, g, b));
+    }
+  }
+
+  template <>
+  struct DestWriter<DestFormat::I420> {
+    static constexpr size_t ROWS = 2;
+    static void write(const unsigned char* const* rows, size_t y,
+        size_t width, unsigned char* const* planes, const size_t* strides) {
+      unsigned char* u = planes[1] + (y / 2) * strides[1];
+      unsigned char* v = planes[2] + (y / 2) * strides[2];
+      writeLumaAndChroma(rows, y, width, planes, strides,
+          [u, v](size_t x, unsigned char cb, unsigned char cr) {
+            u[x] = cb;
+            v[x] = cr;
+          });
+    }
+  };
+
+  template <>
+  struct DestWriter<DestFormat::NV12> {
+    static constexpr size_t ROWS = 2;
+    static void write(const unsigned char* const* rows, size_t y,
+        size_t width, unsigned char* const* planes, const size_t* strides) {
+      unsigned char* uv = planes[1] + (y / 2) * strides[1];
+      writeLumaAndChroma(rows, y, width, planes, strides,
+          [uv](size_t x, unsigned char cb, unsigned char cr) {
+            uv[2 * x] = cb;
+            uv[2 * x + 1] = cr;
+          });
+    }
+  };
+
+  DecomposeKernel::DecomposeKernel()
+      : _srcWidth(0),
+        _srcHeight(0),
+        _eyeWidth(0),
+        _eyeHeight(0),
+        _frame(nullptr),
+        _sourceRow(nullptr),
+        _streamingSourceRow(nullptr),
+        _tileColumns(0),
+        _tileRows(0),
+        _tileHashesValid(false) {}
+
+  template <DestFormat dest, size_t downscale>
+  void DecomposeKernel::decomposeFrame(const unsigned char* src,
+      const EyeTarget* eyes) {
+    using Writer = DestWriter<dest>;
+    const size_t pixelBytes = bytesPerPixel(_config.source);
+    const size_t srcRowBytes = _srcWidth * pixelBytes;
+    const bool masked = !_maskSpans.empty();
+    const size_t fullEyeWidth = _srcWidth / 2;
+    const size_t fullRowBytes = fullEyeWidth * DEST_COMPS;
+    const size_t outRowBytes = _eyeWidth * DEST_COMPS;
+
+    // Scratch rows stay in L1/L2, so the source is still read only once.
+    unsigned char* outRows[2][2];
+    unsigned char* fullRows[2][2];
+    for (size_t eye = 0; eye < 2; ++eye) {
+      for (size_t r = 0; r < 2; ++r) {
+        outRows[eye][r] = _scratch.data() + (eye * 2 + r) * outRowBytes;
+        fullRows[eye][r] =
+            _scratch.data() + 4 * outRowBytes + (eye * 2 + r) * fullRowBytes;
+      }
+    }
+
+    for (size_t y = 0; y < _eyeHeight; y += Writer::ROWS) {
+      for (size_t r = 0; r < Writer::ROWS; ++r) {
+        // Only the output pixels that either eye's lens shows are converted.
+        size_t begin = 0;
+        size_t end = _eyeWidth;
+        if (masked) {
+          clipToMask(y + r, 0, _eyeWidth, begin, end);
+        }
+
+        const unsigned char* row0 =
+            src + (y + r) * 2 * downscale * srcRowBytes;
+        if (downscale == 0) {
+          unsigned char* rows[] = {outRows[0][r], outRows[1][r]};
+          resampleRow(src, y + r, rows);
+        } else if (end <= begin) {
+          // Neither eye shows this row; the mask below blacks it out.
+        } else if (downscale == 1) {
+          const unsigned char* in = row0 + begin * 2 * pixelBytes;
+          _sourceRow(in, in + srcRowBytes, end - begin,
+              outRows[0][r] + begin * DEST_COMPS,
+              outRows[1][r] + begin * DEST_COMPS);
+        } else {
+          const size_t fullBegin = 2 * begin;
+          const size_t fullOffset = fullBegin * DEST_COMPS;
+          const unsigned char* in0 = row0 + fullBegin * 2 * pixelBytes;
+          const unsigned char* in2 = in0 + 2 * srcRowBytes;
+          _sourceRow(in0, in0 + srcRowBytes, 2 * (end - begin),
+              fullRows[0][0] + fullOffset, fullRows[1][0] + fullOffset);
+          _sourceRow(in2, in2 + srcRowBytes, 2 * (end - begin),
+              fullRows[0][1] + fullOffset, fullRows[1][1] + fullOffset);
+          for (size_t eye = 0; eye < 2; ++eye) {
+            downscaleRow2(fullRows[eye][0] + fullOffset,
+                fullRows[eye][1] + fullOffset, end - begin,
+                outRows[eye][r] + begin * DEST_COMPS);
+          }
+        }
+
+        if (masked) {
+          for (size_t eye = 0; eye < 2; ++eye) {
+            maskRow(eye, y + r, outRows[eye][r], 0, _eyeWidth);
+          }
+        }
+      }
+
+      for (size_t eye = 0; eye < 2; ++eye) {
+        Writer::write(outRows[eye], y, _eyeWidth, eyes[eye].planes,
+            eyes[eye].strides);
+      }
+    }
+  }
+
+  /*
+   * Area-filters an RGBX row horizontally into width pixels of four floats,
+   * using taps weights per output pixel starting at first[x].
+   */
+  static void filterRowHorizontal(const unsigned char* in, size_t width,
+      const size_t* first, const float* weights, size_t taps, float* out) {
+    for (size_t x = 0; x < width; ++x, weights += taps, out += 4) {
+      const unsigned char* px = in + first[x] * DEST_COMPS;
+#ifdef IMAGEUTILS_SSE2
+      const __m128i zero = _mm_setzero_si128();
+      __m128 sum = _mm_setzero_ps();
+      for (size_t t = 0; t < taps; ++t, px += DEST_COMPS) {
+        int32_t bytes;
+        std::memcpy(&bytes, px, sizeof(bytes));
+        __m128i wide = _mm_unpacklo_epi16(
+            _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+        sum = _mm_add_ps(sum,
+            _mm_mul_ps(_mm_cvtepi32_ps(wide), _mm_set1_ps(weights[t])));
+      }
+      _mm_storeu_ps(out, sum);
+#else
+      float r = 0.0f;
+      float g = 0.0f;
+      float b = 0.0f;
+      for (size_t t = 0; t < taps; ++t, px += DEST_COMPS) {
+        r += weights[t] * px[0];
+        g += weights[t] * px[1];
+        b += weights[t] * px[2];
+      }
+      out[0] = r;
+      out[1] = g;
+      out[2] = b;
+      out[3] = 0.0f;
+#endif
+    }
+  }
+
+  /* acc += weight * row, over count floats (a multiple of four). */
+  static void accumulateRow(const float* row, float weight, size_t count,
+      float* acc) {
+    size_t i = 0;
+#ifdef IMAGEUTILS_SSE2
+    const __m128 w = _mm_set1_ps(weight);
+    for (; i < count; i += 4) {
+      _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i),
+          _mm_mul_ps(_mm_loadu_ps(row + i), w)));
+    }
+#endif
+    for (; i < count; ++i) {
+      acc[i] += weight * row[i];
+    }
+  }
+
+  /* Rounds width pixels of four floats in [0, 255] to RGBX. */
+  static void quantizeRow(const float* in, size_t width, unsigned char* out) {
+    size_t x = 0;
+#ifdef IMAGEUTILS_SSE2
+    const __m128 half = _mm_set1_ps(0.5f);
+    for (; x + 4 <= width; x += 4) {
+      __m128i p0 = _mm_cvttps_epi32(_mm_add_ps(_mm_loadu_ps(in + 4 * x), half));
+      __m128i p1 =
+          _mm_cvttps_epi32(_mm_add_ps(_mm_loadu_ps(in + 4 * x + 4), half));
+      __m128i p2 =
+          _mm_cvttps_epi32(_mm_add_ps(_mm_loadu_ps(in + 4 * x + 8), half));
+      __m128i p3 =
+          _mm_cvttps_epi32(_mm_add_ps(_mm_loadu_ps(in + 4 * x + 12), half));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x * DEST_COMPS),
+          _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3)));
+    }
+#endif
+    for (; x < width; ++x) {
+      for (size_t c = 0; c < 3; ++c) {
+        float value = in[4 * x + c] + 0.5f;
+        out[x * DEST_COMPS + c] = value >= 255.0f ? 255 : (unsigned char) value;
+      }
+    }
+  }
+
+  /*
+   * One output row per eye at an arbitrary ratio: area-filters each source
+   * row pair that overlaps it horizontally, then sums them with their
+   * vertical weights. A row pair on the boundary between two output rows is
+   * filtered once and reused from _filteredRows.
+   */
+  void DecomposeKernel::resampleRow(const unsigned char* src, size_t y,
+      unsigned char* const* outRows) {
+    const size_t srcRowBytes = _srcWidth * bytesPerPixel(_config.source);
+    const size_t fullEyeWidth = _srcWidth / 2;
+    unsigned char* fullRows[] = {
+      _scratch.data() + 4 * _eyeWidth * DEST_COMPS,
+      _scratch.data() + 4 * _eyeWidth * DEST_COMPS + fullEyeWidth * DEST_COMPS,
+    };
+    const size_t filteredRowSize = _eyeWidth * 4;
+    const size_t slotSize = 2 * filteredRowSize;
+
+    if (y == 0) {
+      _filteredRowIndex[0] = _filteredRowIndex[1] = (size_t) -1;
+    }
+
+    float* acc = _accumulator.data();
+    std::fill(_accumulator.begin(), _accumulator.end(), 0.0f);
+
+    for (size_t k = 0; k < _yAxis.taps; ++k) {
+      float wy = _yAxis.weights[y * _yAxis.taps + k];
+      if (wy == 0.0f) {
+        continue;
+      }
+
+      size_t row = _yAxis.first[y] + k;
+      size_t slot = row % 2;
+      float* filtered = _filteredRows.data() + slot * slotSize;
+      if (_filteredRowIndex[slot] != row) {
+        const unsigned char* row0 = src + row * 2 * srcRowBytes;
+        _sourceRow(row0, row0 + srcRowBytes, fullEyeWidth, fullRows[0],
+            fullRows[1]);
+        for (size_t eye = 0; eye < 2; ++eye) {
+          filterRowHorizontal(fullRows[eye], _eyeWidth, _xAxis.first.data(),
+              _xAxis.weights.data(), _xAxis.taps,
+              filtered + eye * filteredRowSize);
+        }
+        _filteredRowIndex[slot] = row;
+      }
+
+      accumulateRow(filtered, wy, slotSize, acc);
+    }
+
+    for (size_t eye = 0; eye < 2; ++eye) {
+      quantizeRow(acc + eye * filteredRowSize, _eyeWidth, outRows[eye]);
+    }
+  }
+
+  /*
+   * Builds the area-filter taps for resampling in pixels to out pixels. Each
+   * output pixel averages the input range it covers, with partial weights at
+   * the ends; weights beyond the input are zero, so taps can read past the
+   * covered range but never past the end of the row.
+   */
+  static void buildResampleAxis(size_t in, size_t out, size_t& taps,
+      std::vector<size_t>& first, std::vector<float>& weights) {
+    double ratio = (double) in / out;
+    taps = std::min((size_t) std::ceil(ratio) + 1, in);
+    first.assign(out, 0);
+    weights.assign(out * taps, 0.0f);
+    for (size_t o = 0; o < out; ++o) {
+      double start = o * ratio;
+      double end = std::min((o + 1) * ratio, (double) in);
+      size_t begin = std::min((size_t) start, in - taps);
+      first[o] = begin;
+      for (size_t k = 0; k < taps; ++k) {
+        double lo = std::max((double) (begin + k), start);
+        double hi = std::min((double) (begin + k + 1), end);
+        if (hi > lo) {
+          weights[o * taps + k] = (float) ((hi - lo) / ratio);
+        }
+      }
+    }
+  }
+
+  DecomposeKernel::RowFunc* DecomposeKernel::directRowFunc(
+      const EyeTarget* eyes) const {
+    if (_streamingSourceRow != nullptr &&
+        reinterpret_cast<uintptr_t>(eyes[0].planes[0]) % 16 == 0 &&
+        reinterpret_cast<uintptr_t>(eyes[1].planes[0]) % 16 == 0) {
+      return _streamingSourceRow;
+    }
+    return _sourceRow;
+  }
+
+  void DecomposeKernel::decomposeRegionDirect(RowFunc* sourceRow,
+      const unsigned char* src, const EyeTarget* eyes, size_t x0, size_t x1,
+      size_t y0, size_t y1) {
+    const size_t pixelBytes = bytesPerPixel(_config.source);
+    const size_t srcRowBytes = _srcWidth * pixelBytes;
+    const bool masked = !_maskSpans.empty();
+    for (size_t y = y0; y < y1; ++y) {
+      unsigned char* lRow = eyes[0].planes[0] + y * eyes[0].strides[0];
+      unsigned char* rRow = eyes[1].planes[0] + y * eyes[1].strides[0];
+      size_t begin = x0;
+      size_t end = x1;
+      if (masked) {
+        clipToMask(y, x0, x1, begin, end);
+      }
+
+      if (end > begin) {
+        const unsigned char* row0 =
+            src + y * 2 * srcRowBytes + begin * 2 * pixelBytes;
+        sourceRow(row0, row0 + srcRowBytes, end - begin,
+            lRow + begin * DEST_COMPS, rRow + begin * DEST_COMPS);
+      }
+      if (masked) {
+        maskRow(0, y, lRow, x0, x1);
+        maskRow(1, y, rRow, x0, x1);
+      }
+    }
+  }
+
+  void DecomposeKernel::decomposeFrameDirect(const unsigned char* src,
+      const EyeTarget* eyes) {
+    // RGBX at full size is what the row kernels produce, so they write
+    // straight into the output.
+    RowFunc* sourceRow = directRowFunc(eyes);
+    decomposeRegionDirect(sourceRow, src, eyes, 0, _eyeWidth, 0, _eyeHeight);
+    if (sourceRow != _sourceRow) {
+      StreamingStore::finish();
+    }
+  }
+
+  bool DecomposeKernel::configure(const KernelConfig& config,
+      size_t srcWidth, size_t srcHeight) {
+    _frame = nullptr;
+    if (bytesPerPixel(config.source) == 0 ||
+        !(config.scale > 0.0 && config.scale <= 1.0)) {
+      return false;
+    }
+    if (srcWidth == 0 || srcHeight == 0 ||
+        srcWidth % 2 != 0 || srcHeight % 2 != 0) {
+      return false;
+    }
+
+    // Chroma subsampling needs even eye sizes.
+    bool subsampled =
+        config.dest == DestFormat::I420 || config.dest == DestFormat::NV12;
+    size_t align = subsampled ? 2 : 1;
+    size_t fullEyeWidth = srcWidth / 2;
+    size_t fullEyeHeight = srcHeight / 2;
+    auto scaled = [&](size_t full) {
+      size_t size = (size_t) (full * config.scale / align + 0.5) * align;
+      return std::max(size, align);
+    };
+
+    _config = config;
+    _srcWidth = srcWidth;
+    _srcHeight = srcHeight;
+    _eyeWidth = scaled(fullEyeWidth);
+    _eyeHeight = scaled(fullEyeHeight);
+    if (_eyeWidth > fullEyeWidth || _eyeHeight > fullEyeHeight) {
+      return false;
+    }
+
+    _tileColumns = (srcWidth + TILE_SIZE - 1) / TILE_SIZE;
+    _tileRows = (srcHeight + TILE_SIZE - 1) / TILE_SIZE;
+    _tileHashes.assign(_tileColumns * _tileRows, TileHash());
+    _tileHashesValid = false;
+    _bandHashes.assign(_tileColumns, TileHash());
+    _changedTiles.assign(_tileColumns, 0);
+    buildLensMask();
+
+    size_t downscale = 0;
+    if (_eyeWidth == fullEyeWidth && _eyeHeight == fullEyeHeight) {
+      downscale = 1;
+    } else if (_eyeWidth * 2 == fullEyeWidth &&
+        _eyeHeight * 2 == fullEyeHeight) {
+      downscale = 2;
+    }
+
+    _sourceRow = rowFunc<CachedStore>(config.source, config.transform);
+    _streamingSourceRow = nullptr;
+
+    // Only the direct path writes output with the row kernels' vector
+    // stores, so it's the only one that can stream.
+    bool direct = config.dest == DestFormat::RGBX && downscale == 1;
+#ifdef IMAGEUTILS_SSE2
+    // The lens mask overwrites some of the row kernels' output, which mustn't
+    // race with streaming stores still in flight.
+    if (direct && _eyeWidth % 4 == 0 && _maskSpans.empty()) {
+      size_t outputBytes = imageSize() * imageCount();
+      if (config.storeMode == StoreMode::Streaming ||
+          (config.storeMode == StoreMode::Auto &&
+           outputBytes >= STREAMING_STORE_THRESHOLD)) {
+        _streamingSourceRow =
+            rowFunc<StreamingStore>(config.source, config.transform);
+      }
+    }
+#endif
+
+    if (direct) {
+      _scratch.clear();
+      _frame = &DecomposeKernel::decomposeFrameDirect;
+      return true;
+    }
+
+    _scratch.assign(4 * _eyeWidth * DEST_COMPS +
+        (downscale != 1 ? 4 * fullEyeWidth * DEST_COMPS : 0), 0);
+    if (downscale == 0) {
+      buildResampleAxis(fullEyeWidth, _eyeWidth, _xAxis.taps, _xAxis.first,
+          _xAxis.weights);
+      buildResampleAxis(fullEyeHeight, _eyeHeight, _yAxis.taps, _yAxis.first,
+          _yAxis.weights);
+      _accumulator.assign(2 * _eyeWidth * 4, 0.0f);
+      _filteredRows.assign(2 * 2 * _eyeWidth * 4, 0.0f);
+    }
+
+    switch (config.dest) {
+      case DestFormat::RGBX:
+        _frame = downscale == 2
+            ? &DecomposeKernel::decomposeFrame<DestFormat::RGBX, 2>
+            : &DecomposeKernel::decomposeFrame<DestFormat::RGBX, 0>;
+        break;
+      case DestFormat::RGB:
+        _frame = downscale == 1
+            ? &DecomposeKernel::decomposeFrame<DestFormat::RGB, 1>
+            : downscale == 2
+            ? &DecomposeKernel::decomposeFrame<DestFormat::RGB, 2>
+            : &DecomposeKernel::decomposeFrame<DestFormat::RGB, 0>;
+        break;
+      case DestFormat::I420:
+        _frame = downscale == 1
+            ? &DecomposeKernel::decomposeFrame<DestFormat::I420, 1>
+            : downscale == 2
+            ? &DecomposeKernel::decomposeFrame<DestFormat::I420, 2>
+            : &DecomposeKernel::decomposeFrame<DestFormat::I420, 0>;
+        break;
+      case DestFormat::NV12:
+        _frame = downscale == 1
+            ? &DecomposeKernel::decomposeFrame<DestFormat::NV12, 1>
+            : downscale == 2
+            ? &DecomposeKernel::decomposeFrame<DestFormat::NV12, 2>
+            : &DecomposeKernel::decomposeFrame<DestFormat::NV12, 0>;
+        break;
+    }
+    return _frame != nullptr;
+  }
+
+  /*
+   * Finds each output row's visible span in both eyes from the lens mask,
+   * and which tiles of the capture can reach a visible pixel at all.
+   */
+  void DecomposeKernel::buildLensMask() {
+    _maskSpans.clear();
+    _tileVisible.clear();
+    const LensMask& mask = _config.lensMask;
+    if (!mask.enabled()) {
+      return;
+    }
+
+    _maskSpans.assign(3 * _eyeHeight * 2, 0);
+    const double width = (double) _eyeWidth;
+    const double height = (double) _eyeHeight;
+    const double radius =
+        mask.radius * std::sqrt(width * width + height * height) / 2.0;
+    const double centerX = mask.centerX * width;
+    const double centerY = mask.centerY * height;
+    auto column = [&](double x) {
+      return (size_t) std::min(std::max(x, 0.0), width);
+    };
+    for (size_t y = 0; y < _eyeHeight; ++y) {
+      size_t* left = &_maskSpans[(0 * _eyeHeight + y) * 2];
+      size_t* right = &_maskSpans[(1 * _eyeHeight + y) * 2];
+      size_t* both = &_maskSpans[(2 * _eyeHeight + y) * 2];
+      double dy = y + 0.5 - centerY;
+      if (std::abs(dy) >= radius) {
+        continue; // All empty.
+      }
+
+      // Pixels whose centers are inside the circle.
+      double half = std::sqrt(radius * radius - dy * dy);
+      left[0] = column(std::ceil(centerX - half - 0.5));
+      left[1] = column(std::floor(centerX + half - 0.5) + 1.0);
+      if (left[1] <= left[0]) {
+        left[0] = left[1] = 0;
+        continue;
+      }
+      right[0] = _eyeWidth - left[1];
+      right[1] = _eyeWidth - left[0];
+      both[0] = std::min(left[0], right[0]);
+      both[1] = std::max(left[1], right[1]);
+    }
+
+    // Each 2x2 block of the capture feeds the same column of both eyes. Round
+    // outwards, since a scaled block can touch two output pixels.
+    const size_t tileBlocks = TILE_SIZE / 2;
+    const double scaleX = width / (_srcWidth / 2);
+    const double scaleY = height / (_srcHeight / 2);
+    _tileVisible.assign(tileCount(), 0);
+    for (size_t band = 0; band < _tileRows; ++band) {
+      size_t y0 = (size_t) (band * tileBlocks * scaleY);
+      size_t y1 = std::min(_eyeHeight,
+          (size_t) std::ceil((band + 1) * tileBlocks * scaleY));
+      for (size_t tx = 0; tx < _tileColumns; ++tx) {
+        size_t x0 = (size_t) (tx * tileBlocks * scaleX);
+        size_t x1 = std::min(_eyeWidth,
+            (size_t) std::ceil((tx + 1) * tileBlocks * scaleX));
+        for (size_t y = y0; y < y1; ++y) {
+          const size_t* both = maskSpan(2, y);
+          if (both[0] < x1 && both[1] > x0) {
+            _tileVisible[band * _tileColumns + tx] = 1;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  /* Narrows [x0, x1) of output row y to what either eye shows. */
+  void DecomposeKernel::clipToMask(size_t y, size_t x0, size_t x1,
+      size_t& begin, size_t& end) const {
+    const size_t* both = maskSpan(2, y);
+    begin = std::min(std::max(both[0], x0), x1);
+    end = std::max(std::min(both[1], x1), begin);
+  }
+
+  /* Blacks out the pixels in [x0, x1) of an eye's row that it doesn't show. */
+  void DecomposeKernel::maskRow(size_t eye, size_t y, unsigned char* row,
+      size_t x0, size_t x1) const {
+    const size_t* span = maskSpan(eye, y);
+    size_t begin = std::min(std::max(span[0], x0), x1);
+    size_t end = std::max(std::min(span[1], x1), begin);
+    std::memset(row + x0 * DEST_COMPS, 0, (begin - x0) * DEST_COMPS);
+    std::memset(row + end * DEST_COMPS, 0, (x1 - end) * DEST_COMPS);
+  }
+
+  bool DecomposeKernel::isConfiguredFor(PixelFormat source, size_t srcWidth,
+      size_t srcHeight) const {
+    return _frame != nullptr && _config.source == source &&
+        _srcWidth == srcWidth && _srcHeight == srcHeight;
+  }
+
+  size_t DecomposeKernel::imageWidth() const {
+    return _config.eyeLayout == EyeLayout::SideBySide
+        ? 2 * _eyeWidth : _eyeWidth;
+  }
+
+  size_t DecomposeKernel::imageHeight() const {
+    return _config.eyeLayout == EyeLayout::TopBottom
+        ? 2 * _eyeHeight : _eyeHeight;
+  }
+
+  size_t DecomposeKernel::imageCount() const {
+    return _config.eyeLayout == EyeLayout::Separate ? 2 : 1;
+  }
+
+  size_t DecomposeKernel::planeCount() const {
+    switch (_config.dest) {
+      case DestFormat::I420: return 3;
+      case DestFormat::NV12: return 2;
+      default: return 1;
+    }
+  }
+
+  size_t DecomposeKernel::planeHeight(size_t plane) const {
+    return plane == 0 ? imageHeight() : imageHeight() / 2;
+  }
+
+  size_t DecomposeKernel::planeStride(size_t plane) const {
+    switch (_config.dest) {
+      case DestFormat::RGBX: return imageWidth() * DEST_COMPS;
+      case DestFormat::RGB: return imageWidth() * 3;
+      case DestFormat::I420:
+        return plane == 0 ? imageWidth() : imageWidth() / 2;
+      case DestFormat::NV12: return imageWidth();
+    }
+    return 0;
+  }
+
+  /* Bytes of one eye's row within a plane, i.e. the side-by-side offset. */
+  size_t DecomposeKernel::eyePlaneRowBytes(size_t plane) const {
+    switch (_config.dest) {
+      case DestFormat::RGBX: return _eyeWidth * DEST_COMPS;
+      case DestFormat::RGB: return _eyeWidth * 3;
+      case DestFormat::I420: return plane == 0 ? _eyeWidth : _eyeWidth / 2;
+      case DestFormat::NV12: return _eyeWidth;
+    }
+    return 0;
+  }
+
+  size_t DecomposeKernel::imageSize() const {
+    size_t size = 0;
+    for (size_t plane = 0; plane < planeCount(); ++plane) {
+      size += planeStride(plane) * planeHeight(plane);
+    }
+    return size;
+  }
+
+  DestImage DecomposeKernel::image(unsigned char* buffer) const {
+    DestImage image = {};
+    for (size_t plane = 0; plane < planeCount(); ++plane) {
+      image.planes[plane] = buffer;
+      image.strides[plane] = planeStride(plane);
+      buffer += planeStride(plane) * planeHeight(plane);
+    }
+    return image;
+  }
+
+  void DecomposeKernel::eyeTargets(const DestImage* images,
+      EyeTarget* eyes) const {
+    for (size_t eye = 0; eye < 2; ++eye) {
+      const DestImage& image =
+          images[_config.eyeLayout == EyeLayout::Separate ? eye : 0];
+      for (size_t plane = 0; plane < planeCount(); ++plane) {
+        size_t offset = 0;
+        if (eye == 1 && _config.eyeLayout == EyeLayout::SideBySide) {
+          offset = eyePlaneRowBytes(plane);
+        } else if (eye == 1 && _config.eyeLayout == EyeLayout::TopBottom) {
+          offset = planeHeight(plane) / 2 * image.strides[plane];
+        }
+        eyes[eye].planes[plane] = image.planes[plane] + offset;
+        eyes[eye].strides[plane] = image.strides[plane];
+      }
+    }
+  }
+
+  void DecomposeKernel::run(const void* src, const DestImage* images) {
+    EyeTarget eyes[2] = {};
+    eyeTargets(images, eyes);
+    (this->*_frame)(static_cast<const unsigned char*>(src), eyes);
+  }
+
+  /*
+   * Adds bytes to a tile's hash: Fletcher-style running sums of 64-bit words,
+   * which keep up with memory bandwidth and, unlike a plain sum, still change
+   * when content moves within the tile.
+   */
+  static inline void hashBytes(const unsigned char* p, size_t bytes,
+      uint64_t* sums, uint64_t* sumsOfSums) {
+    size_t i = 0;
+#ifdef IMAGEUTILS_SSE2
+    __m128i sum = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sums));
+    __m128i sumOfSums =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(sumsOfSums));
+    for (; i + 16 <= bytes; i += 16) {
+      sum = _mm_add_epi64(sum,
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)));
+      sumOfSums = _mm_add_epi64(sumOfSums, sum);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(sums), sum);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(sumsOfSums), sumOfSums);
+#endif
+    for (; i < bytes; i += 16) {
+      uint64_t words[2] = {0, 0};
+      std::memcpy(words, p + i, std::min<size_t>(16, bytes - i));
+      for (size_t lane = 0; lane < 2; ++lane) {
+        sums[lane] += words[lane];
+        sumsOfSums[lane] += sums[lane];
+      }
+    }
+  }
+
+  uint64_t hashImage(const void* data, size_t bytes) {
+    uint64_t sums[2] = {0, 0};
+    uint64_t sumsOfSums[2] = {0, 0};
+    hashBytes(static_cast<const unsigned char*>(data), bytes, sums,
+        sumsOfSums);
+
+    // Fold the four sums into one word (multiplying by the 64-bit golden
+    // ratio), so that each affects every bit of the result.
+    const uint64_t words[4] = {sums[0], sums[1], sumsOfSums[0], sumsOfSums[1]};
+    uint64_t hash = bytes;
+    for (uint64_t word : words) {
+      hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+      hash ^= hash >> 32;
+    }
+    return hash;
+  }
+
+  /*
+   * Hashes one row of tiles and compares it with the previous capture's,
+   * flagging the changed ones in _changedTiles. Returns how many changed.
+   */
+  size_t DecomposeKernel::hashTileBand(const unsigned char* src,
+      size_t band) {
+    const size_t srcRowBytes = _srcWidth * bytesPerPixel(_config.source);
+    const size_t tileBytes = TILE_SIZE * bytesPerPixel(_config.source);
+    std::fill(_bandHashes.begin(), _bandHashes.end(), TileHash());
+
+    // Row by row rather than tile by tile, so the reads stay sequential.
+    const size_t yEnd = std::min((band + 1) * TILE_SIZE, _srcHeight);
+    for (size_t y = band * TILE_SIZE; y < yEnd; ++y) {
+      const unsigned char* row = src + y * srcRowBytes;
+      for (size_t tx = 0; tx < _tileColumns; ++tx) {
+        // A tile that neither eye shows always hashes (and compares) as 0.
+        if (!_tileVisible.empty() && !_tileVisible[band * _tileColumns + tx]) {
+          continue;
+        }
+        size_t offset = tx * tileBytes;
+        hashBytes(row + offset, std::min(tileBytes, srcRowBytes - offset),
+            _bandHashes[tx].sums, _bandHashes[tx].sumsOfSums);
+      }
+    }
+
+    size_t changed = 0;
+    TileHash* previous = _tileHashes.data() + band * _tileColumns;
+    for (size_t tx = 0; tx < _tileColumns; ++tx) {
+      bool same = _tileHashesValid && std::memcmp(&previous[tx],
+          &_bandHashes[tx], sizeof(TileHash)) == 0;
+      _changedTiles[tx] = same ? 0 : 1;
+      changed += same ? 0 : 1;
+      previous[tx] = _bandHashes[tx];
+    }
+    return changed;
+  }
+
+  bool DecomposeKernel::decomposesTiles() const {
+    return _frame == &DecomposeKernel::decomposeFrameDirect;
+  }
+
+  size_t DecomposeKernel::runChanged(const void* src,
+      const DestImage* images, bool invalidate) {
+    if (invalidate) {
+      _tileHashesValid = false;
+      run(src, images);
+      return tileCount();
+    }
+
+    EyeTarget eyes[2] = {};
+    eyeTargets(images, eyes);
+    const unsigned char* bytes = static_cast<const unsigned char*>(src);
+    const bool direct = decomposesTiles();
+    RowFunc* sourceRow = direct ? directRowFunc(eyes) : nullptr;
+
+    // Each row of tiles is decomposed right after it's hashed, while it's
+    // still in cache. Runs of changed tiles go to the row kernel together.
+    const size_t tileBlocks = TILE_SIZE / 2;
+    size_t changed = 0;
+    for (size_t band = 0; band < _tileRows; ++band) {
+      size_t bandChanged = hashTileBand(bytes, band);
+      changed += bandChanged;
+      if (!direct || bandChanged == 0) {
+        continue;
+      }
+
+      size_t y0 = band * tileBlocks;
+      size_t y1 = std::min(y0 + tileBlocks, _eyeHeight);
+      for (size_t tx = 0; tx < _tileColumns;) {
+        if (!_changedTiles[tx]) {
+          ++tx;
+          continue;
+        }
+        size_t first = tx;
+        while (tx < _tileColumns && _changedTiles[tx]) {
+          ++tx;
+        }
+        decomposeRegionDirect(sourceRow, bytes, eyes, first * tileBlocks,
+            std::min(tx * tileBlocks, _eyeWidth), y0, y1);
+      }
+    }
+    _tileHashesValid = true;
+
+    if (direct && sourceRow != _sourceRow) {
+      StreamingStore::finish();
+    }
+    // The other kernels can't stop at tile edges, so any change decomposes
+    // the whole frame; the hashes still let an unchanged capture skip the
+    // decomposition, the JPEG and the send.
+    if (!direct && changed > 0) {
+      (this->*_frame)(bytes, eyes);
+    }
+    return changed;
+  }
+
+}
@@ -1,94 +1,261 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
 namespace ImageUtils {
 
-  static constexpr size_t SRC_COMPS = 4; // RGBA
   static constexpr size_t DEST_COMPS = 4; // RGBX
 
-  template <typename T>
-  using ProcessBlockFunc =
-      void(T*, size_t, size_t, unsigned char*, unsigned char*);
+  /**
+   * Source pixel layouts that the checkerboard decomposition understands.
+   * These mirror the VP2 raster formats we can read back, but are kept
+   * independent of Maya.
+   */
+  enum class PixelFormat {
+    RGBA32F,  /* 4 x 32-bit float. */
+    RGBA16F,  /* 4 x 16-bit half float; half the readback of RGBA32F. */
+    RGB32F,   /* 3 x 32-bit float, no alpha. */
+    RGBA8,    /* 4 x 8-bit unorm (also RGBX). */
+    BGRA8,    /* 4 x 8-bit unorm, red and blue swapped (also BGRX). */
+    RGB10A2,  /* 10-bit unorm RGB packed with 2-bit alpha in 32 bits. */
+  };
 
-  template <typename T, size_t comps>
-  inline T* getPixelPtr(T* buf, size_t bufWidth, size_t row, size_t col) {
-    return buf + (row * bufWidth * comps) + (col * comps);
-  }
+  /**
+   * How float samples are turned into 8-bit values. Every transform clamps
+   * to [0, 1] first, so HDR values saturate instead of wrapping. Unorm
+   * formats are already display-encoded and pass through unchanged.
+   */
+  enum class ColorTransform {
+    Linear, /* Clamp only. */
+    Srgb,   /* Clamp, then sRGB-encode (for linear float render targets). */
+  };
 
-  inline void processBlockFloat(float* srcBlock, size_t srcWidth,
-      size_t col, unsigned char* lDest, unsigned char* rDest) {
-    float* srcRows[] = {
-      srcBlock,
-      srcBlock + srcWidth * SRC_COMPS
-    };
+  /**
+   * How the decomposition writes its output. Streaming (non-temporal) stores
+   * bypass the cache, which saves the read-for-ownership of every output line
+   * but leaves the image in memory rather than cache for the JPEG encoder.
+   * Auto streams once the output is larger than STREAMING_STORE_THRESHOLD,
+   * which only a 4K stream (33 MB of RGBX) reaches; a 1280x720 stream's
+   * output is 3.7 MB, so at the usual stream sizes Auto writes cached.
+   */
+  enum class StoreMode {
+    Auto,
+    Cached,
+    Streaming,
+  };
 
-    lDest[0] = (srcRows[0][0] + srcRows[1][4]) * 127.999f;
-    lDest[1] = (srcRows[0][1] + srcRows[1][5]) * 127.999f;
-    lDest[2] = (srcRows[0][2] + srcRows[1][6]) * 127.999f;
+  static constexpr size_t STREAMING_STORE_THRESHOLD = 32 * 1024 * 1024;
 
-    rDest[0] = (srcRows[0][4] + srcRows[1][0]) * 127.999f;
-    rDest[1] = (srcRows[0][5] + srcRows[1][1]) * 127.999f;
-    rDest[2] = (srcRows[0][6] + srcRows[1][2]) * 127.999f;
-  }
+  size_t bytesPerPixel(PixelFormat format);
+  const char* formatName(PixelFormat format);
 
-  inline void processBlockUchar(unsigned char* srcBlock,
-      size_t srcWidth, size_t col, unsigned char* lDest, unsigned char* rDest) {
-    unsigned char* srcRows[] = {
-      srcBlock,
-      srcBlock + srcWidth * SRC_COMPS
-    };
+  /**
+   * Hashes a whole image with the same running sums as the decomposition's
+   * tile hashes, e.g. to recognize a capture that was seen before.
+   */
+  uint64_t hashImage(const void* data, size_t bytes);
 
-    lDest[0] = (srcRows[0][0] + srcRows[1][4]) / 2;
-    lDest[1] = (srcRows[0][1] + srcRows[1][5]) / 2;
-    lDest[2] = (srcRows[0][2] + srcRows[1][6]) / 2;
-
-    rDest[0] = (srcRows[0][4] + srcRows[1][0]) / 2;
-    rDest[1] = (srcRows[0][5] + srcRows[1][1]) / 2;
-    rDest[2] = (srcRows[0][6] + srcRows[1][2]) / 2;
-  }
-
-  template <typename T, ProcessBlockFunc<T> processBlock>
-  bool decomposeCheckerboardStereo(void* src, size_t srcWidth, size_t srcHeight,
-      unsigned char* dest, size_t destSize) {
-    // Enforce src buffer dimensions.
-    if (srcWidth % 2 != 0 || srcHeight % 2 != 0) {
-      return false;
-    }
+  /** Output pixel layouts of a DecomposeKernel. */
+  enum class DestFormat {
+    RGBX, /* 4 bytes per pixel; X is undefined. */
+    RGB,  /* 3 bytes per pixel. */
+    I420, /* Full-range BT.601 Y, U and V planes, chroma halved both ways. */
+    NV12, /* Y plane, then interleaved UV at I420's chroma resolution. */
+  };
+
+  /** Where each eye goes in the output. */
+  enum class EyeLayout {
+    SideBySide, /* One image, left eye on the left. */
+    TopBottom,  /* One image, left eye on top. */
+    Separate,   /* One image per eye. */
+  };
+
+  /**
+   * The part of each eye that a headset's lens shows: a circle, in fractions
+   * of the eye's size. The rest of the eye is written black, which costs the
+   * JPEG encoder almost nothing, and its source pixels aren't converted (nor,
+   * in tiles that neither eye shows, even hashed). The right eye's circle is
+   * the mirror image of the left eye's.
+   */
+  struct LensMask {
+    double radius;  /* Of half the eye's diagonal; 0 turns the mask off. */
+    double centerX; /* Of the left eye's width, from its left edge. */
+    double centerY; /* Of the eye's height, from the top. */
 
-    // Enforce dest buffer capacity.
-    size_t spaceRequired = srcWidth * srcHeight * DEST_COMPS;
-    if (destSize < spaceRequired) {
-      return false;
+    LensMask() : radius(0.0), centerX(0.5), centerY(0.5) {}
+    bool enabled() const { return radius > 0.0; }
+    bool operator==(const LensMask& other) const {
+      return radius == other.radius && centerX == other.centerX &&
+          centerY == other.centerY;
     }
+    bool operator!=(const LensMask& other) const { return !(*this == other); }
+  };
+
+  struct KernelConfig {
+    PixelFormat source;
+    ColorTransform transform;
+    DestFormat dest;
+    EyeLayout eyeLayout;
+    /**
+     * Output eye size relative to the capture's, in (0, 1]. Downscaling is
+     * box-filtered in the same pass as the decomposition; 1 and 0.5 have
+     * their own kernels, other ratios use a general area filter.
+     */
+    double scale;
+    StoreMode storeMode;
+    LensMask lensMask;
+
+    KernelConfig()
+        : source(PixelFormat::RGBA8),
+          transform(ColorTransform::Linear),
+          dest(DestFormat::RGBX),
+          eyeLayout(EyeLayout::SideBySide),
+          scale(1.0),
+          storeMode(StoreMode::Auto) {}
+  };
+
+  /** One output image, with up to three planes (see DestFormat). */
+  struct DestImage {
+    unsigned char* planes[3];
+    size_t strides[3];
+  };
+
+  /**
+   * A checkerboard decomposition specialized at compile time for its
+   * destination format and downscale factor, with the source format's row
+   * kernel chosen up front as well. Configure it when the capture format or
+   * size changes (normally once per connection); run() then does no dispatch
+   * or allocation of its own.
+   */
+  class DecomposeKernel {
+  public:
+    DecomposeKernel();
+
+    /**
+     * Selects the kernel for captures of srcWidth x srcHeight. Returns false
+     * if the size can't be decomposed with this configuration (the capture
+     * must have even dimensions, and I420/NV12 need even eye sizes).
+     */
+    bool configure(const KernelConfig& config, size_t srcWidth,
+        size_t srcHeight);
+    bool isConfigured() const { return _frame != nullptr; }
+    bool isConfiguredFor(PixelFormat source, size_t srcWidth,
+        size_t srcHeight) const;
+    const KernelConfig& config() const { return _config; }
 
-    // Cast buffer to correct format.
-    T* srcData = reinterpret_cast<T*>(src);
+    size_t eyeWidth() const { return _eyeWidth; }
+    size_t eyeHeight() const { return _eyeHeight; }
+    size_t imageWidth() const;
+    size_t imageHeight() const;
+    size_t imageCount() const;
+    size_t planeCount() const;
+    /** Bytes for one image with its planes packed back to back. */
+    size_t imageSize() const;
+    /** Describes a packed image of imageSize() bytes starting at buffer. */
+    DestImage image(unsigned char* buffer) const;
 
-    // Move in 2x2 blocks through the source and map to 2x1 blocks.
-    for (int row = 0; row < srcHeight; row += 2) {
-      for (int col = 0; col < srcWidth; col += 2) {
-        T* srcBlock = getPixelPtr<T, SRC_COMPS>(srcData, srcWidth, row, col);
-        unsigned char* lDest = getPixelPtr<unsigned char, DEST_COMPS>(
-            dest, srcWidth, row / 2, col / 2);
-        unsigned char* rDest = getPixelPtr<unsigned char, DEST_COMPS>(
-            dest, srcWidth, row / 2, col / 2 + srcWidth / 2);
+    /** Decomposes src into imageCount() images. */
+    void run(const void* src, const DestImage* images);
 
-        processBlock(srcBlock, srcWidth, col, lDest, rDest);
-      }
+    /** Source pixels along each side of the tiles that runChanged compares. */
+    static constexpr size_t TILE_SIZE = 32;
+
+    /**
+     * Like run(), but hashes each TILE_SIZE square of src and skips the tiles
+     * that match the previous runChanged(), so the images must still hold
+     * that call's output. Only RGBX at full size decomposes tile by tile;
+     * other configurations decompose the whole frame if any tile changed.
+     * Pass invalidate when the whole capture is expected to differ (e.g. the
+     * camera moved): hashing is skipped, every tile is decomposed, and the
+     * next call compares against nothing. Returns the number of changed
+     * tiles, which is tileCount() when invalidated.
+     */
+    size_t runChanged(const void* src, const DestImage* images,
+        bool invalidate);
+    size_t tileCount() const { return _tileColumns * _tileRows; }
+    /** Whether runChanged decomposes only the changed tiles. */
+    bool decomposesTiles() const;
+
+  private:
+    struct EyeTarget {
+      unsigned char* planes[3];
+      size_t strides[3];
+    };
+
+    using FrameFunc = void (DecomposeKernel::*)(const unsigned char* src,
+        const EyeTarget* eyes);
+    using RowFunc = void(const unsigned char* row0, const unsigned char* row1,
+        size_t blocks, unsigned char* lDest, unsigned char* rDest);
+
+    /* Running sums of a tile's 64-bit words, in two lanes. */
+    struct TileHash {
+      uint64_t sums[2];
+      uint64_t sumsOfSums[2];
+    };
+
+    /* Area-filter taps for one axis of an arbitrary-ratio downscale. */
+    struct ResampleAxis {
+      std::vector<size_t> first;
+      std::vector<float> weights; /* taps per output pixel, zero-padded. */
+      size_t taps;
+    };
+
+    /* downscale is 1, 2, or 0 for an arbitrary ratio. */
+    template <DestFormat dest, size_t downscale>
+    void decomposeFrame(const unsigned char* src, const EyeTarget* eyes);
+    void resampleRow(const unsigned char* src, size_t y,
+        unsigned char* const* outRows);
+    void decomposeFrameDirect(const unsigned char* src, const EyeTarget* eyes);
+    RowFunc* directRowFunc(const EyeTarget* eyes) const;
+    /* Blocks [x0, x1) of output rows [y0, y1), in eye pixels. */
+    void decomposeRegionDirect(RowFunc* sourceRow, const unsigned char* src,
+        const EyeTarget* eyes, size_t x0, size_t x1, size_t y0, size_t y1);
+    size_t hashTileBand(const unsigned char* src, size_t band);
+    void buildLensMask();
+    /* Visible [begin, end) of output row y; eye 2 is both eyes' union. */
+    const size_t* maskSpan(size_t eye, size_t y) const {
+      return _maskSpans.data() + (eye * _eyeHeight + y) * 2;
     }
+    void clipToMask(size_t y, size_t x0, size_t x1, size_t& begin,
+        size_t& end) const;
+    void maskRow(size_t eye, size_t y, unsigned char* row, size_t x0,
+        size_t x1) const;
+    void eyeTargets(const DestImage* images, EyeTarget* eyes) const;
+
+    size_t planeHeight(size_t plane) const;
+    size_t planeStride(size_t plane) const;
+    size_t eyePlaneRowBytes(size_t plane) const;
+
+    KernelConfig _config;
+    size_t _srcWidth;
+    size_t _srcHeight;
+    size_t _eyeWidth;
+    size_t _eyeHeight;
+    FrameFunc _frame;
+    RowFunc* _sourceRow;
+    RowFunc* _streamingSourceRow; /* Null if streaming stores don't apply. */
 
-    return true;
-  }
+    /* Eye rows at full and output resolution, between the passes. */
+    std::vector<unsigned char> _scratch;
+    ResampleAxis _xAxis;
+    ResampleAxis _yAxis;
+    std::vector<float> _accumulator;
+    std::vector<float> _filteredRows; /* Two slots of both eyes' rows. */
+    size_t _filteredRowIndex[2];
 
-  bool decomposeCheckerboardStereoFloat(void* src, size_t srcWidth,
-      size_t srcHeight, unsigned char* dest, size_t destSize) {
-    return decomposeCheckerboardStereo<float, processBlockFloat>(
-        src, srcWidth, srcHeight, dest, destSize);
-  }
+    /* The previous runChanged's tile hashes, row by row of tiles. */
+    size_t _tileColumns;
+    size_t _tileRows;
+    std::vector<TileHash> _tileHashes;
+    bool _tileHashesValid;
+    std::vector<TileHash> _bandHashes;
+    std::vector<unsigned char> _changedTiles; /* Of the current band. */
 
-  bool decomposeCheckerboardStereoUchar(void* src, size_t srcWidth,
-      size_t srcHeight, unsigned char* dest, size_t destSize) {
-    return decomposeCheckerboardStereo<unsigned char, processBlockUchar>(
-        src, srcWidth, srcHeight, dest, destSize);
-  }
+    /* Empty without a lens mask; see maskSpan. */
+    std::vector<size_t> _maskSpans;
+    std::vector<unsigned char> _tileVisible; /* Per tile, like _tileHashes. */
+  };
 
 }
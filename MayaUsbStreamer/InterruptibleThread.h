@@ -0,0 +1,84 @@
+#pragma once
+
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <memory>
+
+class CancelToken {
+public:
+  CancelToken() : _cancelled(false) {}
+
+  /**
+   * Sets the cancel flag and runs the current interrupt hook, if any, so that
+   * a blocking operation on the worker thread returns immediately.
+   */
+  void cancel() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _cancelled.store(true);
+    if (_interrupt) {
+      _interrupt();
+    }
+  }
+
+  bool isCancelled() const { return _cancelled.load(); }
+
+  /**
+   * Installs a hook that aborts the operation about to begin. Returns false
+   * (and installs nothing) if the token has already been cancelled.
+   */
+  bool setInterrupt(std::function<void()> interrupt) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_cancelled.load()) {
+      return false;
+    }
+    _interrupt = interrupt;
+    return true;
+  }
+
+  void clearInterrupt() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _interrupt = nullptr;
+  }
+
+private:
+  std::atomic_bool _cancelled;
+  std::mutex _mutex;
+  std::function<void()> _interrupt;
+};
+
+class InterruptibleThread {
+public:
+  using SharedCancelToken = std::shared_ptr<CancelToken>;
+
+  InterruptibleThread(std::function<void(const SharedCancelToken)> func)
+      : _cancel(std::make_shared<CancelToken>()),
+        _thread(func, _cancel) {}
+
+  ~InterruptibleThread() {
+    cancel();
+    join();
+  }
+
+  void cancel() { _cancel->cancel(); }
+  bool isCancelled() { return _cancel->isCancelled(); }
+
+  void join() {
+    if (!_thread.joinable()) {
+      return;
+    }
+
+    // A worker may end up tearing down its own device (e.g. from a failure
+    // callback); it can't join itself, and it's about to exit anyway.
+    if (_thread.get_id() == std::this_thread::get_id()) {
+      _thread.detach();
+    } else {
+      _thread.join();
+    }
+  }
+
+private:
+  SharedCancelToken _cancel;
+  std::thread _thread;
+};
@@ -1,5 +1,4 @@
 #include "MayaUsbDevice.h"
-#include "ImageUtils.h"
 #include "EndianUtils.h"
 #include <stdexcept>
 #include <sstream>
@@ -8,30 +7,70 @@
 #include <cstring>
 
 libusb_context* MayaUsbDevice::_usb(nullptr);
-tjhandle MayaUsbDevice::_jpegCompressor(nullptr);
+
+static void LIBUSB_CALL transferCompleted(libusb_transfer* transfer) {
+  *reinterpret_cast<int*>(transfer->user_data) = 1;
+}
 
 MayaUsbDevice::MayaUsbDevice(uint16_t vid, uint16_t pid)
     : MayaUsbDevice({ MayaUsbDeviceId(vid, pid) }) {}
 
 MayaUsbDevice::MayaUsbDevice(std::vector<MayaUsbDeviceId> ids)
     : _hnd(nullptr),
+      _handshakeWorker(nullptr),
       _receiveWorker(nullptr),
       _sendWorker(nullptr),
+      _pendingPose(false),
+      _credits(0),
+      _creditsLent(0),
+      _creditsEnabled(false),
+      _clockSyncEnabled(false),
+      _frameAbortEnabled(false),
+      _slicedEnabled(false),
+      _framePoseEnabled(false),
+      _frameTimeEnabled(false),
+      _sendBusy(false),
       _handshake(false),
-      _sendReady(false),
-      _rgbImageBuffer(new unsigned char[RGB_IMAGE_SIZE]),
-      _jpegBuffer(nullptr) {
+      _framesSent(0),
+      _framesDropped(0),
+      _samplesRead(0),
+      _sampleReads(0),
+      _creditWaits(0),
+      _creditResets(0),
+      _framesTooLarge(0),
+      _framesAborted(0) {
   int status;
 
-  for (const MayaUsbDeviceId& id : ids) {
-    libusb_device_handle* tempHnd =
-        libusb_open_device_with_vid_pid(_usb, id.vid, id.pid);
-    if (tempHnd != nullptr) {
-      _id = id;
-      _hnd = tempHnd;
+  // Several phones in accessory mode share the same VID/PID, so walk the
+  // whole device list and take the first one that isn't claimed yet.
+  libusb_device** devices;
+  ssize_t numDevices = libusb_get_device_list(_usb, &devices);
+  for (ssize_t i = 0; i < numDevices && _hnd == nullptr; ++i) {
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(devices[i], &desc) < 0) {
+      continue;
+    }
+
+    for (const MayaUsbDeviceId& id : ids) {
+      if (desc.idVendor != id.vid || desc.idProduct != id.pid) {
+        continue;
+      }
+
+      libusb_device_handle* tempHnd;
+      if (libusb_open(devices[i], &tempHnd) == 0) {
+        if (libusb_claim_interface(tempHnd, 0) == 0) {
+          _id = id;
+          _hnd = tempHnd;
+        } else {
+          libusb_close(tempHnd);
+        }
+      }
       break;
     }
   }
+  if (numDevices >= 0) {
+    libusb_free_device_list(devices, 1);
+  }
   if (_hnd == nullptr) {
     throw std::runtime_error("Could not create device with given VIDs/PIDs");
   }
@@ -95,38 +134,28 @@ MayaUsbDevice::MayaUsbDevice(std::vector<MayaUsbDeviceId> ids)
   }
 
   libusb_free_config_descriptor(configDesc);
-
-  status = libusb_claim_interface(_hnd, 0);
-  if (status < 0) {
-    libusb_close(_hnd);
-    throw std::runtime_error("Could not claim interface");
-  }
 }
 
 MayaUsbDevice::~MayaUsbDevice() {
-  bool receiving = _receiveWorker && !_receiveWorker->isCancelled();
-  bool sending = _sendWorker && !_sendWorker->isCancelled();
-  bool needDelay = false;
-
-  if (receiving) {
-    _receiveWorker->cancel();
-    needDelay = true;
-  }
-
-  if (sending) {
-    _sendWorker->cancel();
-    _sendCv.notify_one(); // Wake up the send loop so it can cancel.
-    needDelay = true;
+  // Cancel everything first so that the workers wind down in parallel; any
+  // in-flight bulk transfer is aborted by its cancel token.
+  for (auto worker : { _handshakeWorker, _receiveWorker, _sendWorker }) {
+    if (worker) {
+      worker->cancel();
+    }
   }
 
-  if (needDelay) {
-    // Wait 2s since our send/receive loops check every 500ms for cancel flag.
-    std::this_thread::sleep_for(std::chrono::seconds(2));
+  if (_sendWorker) {
+    // Wake up the send loop so it can cancel. Taking the mutex guarantees that
+    // the loop is either waiting or will see the flag before it waits.
+    { std::lock_guard<std::mutex> lock(_sendMutex); }
+    _sendCv.notify_one();
   }
 
-  delete[] _rgbImageBuffer;
-  if (_jpegBuffer != nullptr) {
-    tjFree(_jpegBuffer);
+  for (auto worker : { _handshakeWorker, _receiveWorker, _sendWorker }) {
+    if (worker) {
+      worker->join();
+    }
   }
 
   libusb_release_interface(_hnd, 0);
@@ -148,6 +177,83 @@ void MayaUsbDevice::flushInputBuffer(unsigned char* buf) {
   }
 }
 
+int MayaUsbDevice::bulkTransfer(
+    const InterruptibleThread::SharedCancelToken& cancel,
+    uint8_t endpoint, unsigned char* data, int length, int* transferred,
+    unsigned int timeout) {
+  *transferred = 0;
+
+  libusb_transfer* transfer = libusb_alloc_transfer(0);
+  if (transfer == nullptr) {
+    return LIBUSB_ERROR_NO_MEM;
+  }
+
+  int completed = 0;
+  libusb_fill_bulk_transfer(transfer,
+      _hnd,
+      endpoint,
+      data,
+      length,
+      transferCompleted,
+      &completed,
+      timeout);
+
+  if (!cancel->setInterrupt([=] { libusb_cancel_transfer(transfer); })) {
+    libusb_free_transfer(transfer);
+    return LIBUSB_ERROR_INTERRUPTED;
+  }
+
+  int status = libusb_submit_transfer(transfer);
+  if (status < 0) {
+    cancel->clearInterrupt();
+    libusb_free_transfer(transfer);
+    return status;
+  }
+
+  // Catch a cancel that landed between installing the hook and submitting.
+  if (cancel->isCancelled()) {
+    libusb_cancel_transfer(transfer);
+  }
+
+  // Same event loop as libusb's own synchronous transfers.
+  while (!completed) {
+    status = libusb_handle_events_completed(_usb, &completed);
+    if (status < 0 && status != LIBUSB_ERROR_INTERRUPTED) {
+      libusb_cancel_transfer(transfer);
+    }
+  }
+
+  cancel->clearInterrupt();
+
+  *transferred = transfer->actual_length;
+  switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+      status = 0;
+      break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+      status = LIBUSB_ERROR_TIMEOUT;
+      break;
+    case LIBUSB_TRANSFER_CANCELLED:
+      status = LIBUSB_ERROR_INTERRUPTED;
+      break;
+    case LIBUSB_TRANSFER_STALL:
+      status = LIBUSB_ERROR_PIPE;
+      break;
+    case LIBUSB_TRANSFER_OVERFLOW:
+      status = LIBUSB_ERROR_OVERFLOW;
+      break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      status = LIBUSB_ERROR_NO_DEVICE;
+      break;
+    default:
+      status = LIBUSB_ERROR_IO;
+      break;
+  }
+
+  libusb_free_transfer(transfer);
+  return status;
+}
+
 std::string MayaUsbDevice::getDescription() {
   std::ostringstream os;
   os << std::setfill('0') << std::hex
@@ -247,20 +353,22 @@ bool MayaUsbDevice::waitHandshakeAsync(std::function<void(bool)> callback) {
     return false;
   }
 
-  _receiveWorker = std::make_shared<InterruptibleThread>(
-    [=](const InterruptibleThread::SharedAtomicBool cancel) {
-      unsigned char* inputBuffer = new unsigned char[BUFFER_LEN];
-      flushInputBuffer(inputBuffer);
+  _handshakeWorker = std::make_shared<InterruptibleThread>(
+    [=](const InterruptibleThread::SharedCancelToken cancel) {
+      FrameBuffer inputBuffer;
+      inputBuffer.allocate(BUFFER_LEN);
+      flushInputBuffer(inputBuffer.data());
 
       int i = 0;
       int read = 0;
       int status = LIBUSB_ERROR_TIMEOUT;
       bool cancelled;
-      while (!(cancelled = cancel->load()) && status == LIBUSB_ERROR_TIMEOUT) {
+      while (!(cancelled = cancel->isCancelled()) &&
+          status == LIBUSB_ERROR_TIMEOUT) {
         std::cout << i++ << " Waiting..." << std::endl;
-        status = libusb_bulk_transfer(_hnd,
+        status = bulkTransfer(cancel,
             _inEndpoint,
-            inputBuffer,
+            inputBuffer.data(),
             BUFFER_LEN,
             &read,
             500);
@@ -269,42 +377,331 @@ bool MayaUsbDevice::waitHandshakeAsync(std::function<void(bool)> callback) {
       if (cancelled) {
         std::cout << "Handshake cancelled!" << std::endl;
       } else {
-        bool success = true;
-        if (read == BUFFER_LEN) {
-          for (int i = 0; i < BUFFER_LEN; ++i) {
-            unsigned char expected = (unsigned char) i;
-            if (inputBuffer[i] != expected) {
-              std::cout << "Handshake expect=" << (int) expected
-                        << ", receive=" << (int) inputBuffer[i] << std::endl;
-              success = false;
-              break;
-            }
-          }
-        } else {
-          std::cout << "Handshake read=" << read << std::endl;
-          success = false;
-        }
-        std::cout << "Received handshake, status=" << status << std::endl;
+        bool success = status == 0 && parseHello(inputBuffer.data(), read);
+        std::cout << "Received handshake, status=" << status
+                  << ", read=" << read << ", valid=" << success << std::endl;
 
         _handshake.store(success);
         callback(success);
       }
 
-      delete[] inputBuffer;
-      cancel->store(true);
+      inputBuffer.release();
     }
   );
 
   return true;
 }
 
+bool MayaUsbDevice::parseHello(const unsigned char* data, size_t length) {
+  if (length < 8) {
+    return false;
+  }
+
+  // Big-endian fields at fixed offsets; see HELLO_LEN.
+  auto u8 = [&](size_t offset) { return data[offset]; };
+  auto u16 = [&](size_t offset) {
+    uint16_t value;
+    std::memcpy(&value, data + offset, sizeof(value));
+    return EndianUtils::bigToNative(value);
+  };
+  auto u32 = [&](size_t offset) {
+    uint32_t value;
+    std::memcpy(&value, data + offset, sizeof(value));
+    return EndianUtils::bigToNative(value);
+  };
+
+  uint16_t version = u16(4);
+  uint16_t helloLength = u16(6);
+  if (u32(0) != PROTOCOL_MAGIC || version < 1 || helloLength < HELLO_LEN ||
+      helloLength > length) {
+    std::cout << "Handshake magic=" << std::hex << u32(0) << std::dec
+              << ", version=" << version << ", length=" << helloLength
+              << std::endl;
+    return false;
+  }
+
+  float refreshRate;
+  uint32_t refreshRateBits = u32(16);
+  std::memcpy(&refreshRate, &refreshRateBits, sizeof(refreshRate));
+
+  DeviceCapabilities capabilities;
+  capabilities.version = std::min(version, PROTOCOL_VERSION);
+  capabilities.codecs = u32(8);
+  capabilities.maxDecodeWidth = u16(12);
+  capabilities.maxDecodeHeight = u16(14);
+  capabilities.refreshRate = refreshRate > 0.0f ? refreshRate : 0.0f;
+  capabilities.eyeLayouts = u8(20);
+  capabilities.preferredEyeLayout = u8(21);
+  capabilities.maxTransferSize = u32(24);
+  capabilities.features = u32(28);
+  _capabilities = capabilities;
+
+  std::cout << "Device protocol " << version << ", codecs="
+            << capabilities.codecs << ", decode "
+            << capabilities.maxDecodeWidth << "x"
+            << capabilities.maxDecodeHeight << ", "
+            << capabilities.refreshRate << "Hz, layouts="
+            << (int) capabilities.eyeLayouts << ", maxTransfer="
+            << capabilities.maxTransferSize << ", features="
+            << capabilities.features << std::endl;
+  return true;
+}
+
+bool MayaUsbDevice::sendReply(
+    const InterruptibleThread::SharedCancelToken& cancel) {
+  unsigned char reply[REPLY_LEN] = {};
+  uint32_t magic = EndianUtils::nativeToBig(PROTOCOL_MAGIC);
+  uint16_t version = EndianUtils::nativeToBig(_capabilities.version);
+  uint16_t length = EndianUtils::nativeToBig((uint16_t) REPLY_LEN);
+  uint32_t features = EndianUtils::nativeToBig(
+      _capabilities.features & HOST_FEATURES);
+  std::memcpy(reply + 0, &magic, sizeof(magic));
+  std::memcpy(reply + 4, &version, sizeof(version));
+  std::memcpy(reply + 6, &length, sizeof(length));
+  reply[8] = 0; // CODEC_JPEG is the only codec so far.
+  reply[9] = _settings.eyeLayout;
+  std::memcpy(reply + 12, &features, sizeof(features));
+
+  int written = 0;
+  bulkTransfer(cancel, _outEndpoint, reply, REPLY_LEN, &written, 500);
+  return written == REPLY_LEN;
+}
+
+bool MayaUsbDevice::sendPing(
+    const InterruptibleThread::SharedCancelToken& cancel) {
+  unsigned char ping[PING_LEN];
+  uint32_t marker = EndianUtils::nativeToBig(PING_MARKER);
+  std::memcpy(ping, &marker, sizeof(marker));
+
+  // Stamp t1 as late as possible before the transfer.
+  uint32_t sequence = EndianUtils::nativeToBig(
+      _clockSync.pingSent(ClockSync::Clock::now()));
+  std::memcpy(ping + 4, &sequence, sizeof(sequence));
+
+  int written = 0;
+  bulkTransfer(cancel, _outEndpoint, ping, PING_LEN, &written, 500);
+  return written == PING_LEN;
+}
+
+bool MayaUsbDevice::sendFramePose(
+    const InterruptibleThread::SharedCancelToken& cancel,
+    const FramePose& pose) {
+  const float fields[] = {
+    pose.rotation[0], pose.rotation[1], pose.rotation[2], pose.rotation[3],
+    pose.fovX, pose.fovY, pose.eyeOffsets[0], pose.eyeOffsets[1],
+  };
+  static_assert(4 + sizeof(fields) == POSE_LEN, "POSE_LEN is out of date");
+
+  unsigned char header[POSE_LEN];
+  uint32_t marker = EndianUtils::nativeToBig(POSE_MARKER);
+  std::memcpy(header, &marker, sizeof(marker));
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+    float field = EndianUtils::nativeToBigFloat(fields[i]);
+    std::memcpy(header + 4 + i * sizeof(field), &field, sizeof(field));
+  }
+
+  int written = 0;
+  bulkTransfer(cancel, _outEndpoint, header, POSE_LEN, &written, 500);
+  return written == POSE_LEN;
+}
+
+/*
+ * Sends nothing (and succeeds) if the frame has no capture time, i.e. it's
+ * a panorama face, or the clocks haven't been compared yet.
+ */
+bool MayaUsbDevice::sendFrameTime(
+    const InterruptibleThread::SharedCancelToken& cancel,
+    ClockSync::Clock::time_point captureTime) {
+  int64_t deviceTimeNs;
+  if (captureTime == ClockSync::Clock::time_point() ||
+      !_clockSync.toDeviceTime(captureTime, deviceTimeNs)) {
+    return true;
+  }
+
+  unsigned char header[TIME_LEN];
+  uint32_t marker = EndianUtils::nativeToBig(TIME_MARKER);
+  uint64_t time = EndianUtils::nativeToBig((uint64_t) deviceTimeNs);
+  std::memcpy(header, &marker, sizeof(marker));
+  std::memcpy(header + 4, &time, sizeof(time));
+
+  int written = 0;
+  bulkTransfer(cancel, _outEndpoint, header, TIME_LEN, &written, 500);
+  return written == TIME_LEN;
+}
+
+bool MayaUsbDevice::probeLink(
+    const InterruptibleThread::SharedCancelToken& cancel, LinkProbe& probe) {
+  using Clock = ClockSync::Clock;
+
+  // Whole BUFFER_LEN transfers, like a frame's, each one a probe record. The
+  // contents don't matter.
+  FrameBuffer buffer;
+  if (!buffer.allocate(BUFFER_LEN)) {
+    return false;
+  }
+  std::memset(buffer.data(), 0, BUFFER_LEN);
+  uint32_t marker = EndianUtils::nativeToBig(PROBE_MARKER);
+  uint32_t length = EndianUtils::nativeToBig((uint32_t) (BUFFER_LEN - 8));
+  std::memcpy(buffer.data(), &marker, sizeof(marker));
+  std::memcpy(buffer.data() + 4, &length, sizeof(length));
+
+  // Sustained throughput, including the device reading the data back out.
+  Clock::time_point start = Clock::now();
+  Clock::time_point deadline = start + std::chrono::milliseconds(PROBE_MAX_MS);
+  uint64_t bytes = 0;
+  while (bytes < PROBE_MAX_BYTES && Clock::now() < deadline) {
+    int written = 0;
+    bulkTransfer(cancel, _outEndpoint, buffer.data(), BUFFER_LEN, &written,
+        500);
+    if (written < (int) BUFFER_LEN) {
+      return false;
+    }
+    bytes += BUFFER_LEN;
+  }
+  double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  buffer.release();
+
+  // The round trip is the clock sync's first round of pings.
+  deadline = Clock::now() + std::chrono::milliseconds(PROBE_PING_MS);
+  ClockSync::Estimate clock = _clockSync.getEstimate();
+  while (_clockSyncEnabled && !clock.valid && Clock::now() < deadline) {
+    Clock::time_point pingTime = _clockSync.nextPingTime();
+    if (Clock::now() >= pingTime) {
+      if (!sendPing(cancel)) {
+        return false;
+      }
+    } else {
+      std::unique_lock<std::mutex> lock(_sendMutex);
+      _sendCv.wait_until(lock, std::min(pingTime, deadline), [&] {
+        return cancel->isCancelled();
+      });
+    }
+    if (cancel->isCancelled()) {
+      return false;
+    }
+    clock = _clockSync.getEstimate();
+  }
+
+  probe.valid = seconds > 0.0;
+  probe.bytes = bytes;
+  probe.bytesPerSecond = seconds > 0.0 ? bytes / seconds : 0.0;
+  probe.roundTripMs = clock.valid ? clock.roundTripNs / 1e6 : 0.0;
+  std::cout << "Link probe: " << bytes << " bytes in " << seconds * 1000.0
+            << "ms (" << probe.bytesPerSecond / (1024.0 * 1024.0)
+            << " MB/s), round trip " << probe.roundTripMs << "ms"
+            << std::endl;
+  return true;
+}
+
+bool MayaUsbDevice::sendChunks(
+    const InterruptibleThread::SharedCancelToken& cancel,
+    const unsigned char* data, size_t size, unsigned char* staging,
+    size_t abortBefore, bool markLast, bool& aborted) {
+  aborted = false;
+  const size_t chunkData = BUFFER_LEN - CHUNK_HEADER_LEN;
+  for (size_t i = 0; i < size; i += chunkData) {
+    // Past abortBefore (normally half of the frame), finishing the frame is
+    // quicker than starting the newer one over.
+    if (i < abortBefore) {
+      // A newer frame that the device can't take will only be skipped, so
+      // it's no reason to give this one up.
+      bool newer;
+      {
+        std::lock_guard<std::mutex> lock(_sendMutex);
+        bool tooLarge;
+        newer = _pendingFrame != nullptr &&
+            acceptsFrame(*_pendingFrame, tooLarge);
+      }
+      if (newer) {
+        aborted = true;
+        return sendAbort(cancel);
+      }
+    }
+
+    size_t chunk = std::min(chunkData, size - i);
+    uint32_t length = (uint32_t) chunk;
+    if (markLast && i + chunk == size) {
+      length |= LAST_CHUNK;
+    }
+    uint32_t header = EndianUtils::nativeToBig(length);
+    std::memcpy(staging, &header, sizeof(header));
+    std::memcpy(staging + CHUNK_HEADER_LEN, data + i, chunk);
+
+    int written = 0;
+    int transferLength = (int) (CHUNK_HEADER_LEN + chunk);
+    bulkTransfer(cancel, _outEndpoint, staging, transferLength, &written,
+        500);
+    if (written < transferLength) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool MayaUsbDevice::sendSlices(
+    const InterruptibleThread::SharedCancelToken& cancel,
+    const JpegFrame& frame, unsigned char* staging, bool mayAbort,
+    bool& aborted) {
+  aborted = false;
+  uint32_t header[2] = {
+    EndianUtils::nativeToBig(SLICED_MARKER),
+    EndianUtils::nativeToBig((uint32_t) frame.sliceCount),
+  };
+  int written = 0;
+  bulkTransfer(cancel, _outEndpoint, reinterpret_cast<unsigned char*>(header),
+      sizeof(header), &written, 500);
+  if (written < (int) sizeof(header)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < frame.sliceCount; ++i) {
+    // Each slice goes out as soon as the encoder publishes it, so sending
+    // overlaps compressing the rest of the frame.
+    size_t begin = 0;
+    size_t end = 0;
+    if (!frame.waitForSlice(i, begin, end) ||
+        (_capabilities.maxTransferSize > 0 &&
+         end - begin > _capabilities.maxTransferSize)) {
+      aborted = true; // The encoder gave up on the frame, or the device would.
+      return sendAbort(cancel);
+    }
+
+    // Like a whole frame, a sliced one is only aborted in its first half.
+    size_t abortBefore = mayAbort && i < frame.sliceCount / 2 ? end - begin : 0;
+    if (!sendChunks(cancel, frame.data() + begin, end - begin, staging,
+        abortBefore, true, aborted)) {
+      return false;
+    }
+    if (aborted) {
+      return true;
+    }
+  }
+  return true;
+}
+
+bool MayaUsbDevice::sendAbort(
+    const InterruptibleThread::SharedCancelToken& cancel) {
+  uint32_t marker = EndianUtils::nativeToBig(ABORT_MARKER);
+  int written = 0;
+  bulkTransfer(cancel, _outEndpoint,
+      reinterpret_cast<unsigned char*>(&marker), sizeof(marker), &written,
+      500);
+  return written == sizeof(marker);
+}
+
+LinkProbe MayaUsbDevice::getLinkProbe() {
+  std::lock_guard<std::mutex> lock(_sendMutex);
+  return _linkProbe;
+}
+
 bool MayaUsbDevice::isHandshakeComplete() {
   return _handshake.load();
 }
 
 bool MayaUsbDevice::beginReadLoop(
     std::function<void(const unsigned char*)> callback,
-    size_t readFrame) {
+    std::function<void(const unsigned char*)> streamCallback) {
   if (_inEndpoint == 0) {
     return false;
   }
@@ -314,24 +711,81 @@ bool MayaUsbDevice::beginReadLoop(
   }
 
   _receiveWorker = std::make_shared<InterruptibleThread>(
-    [=](const InterruptibleThread::SharedAtomicBool cancel) {
-      unsigned char* inputBuffer = new unsigned char[readFrame];
+    [=](const InterruptibleThread::SharedCancelToken cancel) {
+      // Room for a whole read after the partial message left by the last one.
+      FrameBuffer inputBuffer;
+      inputBuffer.allocate(READ_BUFFER_LEN + MESSAGE_LEN);
+      unsigned char* data = inputBuffer.data();
+      size_t pending = 0;
       int read = 0;
       int status = LIBUSB_ERROR_TIMEOUT;
       bool cancelled;
-      while (!(cancelled = cancel->load()) &&
+      while (!(cancelled = cancel->isCancelled()) &&
           (status == 0 || status == LIBUSB_ERROR_TIMEOUT)) {
-        status = libusb_bulk_transfer(_hnd,
+        status = bulkTransfer(cancel,
             _inEndpoint,
-            inputBuffer,
-            readFrame,
+            data + pending,
+            READ_BUFFER_LEN,
             &read,
             500);
-        if (status == 0) {
-          callback(inputBuffer);
+
+        // A timed-out transfer may still have received part of the data.
+        if ((status == 0 || status == LIBUSB_ERROR_TIMEOUT) && read > 0) {
+          size_t available = pending + read;
+          size_t count = available / MESSAGE_LEN;
+          // Stamped as early as we can; the pong's round trip includes the
+          // rest of the read.
+          ClockSync::Clock::time_point readTime = ClockSync::Clock::now();
+          const unsigned char* newestPose = nullptr;
+          uint32_t credits = 0;
+          for (size_t i = 0; i < count; ++i) {
+            const unsigned char* message = data + i * MESSAGE_LEN;
+            const unsigned char* payload = message + 4;
+            uint32_t type;
+            std::memcpy(&type, message, sizeof(type));
+            switch (EndianUtils::bigToNative(type)) {
+              case MESSAGE_POSE:
+                _samplesRead++;
+                newestPose = payload;
+                if (streamCallback) {
+                  streamCallback(payload);
+                }
+                break;
+              case MESSAGE_CREDIT: {
+                uint32_t granted;
+                std::memcpy(&granted, payload, sizeof(granted));
+                credits += EndianUtils::bigToNative(granted);
+                break;
+              }
+              case MESSAGE_PONG: {
+                uint32_t sequence;
+                uint32_t hold;
+                int64_t received;
+                std::memcpy(&sequence, payload, sizeof(sequence));
+                std::memcpy(&hold, payload + 4, sizeof(hold));
+                std::memcpy(&received, payload + 8, sizeof(received));
+                _clockSync.pongReceived(EndianUtils::bigToNative(sequence),
+                    EndianUtils::bigToNative(received),
+                    EndianUtils::bigToNative(hold), readTime);
+                break;
+              }
+              default:
+                break; // From a newer device; skip it.
+            }
+          }
+
+          if (credits > 0) {
+            grantCredits(credits);
+          }
+          if (newestPose != nullptr) {
+            _sampleReads++;
+            callback(newestPose);
+          }
+          pending = available - count * MESSAGE_LEN;
+          std::memmove(data, data + count * MESSAGE_LEN, pending);
         }
       }
-      delete[] inputBuffer;
+      inputBuffer.release();
 
       if (!cancelled) {
         // Error if loop ended but not cancelled.
@@ -340,14 +794,15 @@ bool MayaUsbDevice::beginReadLoop(
       }
 
       std::cout << "Read loop ended" << std::endl;
-      cancel->store(true);
     }
   );
 
   return true;
 }
 
-bool MayaUsbDevice::beginSendLoop(std::function<void()> failureCallback) {
+bool MayaUsbDevice::beginSendLoop(const StreamSettings& settings,
+    std::function<void()> failureCallback,
+    std::function<void(const LinkProbe&)> probeCallback) {
   if (_outEndpoint == 0) {
     return false;
   }
@@ -356,152 +811,316 @@ bool MayaUsbDevice::beginSendLoop(std::function<void()> failureCallback) {
     return false;
   }
 
-  // Reset in case there was a previous send loop.
-  _sendReady = false;
+  // Reset in case there was a previous send loop. The device grants its
+  // first credits once its read loop is up.
+  {
+    std::lock_guard<std::mutex> lock(_sendMutex);
+    _pendingFrame = nullptr;
+    _credits = 0;
+    _creditsLent = 0;
+    _creditsEnabled = (_capabilities.features & HOST_FEATURES &
+        FEATURE_CREDITS) != 0;
+    _clockSyncEnabled = (_capabilities.features & HOST_FEATURES &
+        FEATURE_CLOCK_SYNC) != 0;
+    _frameAbortEnabled = (_capabilities.features & HOST_FEATURES &
+        FEATURE_FRAME_ABORT) != 0;
+    _slicedEnabled = supportsSlicedFrames();
+    _framePoseEnabled = (_capabilities.features & HOST_FEATURES &
+        FEATURE_FRAME_POSE) != 0;
+    _frameTimeEnabled = _clockSyncEnabled &&
+        (_capabilities.features & HOST_FEATURES & FEATURE_FRAME_TIME) != 0;
+    _sendBusy = false;
+    _linkProbe = LinkProbe();
+  }
+  _settings = settings;
+  _pacer.reset();
+  _clockSync.reset();
 
   _sendWorker = std::make_shared<InterruptibleThread>(
-    [=](const InterruptibleThread::SharedAtomicBool cancel) {
+    [=](const InterruptibleThread::SharedCancelToken cancel) {
+      LinkProbe probe;
+      if (!sendReply(cancel) || !probeLink(cancel, probe)) {
+        if (!cancel->isCancelled()) {
+          failureCallback();
+        }
+        std::cout << "Send loop ended" << std::endl;
+        return;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(_sendMutex);
+        _linkProbe = probe;
+      }
+      probeCallback(probe);
+
+      // Chunks are staged with their header so each is a single transfer.
+      FrameBuffer staging;
+      if (_frameAbortEnabled && !staging.allocate(BUFFER_LEN)) {
+        failureCallback();
+        std::cout << "Send loop ended" << std::endl;
+        return;
+      }
+      bool lastAborted = false;
+      ClockSync::Clock::time_point creditWaitStart;
+
       while (true) {
         bool error = false;
+        SharedJpegFrame frame;
+        bool withPose = false;
+
+        // Pings go out between frames, so they're never stuck behind one.
+        if (_clockSyncEnabled &&
+            ClockSync::Clock::now() >= _clockSync.nextPingTime() &&
+            !sendPing(cancel)) {
+          if (!cancel->isCancelled()) {
+            failureCallback();
+          }
+          break;
+        }
 
         {
           std::unique_lock<std::mutex> lock(_sendMutex);
-          _sendCv.wait(lock, [&] {
-            return _sendReady || cancel->load();
-          });
-
-          if (cancel->load()) {
-            int written = 0;
-
-            // Write 0 buffer size.
-            uint32_t bytes = 0;
-            libusb_bulk_transfer(_hnd,
-              _outEndpoint,
-              reinterpret_cast<unsigned char*>(&bytes),
-              4,
-              &written,
-              500);
-
-            // Ignore if written or not.
-            break;
-          } else {
-            unsigned long jpegBufferSizeUlong;
-            tjCompress2(_jpegCompressor,
-              _rgbImageBuffer,
-              _jpegBufferWidth,
-              0,
-              _jpegBufferHeight,
-              TJPF_RGBX,
-              &_jpegBuffer,
-              &jpegBufferSizeUlong,
-              TJSAMP_420,
-              100 /* quality 1 to 100 */,
-              0);
-
-            _jpegBufferSize = jpegBufferSizeUlong;
-            int written = 0;
-
-            // Write size of JPEG (32-bit int).
-            uint32_t header = EndianUtils::nativeToBig(
-              (uint32_t)_jpegBufferSize);
-
-            libusb_bulk_transfer(_hnd,
-              _outEndpoint,
-              reinterpret_cast<unsigned char*>(&header),
-              sizeof(header),
-              &written,
-              500);
-            if (written < sizeof(header)) {
-              error = true;
-            } else {
-              // Write JPEG in BUFFER_LEN chunks.
-              for (int i = 0; i < _jpegBufferSize; i += BUFFER_LEN) {
-                written = 0;
-
-                int chunk = std::min(BUFFER_LEN, _jpegBufferSize - i);
-                libusb_bulk_transfer(_hnd,
-                  _outEndpoint,
-                  _jpegBuffer + i,
-                  chunk,
-                  &written,
-                  500);
-
-                if (written < chunk) {
-                  error = true;
-                  break;
-                }
+          _sendBusy = false;
+          auto ready = [&] {
+            return _pendingFrame || cancel->isCancelled();
+          };
+          if (!_clockSyncEnabled) {
+            _sendCv.wait(lock, ready);
+          } else if (!_sendCv.wait_until(lock, _clockSync.nextPingTime(),
+              ready)) {
+            continue; // Time for a ping.
+          }
+
+          // Wait until the device has room for another frame. Anything
+          // queued meanwhile replaces the pending frame, so the device gets
+          // the newest one and never builds up a backlog. Pings still go
+          // out while waiting, and a credit that hasn't come after
+          // CREDIT_TIMEOUT_MS is assumed lost and lent to the send; if the
+          // device really stopped reading, that transfer times out instead.
+          if (_creditsEnabled && _credits == 0 && !cancel->isCancelled()) {
+            ClockSync::Clock::time_point now = ClockSync::Clock::now();
+            if (creditWaitStart == ClockSync::Clock::time_point()) {
+              creditWaitStart = now;
+              _creditWaits++;
+            }
+            ClockSync::Clock::time_point creditDeadline = creditWaitStart +
+                std::chrono::milliseconds(CREDIT_TIMEOUT_MS);
+            ClockSync::Clock::time_point deadline = _clockSyncEnabled
+                ? std::min(_clockSync.nextPingTime(), creditDeadline)
+                : creditDeadline;
+            if (!_sendCv.wait_until(lock, deadline, [&] {
+                  return _credits > 0 || cancel->isCancelled();
+                })) {
+              if (ClockSync::Clock::now() < creditDeadline) {
+                continue; // Time for a ping.
               }
+              _credits = 1;
+              _creditsLent++;
+              _creditResets++;
+              std::cout << "No credit for " << CREDIT_TIMEOUT_MS
+                  << " ms, assuming it was lost" << std::endl;
+            }
+          }
+          creditWaitStart = ClockSync::Clock::time_point();
+
+          // Hold off until the frame's slot in the pacing schedule. A newer
+          // frame queued in the meantime replaces this one, so we always
+          // send the freshest frame available at the slot.
+          FramePacer::Clock::time_point sendTime = _pacer.nextSendTime();
+          if (sendTime > FramePacer::Clock::now()) {
+            _sendCv.wait_until(lock, sendTime, [&] {
+              return cancel->isCancelled();
+            });
+          }
+
+          if (!cancel->isCancelled()) {
+            frame.swap(_pendingFrame);
+            withPose = _pendingPose;
+            _sendBusy = true;
+            if (_creditsEnabled) {
+              _credits--;
             }
           }
         }
 
+        if (!frame) {
+          int written = 0;
+
+          // Write 0 buffer size. The token is already cancelled, so use a
+          // plain transfer with a short timeout.
+          uint32_t bytes = 0;
+          libusb_bulk_transfer(_hnd,
+            _outEndpoint,
+            reinterpret_cast<unsigned char*>(&bytes),
+            4,
+            &written,
+            TERMINATE_TIMEOUT_MS);
+
+          // Ignore if written or not.
+          break;
+        }
+
+        // Don't send what the device would have to reject; its credit is
+        // still free for the next frame. A sliced frame is still being
+        // encoded, so its slices are checked as they're sent. Sliced frames
+        // (or panorama faces) only reach a device without them while the
+        // panel turns them off for it, or disconnects it.
+        bool sliced = frame->sliceCount > 1;
+        bool face = frame->face >= 0;
+        bool tooLarge;
+        if (!acceptsFrame(*frame, tooLarge)) {
+          if (tooLarge) {
+            _framesTooLarge++;
+          }
+          if (_creditsEnabled) {
+            std::lock_guard<std::mutex> lock(_sendMutex);
+            _credits++;
+          }
+          continue;
+        }
+
+        // The frame is shared with the other devices' queues; only read it.
+        FramePacer::Clock::time_point start = FramePacer::Clock::now();
+        bool aborted = false;
+
+        // Always let the frame after an aborted one through, so frames
+        // still arrive when they're queued faster than they can be sent.
+        // A face is kept until it's replaced, so it must arrive whole.
+        bool mayAbort = !lastAborted && !face;
+        if (face) {
+          uint32_t marker[2] = {
+            EndianUtils::nativeToBig(PANORAMA_MARKER),
+            EndianUtils::nativeToBig((uint32_t) frame->face),
+          };
+          int written = 0;
+          bulkTransfer(cancel, _outEndpoint,
+              reinterpret_cast<unsigned char*>(marker), sizeof(marker),
+              &written, 500);
+          error = written < (int) sizeof(marker);
+        } else {
+          if (withPose && _framePoseEnabled && frame->pose.valid) {
+            error = !sendFramePose(cancel, frame->pose);
+          }
+          if (!error && _frameTimeEnabled) {
+            error = !sendFrameTime(cancel, frame->pose.captureTime);
+          }
+        }
+
         if (error) {
+          // The face's marker or the frame's pose or time didn't go out.
+        } else if (sliced) {
+          error = !sendSlices(cancel, *frame, staging.data(), mayAbort,
+              aborted);
+        } else {
+          int written = 0;
+
+          // Write size of JPEG (32-bit int).
+          uint32_t header = EndianUtils::nativeToBig((uint32_t)frame->size);
+
+          bulkTransfer(cancel,
+            _outEndpoint,
+            reinterpret_cast<unsigned char*>(&header),
+            sizeof(header),
+            &written,
+            500);
+          if (written < sizeof(header)) {
+            error = true;
+          } else if (_frameAbortEnabled) {
+            error = !sendChunks(cancel, frame->data(), frame->size,
+                staging.data(), mayAbort ? frame->size / 2 : 0, false,
+                aborted);
+          } else {
+            // Write JPEG in BUFFER_LEN chunks.
+            for (size_t i = 0; i < frame->size; i += BUFFER_LEN) {
+              written = 0;
+
+              int chunk = std::min(BUFFER_LEN, frame->size - i);
+              bulkTransfer(cancel,
+                _outEndpoint,
+                frame->data() + i,
+                chunk,
+                &written,
+                500);
+
+              if (written < chunk) {
+                error = true;
+                break;
+              }
+            }
+          }
+        }
+
+        if (cancel->isCancelled()) {
+          // Transfer was interrupted mid-frame; the device is going away.
+          break;
+        } else if (error) {
           // Only signal on a send error.
           failureCallback();
           break;
+        } else if (aborted) {
+          _framesAborted++;
         } else {
-          // Only reset send flag if successful.
-          _sendReady = false;
+          _pacer.frameSent(start, FramePacer::Clock::now());
+          _framesSent++;
         }
+        lastAborted = aborted;
       }
 
       std::cout << "Send loop ended" << std::endl;
-      cancel->store(true);
     }
   );
 
   return true;
 }
 
-bool MayaUsbDevice::supportsRasterFormat(MHWRender::MRasterFormat format) {
-  switch (format) {
-    case MHWRender::kR32G32B32A32_FLOAT:
-    case MHWRender::kR8G8B8A8_UNORM:
-      return true;
-    default:
-      return false;
-  }
+/*
+ * Whether the send loop would send frame rather than skip it; see there.
+ * tooLarge is set if it's a whole frame beyond the device's transfer size.
+ */
+bool MayaUsbDevice::acceptsFrame(const JpegFrame& frame,
+    bool& tooLarge) const {
+  bool sliced = frame.sliceCount > 1;
+  tooLarge = !sliced && _capabilities.maxTransferSize > 0 &&
+      frame.size > _capabilities.maxTransferSize;
+  return !(sliced && !_slicedEnabled) &&
+      !(frame.face >= 0 && !supportsPanorama()) && !tooLarge;
 }
 
-bool MayaUsbDevice::sendStereo(void* data,
-    MHWRender::MTextureDescription desc) {
-  // If the send loop is busy, then skip this frame.
-  if (_sendMutex.try_lock()) {
-    std::lock_guard<std::mutex> lock(_sendMutex, std::adopt_lock);
-
-    if (!_sendReady) {
-      switch (desc.fFormat) {
-        case MHWRender::kR32G32B32A32_FLOAT:
-          ImageUtils::decomposeCheckerboardStereoFloat(data,
-              desc.fWidth,
-              desc.fHeight,
-              _rgbImageBuffer,
-              RGB_IMAGE_SIZE);
-          break;
-        case MHWRender::kR8G8B8A8_UNORM:
-          ImageUtils::decomposeCheckerboardStereoUchar(data,
-              desc.fWidth,
-              desc.fHeight,
-              _rgbImageBuffer,
-              RGB_IMAGE_SIZE);
-          break;
-        default:
-          return false;
-      }
+bool MayaUsbDevice::queueFrame(SharedJpegFrame frame, bool withPose) {
+  bool dropped;
 
-      // Delay JPEG creation until send loop to improve Maya performance.
-      _jpegBufferWidth = desc.fWidth;
-      _jpegBufferHeight = desc.fHeight / 2;
+  {
+    std::lock_guard<std::mutex> lock(_sendMutex);
 
-      // Dispatch send loop.
-      _sendReady = true;
-      _sendCv.notify_one();
+    // If the send loop is still busy with an earlier frame, the frame that was
+    // waiting behind it is stale; replace it with the newer one.
+    dropped = _pendingFrame != nullptr;
+    _pendingFrame = frame;
+    _pendingPose = withPose;
+  }
+  _sendCv.notify_one();
 
-      return true;
-    }
+  if (dropped) {
+    _framesDropped++;
   }
+  return !dropped;
+}
+
+bool MayaUsbDevice::isSendIdle() {
+  std::lock_guard<std::mutex> lock(_sendMutex);
+  return !_pendingFrame && !_sendBusy;
+}
 
-  return false;
+void MayaUsbDevice::grantCredits(uint32_t credits) {
+  {
+    std::lock_guard<std::mutex> lock(_sendMutex);
+    // A late credit repays one lent after a timeout, so a slow device
+    // doesn't end up with more frames in flight than it granted.
+    uint32_t repaid = std::min(credits, _creditsLent);
+    _creditsLent -= repaid;
+    _credits += credits - repaid;
+  }
+  _sendCv.notify_one();
 }
 
 void MayaUsbDevice::initUsb() {
@@ -519,19 +1138,3 @@ void MayaUsbDevice::exitUsb() {
   }
   _usb = nullptr;
 }
-
-void MayaUsbDevice::initJpeg() {
-  if (_jpegCompressor) {
-    return;
-  }
-  _jpegCompressor = tjInitCompress();
-  std::cout << "TurboJPEG INIT" << std::endl;
-}
-
-void MayaUsbDevice::exitJpeg() {
-  if (_jpegCompressor) {
-    tjDestroy(_jpegCompressor);
-    std::cout << "TurboJPEG EXIT" << std::endl;
-  }
-  _jpegCompressor = nullptr;
-}
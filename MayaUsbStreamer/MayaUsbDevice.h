@@ -1,39 +1,19 @@
 #pragma once
 
-#include <maya/MTextureManager.h>
 #include <libusb-1.0/libusb.h>
-#include <turbojpeg.h>
 #include <cstdint>
 #include <string>
 #include <vector>
+#include <memory>
 #include <functional>
 #include <atomic>
-#include <thread>
 #include <mutex>
 #include <condition_variable>
 
-class InterruptibleThread {
-public:
-  using SharedAtomicBool = std::shared_ptr<std::atomic_bool>;
-
-  InterruptibleThread(std::function<void(const SharedAtomicBool)> func) {
-    _cancel = std::make_shared<std::atomic_bool>(false);
-    std::thread thread([=]() {
-      func(_cancel);
-    });
-    thread.detach();
-  }
-
-  ~InterruptibleThread() {
-    cancel();
-  }
-
-  void cancel() { _cancel->store(true); }
-  bool isCancelled() { return _cancel->load(); }
-
-private:
-  SharedAtomicBool _cancel;
-};
+#include "InterruptibleThread.h"
+#include "StereoEncoder.h"
+#include "FramePacer.h"
+#include "ClockSync.h"
 
 struct MayaUsbDeviceId {
   uint16_t vid;
@@ -48,12 +28,199 @@ struct MayaUsbDeviceId {
   }
 };
 
+/**
+ * What a device told us about itself in its hello, the first thing it sends.
+ * Layouts, codecs and features are bit masks of the constants in
+ * MayaUsbDevice.
+ */
+struct DeviceCapabilities {
+  uint16_t version;
+  uint32_t codecs;
+  uint16_t maxDecodeWidth;
+  uint16_t maxDecodeHeight;
+  float refreshRate; /* Hz; 0 if unknown. */
+  uint8_t eyeLayouts;
+  uint8_t preferredEyeLayout; /* One EYE_LAYOUT_ value, not a mask. */
+  uint32_t maxTransferSize; /* Largest frame the device accepts, in bytes. */
+  uint32_t features;
+
+  DeviceCapabilities()
+      : version(0),
+        codecs(0),
+        maxDecodeWidth(0),
+        maxDecodeHeight(0),
+        refreshRate(0.0f),
+        eyeLayouts(0),
+        preferredEyeLayout(0),
+        maxTransferSize(0),
+        features(0) {}
+};
+
+/** What the host chose, sent to the device before the first frame. */
+struct StreamSettings {
+  uint8_t eyeLayout; /* An EYE_LAYOUT_ value. */
+
+  StreamSettings() : eyeLayout(0) {}
+};
+
+/** What the calibration burst after the handshake measured. */
+struct LinkProbe {
+  bool valid;
+  uint64_t bytes;        /* Sent in the burst. */
+  double bytesPerSecond; /* Sustained bulk OUT throughput to the device. */
+  double roundTripMs;    /* Fastest ping; 0 if the device doesn't answer. */
+
+  LinkProbe()
+      : valid(false), bytes(0), bytesPerSecond(0.0), roundTripMs(0.0) {}
+};
+
 class MayaUsbDevice {
-  static constexpr size_t RGB_IMAGE_SIZE = 1024 * 1024 * 16; // 16 MB.
+public:
+  /*
+   * The hello and its reply. Both start with PROTOCOL_MAGIC, a big-endian
+   * 16-bit protocol version and a 16-bit length in bytes, so that a newer
+   * version can append fields; then, all big-endian:
+   *
+   * Hello (device to host, HELLO_LEN bytes in version 1): u32 codecs,
+   * u16 max decode width, u16 max decode height, f32 display refresh rate,
+   * u8 eye layouts, u8 preferred eye layout, u16 reserved, u32 max transfer
+   * size, u32 features.
+   *
+   * Reply (host to device, REPLY_LEN bytes in version 1): u8 codec, u8 eye
+   * layout, u16 reserved, u32 features (those both sides support).
+   */
+  static constexpr uint32_t PROTOCOL_MAGIC = 0x4D555342; // "MUSB"
+  static constexpr uint16_t PROTOCOL_VERSION = 1;
+  static constexpr size_t HELLO_LEN = 32;
+  static constexpr size_t REPLY_LEN = 16;
+
+  static constexpr uint32_t CODEC_JPEG = 1 << 0;
+
+  /* Eye layouts; the masks in DeviceCapabilities use 1 << layout. */
+  static constexpr uint8_t EYE_LAYOUT_SIDE_BY_SIDE = 0;
+  static constexpr uint8_t EYE_LAYOUT_TOP_BOTTOM = 1;
+
+  /* The device sends MESSAGE_CREDIT and the host waits for credits. */
+  static constexpr uint32_t FEATURE_CREDITS = 1 << 0;
+  /* The host sends clock pings between frames; the device answers each. */
+  static constexpr uint32_t FEATURE_CLOCK_SYNC = 1 << 1;
+  /* Frames are sent in framed chunks, so the host can abort one midway. */
+  static constexpr uint32_t FEATURE_FRAME_ABORT = 1 << 2;
+  /* The device takes sliced frames (see SLICED_MARKER). */
+  static constexpr uint32_t FEATURE_SLICED_FRAMES = 1 << 3;
+  /* The device shows panoramas sent as cube faces (see PANORAMA_MARKER). */
+  static constexpr uint32_t FEATURE_PANORAMA = 1 << 4;
+  /* The device takes the pose each frame was rendered from (POSE_MARKER). */
+  static constexpr uint32_t FEATURE_FRAME_POSE = 1 << 5;
+  /* The device takes each frame's capture time (TIME_MARKER). Needs
+     FEATURE_CLOCK_SYNC as well. */
+  static constexpr uint32_t FEATURE_FRAME_TIME = 1 << 6;
+  static constexpr uint32_t HOST_FEATURES = FEATURE_CREDITS |
+      FEATURE_CLOCK_SYNC | FEATURE_FRAME_ABORT | FEATURE_SLICED_FRAMES |
+      FEATURE_PANORAMA | FEATURE_FRAME_POSE | FEATURE_FRAME_TIME;
+
+private:
   static constexpr size_t BUFFER_LEN     = 16384;
+  /* Per read; a multiple of every bulk max packet size, so it can't overflow. */
+  static constexpr size_t READ_BUFFER_LEN = 1024;
+
+  /*
+   * Everything the device sends after the handshake is a MESSAGE_LEN message:
+   * a big-endian 32-bit MessageType, then a payload. A pose is four
+   * big-endian floats (a quaternion). A credit is a big-endian 32-bit count
+   * of frames the device has room for, granted on top of earlier credits. A
+   * pong answers a ping: the ping's big-endian 32-bit sequence number, how
+   * long the device held it before replying (u32 ns), and when it received
+   * it (s64 ns on the device's monotonic clock).
+   */
+  static constexpr size_t MESSAGE_PAYLOAD_LEN = 16;
+  static constexpr size_t MESSAGE_LEN = 4 + MESSAGE_PAYLOAD_LEN;
+  enum MessageType : uint32_t {
+    MESSAGE_POSE = 1,
+    MESSAGE_CREDIT = 2,
+    MESSAGE_PONG = 3,
+  };
+
+  /*
+   * In place of a frame's size, marks a clock ping: PING_MARKER, then the
+   * big-endian 32-bit sequence number that the device's pong echoes.
+   */
+  static constexpr uint32_t PING_MARKER = 0xFFFFFFFF;
+  static constexpr size_t PING_LEN = 8;
+
+  /*
+   * In place of a frame's size, marks calibration data for the device to
+   * discard: PROBE_MARKER, a big-endian 32-bit length, then that many bytes.
+   * The burst after the reply is BUFFER_LEN-sized records of these, for up
+   * to PROBE_MAX_BYTES or PROBE_MAX_MS; then pings measure the round trip
+   * for up to PROBE_PING_MS.
+   */
+  static constexpr uint32_t PROBE_MARKER = 0xFFFFFFFE;
+  static constexpr size_t PROBE_MAX_BYTES = 4 * 1024 * 1024;
+  static constexpr int64_t PROBE_MAX_MS = 200;
+  static constexpr int64_t PROBE_PING_MS = 250;
+
+  /*
+   * With FEATURE_FRAME_ABORT, a frame's data after its size is a series of
+   * chunks, each a big-endian 32-bit length and then that many bytes, sent
+   * one chunk per transfer. ABORT_MARKER in place of a chunk's length ends
+   * the frame early; the device discards what it has and returns the frame's
+   * credit.
+   */
+  static constexpr size_t CHUNK_HEADER_LEN = 4;
+  static constexpr uint32_t ABORT_MARKER = 0xFFFFFFFF;
+
+  /*
+   * In place of a frame's size, starts a sliced frame: SLICED_MARKER and a
+   * big-endian 32-bit slice count. Each slice, a JPEG of a band of the frame
+   * from top to bottom, then follows as framed chunks (as above) whose last
+   * chunk has LAST_CHUNK set in its length, since a slice's size isn't known
+   * until it has been compressed. Needs FEATURE_FRAME_ABORT as well.
+   */
+  static constexpr uint32_t SLICED_MARKER = 0xFFFFFFFC;
+  static constexpr uint32_t LAST_CHUNK = 0x80000000;
+
+  /*
+   * In place of a frame's size, announces that the next frame (a whole one)
+   * is a panorama cube face: PANORAMA_MARKER, then the face's big-endian
+   * 32-bit index, 0 to JpegFrame::PANORAMA_FACES - 1. The faces are front
+   * (-Z), right (+X), back (+Z), left (-X), up (+Y) and down (-Y), each the
+   * front view (+Y up) turned by a yaw or, for up and down, a pitch of 90
+   * degrees or 180 for the back, and each a square stereo image with a 90
+   * degree field of view. The device keeps every face until it's replaced
+   * and turns the view itself; a plain frame goes back to the flat view.
+   * Faces are never aborted.
+   */
+  static constexpr uint32_t PANORAMA_MARKER = 0xFFFFFFFB;
+
+  /*
+   * With FEATURE_FRAME_POSE, in place of a frame's size, announces the view
+   * the next frame was rendered from: POSE_MARKER, then big-endian floats:
+   * the head's rotation quaternion (x, y, z, w, like a MESSAGE_POSE), each
+   * eye's horizontal and vertical field of view in radians, and the left
+   * and right eyes' offsets along the head's x axis in scene units (0 if the
+   * head isn't a stereo rig). Only the device whose head the frame followed
+   * gets it, and never before a panorama face.
+   */
+  static constexpr uint32_t POSE_MARKER = 0xFFFFFFFA;
+  static constexpr size_t POSE_LEN = 4 + 8 * 4;
+
+  /*
+   * With FEATURE_FRAME_TIME, in place of a frame's size, says when the next
+   * frame was captured: TIME_MARKER, then a big-endian s64 in nanoseconds on
+   * the device's monotonic clock (the one its pongs use), converted from the
+   * host's with the clock sync's estimate. Sent after any POSE_MARKER, to
+   * every device, once the estimate is valid, and never before a panorama
+   * face.
+   */
+  static constexpr uint32_t TIME_MARKER = 0xFFFFFFF9;
+  static constexpr size_t TIME_LEN = 4 + 8;
+
+  static constexpr unsigned int TERMINATE_TIMEOUT_MS = 50;
+  /** How long a frame waits for a credit before assuming it was lost. */
+  static constexpr unsigned int CREDIT_TIMEOUT_MS = 1000;
 
   static libusb_context* _usb;
-  static tjhandle _jpegCompressor;
 
   libusb_device_handle* _hnd;
 
@@ -64,25 +231,66 @@ class MayaUsbDevice {
   uint8_t _outEndpoint;
 
   std::atomic_bool _handshake;
+  DeviceCapabilities _capabilities; /* Written before _handshake is set. */
+  StreamSettings _settings; /* Only touched by the send loop once started. */
 
+  std::shared_ptr<InterruptibleThread> _handshakeWorker;
   std::shared_ptr<InterruptibleThread> _receiveWorker;
 
   std::shared_ptr<InterruptibleThread> _sendWorker;
-  bool _sendReady; /* Note: doesn't have to be atomic because we lock. */
+  SharedJpegFrame _pendingFrame; /* Latest frame not yet being sent. */
+  bool _pendingPose; /* Whether to send _pendingFrame's pose with it. */
+  uint32_t _credits; /* Frames the device can take; guarded by _sendMutex. */
+  uint32_t _creditsLent; /* Assumed lost, not yet granted; ditto. */
+  bool _creditsEnabled; /* Both sides support FEATURE_CREDITS. */
+  bool _clockSyncEnabled; /* Both sides support FEATURE_CLOCK_SYNC. */
+  bool _frameAbortEnabled; /* Both sides support FEATURE_FRAME_ABORT. */
+  bool _slicedEnabled; /* ...and FEATURE_SLICED_FRAMES. */
+  bool _framePoseEnabled; /* Both sides support FEATURE_FRAME_POSE. */
+  bool _frameTimeEnabled; /* ...FEATURE_FRAME_TIME and FEATURE_CLOCK_SYNC. */
+  bool _sendBusy; /* Sending a frame; guarded by _sendMutex. */
   std::mutex _sendMutex;
   std::condition_variable _sendCv;
 
-  unsigned char* _rgbImageBuffer;
-  unsigned char* _jpegBuffer;
-  size_t _jpegBufferSize;
-  size_t _jpegBufferWidth;
-  size_t _jpegBufferHeight;
+  FramePacer _pacer;
+  ClockSync _clockSync;
+  LinkProbe _linkProbe; /* Guarded by _sendMutex. */
+  std::atomic<uint64_t> _framesSent;
+  std::atomic<uint64_t> _framesDropped;
+  std::atomic<uint64_t> _samplesRead;
+  std::atomic<uint64_t> _sampleReads;
+  std::atomic<uint64_t> _creditWaits;
+  std::atomic<uint64_t> _creditResets;
+  std::atomic<uint64_t> _framesTooLarge;
+  std::atomic<uint64_t> _framesAborted;
+
+  void grantCredits(uint32_t credits);
+  bool parseHello(const unsigned char* data, size_t length);
+  bool sendReply(const InterruptibleThread::SharedCancelToken& cancel);
+  bool sendPing(const InterruptibleThread::SharedCancelToken& cancel);
+  bool sendFramePose(const InterruptibleThread::SharedCancelToken& cancel,
+      const FramePose& pose);
+  bool sendFrameTime(const InterruptibleThread::SharedCancelToken& cancel,
+      ClockSync::Clock::time_point captureTime);
+  bool probeLink(const InterruptibleThread::SharedCancelToken& cancel,
+      LinkProbe& probe);
+  bool sendChunks(const InterruptibleThread::SharedCancelToken& cancel,
+      const unsigned char* data, size_t size, unsigned char* staging,
+      size_t abortBefore, bool markLast, bool& aborted);
+  bool sendSlices(const InterruptibleThread::SharedCancelToken& cancel,
+      const JpegFrame& frame, unsigned char* staging, bool mayAbort,
+      bool& aborted);
+  bool sendAbort(const InterruptibleThread::SharedCancelToken& cancel);
+  bool acceptsFrame(const JpegFrame& frame, bool& tooLarge) const;
 
   int16_t getControlInt16(uint8_t request);
   void sendControl(uint8_t request);
   void sendControlString(uint8_t request, uint16_t index, std::string str);
 
   void flushInputBuffer(unsigned char* buf);
+  int bulkTransfer(const InterruptibleThread::SharedCancelToken& cancel,
+      uint8_t endpoint, unsigned char* data, int length, int* transferred,
+      unsigned int timeout);
 
 public:
   MayaUsbDevice(uint16_t vid, uint16_t pid);
@@ -91,16 +299,73 @@ public:
   ~MayaUsbDevice();
   std::string getDescription();
   void convertToAccessory();
+  /**
+   * Waits for the device's hello on a worker thread, then calls callback
+   * with whether it was valid. The capabilities are available from then on.
+   */
   bool waitHandshakeAsync(std::function<void(bool)> callback);
   bool isHandshakeComplete();
+  const DeviceCapabilities& getCapabilities() const { return _capabilities; }
+  /**
+   * Reads the device's messages on a worker thread. Credits go to the send
+   * loop. Poses (MESSAGE_PAYLOAD_LEN bytes each) are passed one by one,
+   * oldest first, to streamCallback if given; then only the newest pose of
+   * each read goes to callback. Consumers that only need the latest pose
+   * therefore run once per read, not once per sample. callback gets nullptr
+   * if the connection fails.
+   */
   bool beginReadLoop(std::function<void(const unsigned char*)> callback,
-      size_t readFrame);
-  bool beginSendLoop(std::function<void()> failureCallback);
-  bool sendStereo(void* data, MHWRender::MTextureDescription desc);
-  static bool supportsRasterFormat(MHWRender::MRasterFormat format);
+      std::function<void(const unsigned char*)> streamCallback = nullptr);
+  /**
+   * Sends the reply with settings, then measures the link with a short
+   * calibration burst and passes the result to probeCallback (on the send
+   * loop's thread, before any frame is sent). Then sends the newest queued
+   * frame whenever the pacing schedule allows and the device has a credit
+   * for it, so the device never has more frames queued or decoding than it
+   * asked for. Frames over the device's max transfer size are dropped. Clock
+   * pings go out between frames if the device supports them. If the device
+   * supports framed chunks, a frame that's less than half sent when a newer
+   * one is queued is aborted in favor of the newer one, though never two in
+   * a row. Each slice of a sliced frame is sent as soon as it's encoded.
+   * A frame queued withPose is preceded by the pose it was rendered from,
+   * if the device takes it.
+   */
+  bool beginSendLoop(const StreamSettings& settings,
+      std::function<void()> failureCallback,
+      std::function<void(const LinkProbe&)> probeCallback);
+  bool queueFrame(SharedJpegFrame frame, bool withPose = false);
+  uint64_t getFramesSent() const { return _framesSent.load(); }
+  uint64_t getFramesDropped() const { return _framesDropped.load(); }
+  uint64_t getSamplesRead() const { return _samplesRead.load(); }
+  uint64_t getSampleReads() const { return _sampleReads.load(); }
+  /** Times a frame was ready but the device had no credit for it. */
+  uint64_t getCreditWaits() const { return _creditWaits.load(); }
+  /** Times a credit never came and was assumed lost. */
+  uint64_t getCreditResets() const { return _creditResets.load(); }
+  uint64_t getFramesTooLarge() const { return _framesTooLarge.load(); }
+  /** Whether sliced frames can be sent to this device. */
+  bool supportsSlicedFrames() const {
+    return (_capabilities.features & HOST_FEATURES & FEATURE_FRAME_ABORT) &&
+        (_capabilities.features & HOST_FEATURES & FEATURE_SLICED_FRAMES);
+  }
+  /** Whether panorama faces can be sent to this device. */
+  bool supportsPanorama() const {
+    return (_capabilities.features & HOST_FEATURES & FEATURE_PANORAMA) != 0;
+  }
+  /**
+   * Whether the send loop has nothing queued and nothing in progress, i.e.
+   * the device has every frame queued so far, or dropped it.
+   */
+  bool isSendIdle();
+  /** Frames abandoned midway because a newer one was ready. */
+  uint64_t getFramesAborted() const { return _framesAborted.load(); }
+  void setTargetFrameRate(double rate) { _pacer.setTargetRate(rate); }
+  double getTargetFrameRate() const { return _pacer.getTargetRate(); }
+  FramePacer::Stats getPacingStats() const { return _pacer.getStats(); }
+  /** Maps between the host's steady clock and the device's clock. */
+  const ClockSync& getClockSync() const { return _clockSync; }
+  LinkProbe getLinkProbe();
 
   static void initUsb();
   static void exitUsb();
-  static void initJpeg();
-  static void exitJpeg();
 };
@@ -2,6 +2,8 @@
 #include <maya/MPxCommand.h>
 #include <maya/MFnPlugin.h>
 #include <maya/MFnTransform.h>
+#include <maya/MFnCamera.h>
+#include <maya/MPlug.h>
 #include <maya/MSyntax.h>
 #include <maya/MGlobal.h>
 #include <maya/M3dView.h>
@@ -10,15 +12,28 @@
 #include <maya/MViewport2Renderer.h>
 #include <maya/MDrawContext.h>
 #include <maya/MArgDatabase.h>
+#include <maya/MTimerMessage.h>
+#include <maya/MEventMessage.h>
+#include <maya/MDGMessage.h>
 #include <libusb-1.0/libusb.h>
 #include <memory>
+#include <string>
+#include <vector>
+#include <array>
+#include <utility>
+#include <algorithm>
 #include <chrono>
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
 
 #include "EndianUtils.h"
 #include "MayaUsbDevice.h"
+#include "StereoEncoder.h"
+#include "PanelRenderOverride.h"
 
 /**
  * Note: you will need to set your udev rules to allow user access to your
@@ -29,105 +44,1072 @@
 #define STATUS_COMMAND_NAME "usbStatus"
 #define DISCONNECT_COMMAND_NAME "usbDisconnect"
 
-#define CALLBACK_NAME "MayaUsbStreamer_PostRender"
+#define OVERRIDE_NAME_PREFIX "MayaUsbStreamer_"
+#define REFRESH_PERIOD (1.0f / 120.0f) /* seconds */
+#define REFRESH_TIMEOUT std::chrono::milliseconds(250)
+#define POSE_EPSILON 1e-4f
 
 #define RENDER_WIDTH 1280
 #define RENDER_HEIGHT 1440
+#define FRAME_RATE 60.0
+
+/* Seeding the stream from a device's link probe; see seedFromProbe. */
+#define LINK_HEADROOM 0.75 /* Share of the measured throughput to plan for. */
+#define QUALITY_STEP 5
+#define MIN_SEED_SCALE 0.25
+
+/* Motion-adaptive quality (-ad); see MayaUsbStreamer::adaptQuality. */
+#define MOTION_THRESHOLD 0.35f /* Head rotation in radians per second. */
+#define MOTION_SETTLE std::chrono::milliseconds(150)
+#define MOTION_QUALITY 60
+#define MOTION_SCALE 0.5
+#define REFINE_DELAY std::chrono::milliseconds(250)
+#define REFINE_MOTION -1
+
+/* Panorama mode (-pn); see MayaUsbStreamer::sweepPanorama. */
+#define PANORAMA_FOV 1.5707963267948966 /* 90 degrees, in radians. */
+
+/**
+ * A stereo panel streamed to one or more devices. Every binding has its own
+ * head object, render size and encode pipeline, so several panels are
+ * decomposed and compressed in parallel on their own encoder threads.
+ */
+struct StereoBinding {
+  MString stereoPanel;
+  MDagPath headDagPath;
+  int renderWidth;
+  int renderHeight;
+  double streamScale; /* Streamed eye size relative to the rendered one. */
+  uint8_t eyeLayout; /* A MayaUsbDevice::EYE_LAYOUT_ value. */
+  int quality; /* JPEG quality; only lowered, to suit the slowest link. */
+  int slices; /* JPEG slices per frame; 1 unless every device takes them. */
+  ImageUtils::LensMask lensMask;
+  std::atomic<MayaUsbDevice*> leadDevice;
+  /* Devices whose link probe seedFromProbe hasn't applied yet; guarded by
+     _usbDeviceMutex. */
+  std::vector<MayaUsbDevice*> probedDevices;
+
+  /* Refresh driver state; see MayaUsbStreamer::refreshCallback. */
+  std::atomic_bool refreshPending;
+  bool refreshInFlight; /* Only touched on Maya's main thread. */
+  std::chrono::steady_clock::time_point refreshScheduled;
+  float lastRotation[4]; /* Only touched by the lead device's read loop. */
+  /* The lead device's newest rotation, which refreshCallback turns the head
+     to on Maya's main thread; guarded by _usbDeviceMutex. */
+  bool rotationPending;
+  float pendingRotation[4];
+  /* The next capture is likely all new, or must be sent even if it isn't. */
+  std::atomic_bool invalidate;
+
+  /* Motion-adaptive quality (-ad); see MayaUsbStreamer::adaptQuality. */
+  bool adaptive;
+  std::atomic_bool fastMotion; /* Set by the lead device's read loop. */
+  std::chrono::steady_clock::time_point lastPoseTime; /* Read loop only. */
+  /* The rest is only touched on Maya's main thread. */
+  int refineLevel; /* REFINE_MOTION, or how many refinements were sent. */
+  std::chrono::steady_clock::time_point motionTime; /* Last fast motion. */
+  std::chrono::steady_clock::time_point refineTime; /* Last level change. */
+  uint64_t refineCaptures; /* Captures sent when refinement started over. */
+
+  /* Panorama mode (-pn); see MayaUsbStreamer::sweepPanorama. */
+  bool panorama;
+  /* The rest is only touched on Maya's main thread. */
+  bool sweepPending; /* The scene changed, so the faces must be captured. */
+  int sweepFace; /* Next face of the sweep in progress, or -1. */
+  int headFace; /* Face the head is turned to, or -1 between sweeps. */
+  double headRotation[4]; /* The head's own rotation, kept during a sweep. */
+  /* The head camera's settings before -pn changed them; see
+     setPanoramaCamera. */
+  bool cameraChanged;
+  double savedFilmAperture[2];
+  double savedFocalLength;
+
+  /* Captures skipped because of their raster format; main thread only. */
+  int unsupportedFormat;
+  uint64_t unsupportedFrames;
+
+  /* Renders the panel at the stream's size; see attachRenderOverride. Only
+     touched on Maya's main thread. */
+  std::unique_ptr<PanelRenderOverride> renderOverride;
+  bool overrideAttached; /* Registered and assigned to the panel. */
+  MString previousOverride; /* The panel's renderer override before it. */
+
+  std::vector<std::shared_ptr<MayaUsbDevice>> devices;
+  std::shared_ptr<StereoEncoder> encoder; /* Last so it stops first. */
+
+  StereoBinding(const MString& panel, const MDagPath& head, int width,
+      int height, double scale)
+      : stereoPanel(panel),
+        headDagPath(head),
+        renderWidth(width),
+        renderHeight(height),
+        streamScale(scale),
+        eyeLayout(MayaUsbDevice::EYE_LAYOUT_SIDE_BY_SIDE),
+        quality(StereoEncoder::MAX_QUALITY),
+        slices(1),
+        leadDevice(nullptr),
+        refreshPending(true),
+        refreshInFlight(false),
+        lastRotation{0.0f, 0.0f, 0.0f, 0.0f},
+        rotationPending(false),
+        pendingRotation{0.0f, 0.0f, 0.0f, 1.0f},
+        invalidate(true),
+        adaptive(false),
+        fastMotion(false),
+        refineLevel(0),
+        refineCaptures(0),
+        panorama(false),
+        sweepPending(true),
+        sweepFace(-1),
+        headFace(-1),
+        headRotation{0.0, 0.0, 0.0, 1.0},
+        cameraChanged(false),
+        savedFilmAperture{0.0, 0.0},
+        savedFocalLength(0.0),
+        unsupportedFormat(-1),
+        unsupportedFrames(0),
+        overrideAttached(false) {}
+};
 
 class MayaUsbStreamer {
   static int _debugFrameNum;
-  static std::shared_ptr<MayaUsbDevice> _usbDevice;
+  static std::vector<std::shared_ptr<StereoBinding>> _bindings;
   static std::mutex _usbDeviceMutex;
-  static MString _stereoPanel;
-  static MDagPath _headDagPath;
+  static bool _notificationsRegistered;
+  static MCallbackId _refreshTimerId;
+  static std::vector<MCallbackId> _sceneCallbackIds;
+  /* Set by the scene callbacks; see watchScene. */
+  static std::atomic_bool _sceneChanged;
+
+  /* A device whose workers failed; see retireDevice. */
+  struct RetiredDevice {
+    StereoBinding* binding;
+    MayaUsbDevice* device;
+    std::string error; /* Shown once the device is gone; may be empty. */
+  };
+  static std::vector<RetiredDevice> _retiredDevices;
+
+  /* Note: _usbDeviceMutex must be held. */
+  static std::shared_ptr<StereoBinding> findBinding(const MString& panel) {
+    for (const auto& binding : _bindings) {
+      if (binding->stereoPanel == panel) {
+        return binding;
+      }
+    }
+    return nullptr;
+  }
+
+  static void fanOutFrame(StereoBinding* binding, SharedJpegFrame frame) {
+    // Each device has its own single-frame queue, so a slow device only drops
+    // its own frames and never holds back the encoder or the other devices.
+    // Only the lead device's head was followed, so only it gets the pose.
+    std::lock_guard<std::mutex> lock(_usbDeviceMutex);
+    MayaUsbDevice* lead = binding->leadDevice.load();
+    for (const auto& device : binding->devices) {
+      if (device->isHandshakeComplete()) {
+        device->queueFrame(frame, device.get() == lead);
+      }
+    }
+  }
+
+  /**
+   * The view the panel was just rendered from: the head's rotation, as last
+   * set from the lead device's pose, and its camera's field of view and eye
+   * separation. It's read as the frame is captured, on Maya's main thread,
+   * so a pose that arrives between the draw and the capture makes the device
+   * undershoot its reprojection slightly rather than overshoot it. Invalid
+   * if the head isn't a camera, as then the field of view is unknown.
+   */
+  static FramePose headPose(StereoBinding* binding) {
+    FramePose pose;
+    MStatus status;
+    MFnTransform xform(binding->headDagPath, &status);
+    if (status.error()) {
+      return pose;
+    }
+
+    double x, y, z, w;
+    xform.getRotationQuaternion(x, y, z, w);
+    pose.rotation[0] = (float) x;
+    pose.rotation[1] = (float) y;
+    pose.rotation[2] = (float) z;
+    pose.rotation[3] = (float) w;
+
+    MDagPath cameraPath = binding->headDagPath;
+    if (!cameraPath.extendToShape() || !cameraPath.hasFn(MFn::kCamera)) {
+      return pose;
+    }
+
+    MFnCamera camera(cameraPath);
+    pose.fovX = (float) camera.horizontalFieldOfView();
+    pose.fovY = (float) camera.verticalFieldOfView();
+
+    // Only a stereo rig's center camera has a separation; the eyes are
+    // either side of it.
+    MPlug separation = camera.findPlug("interaxialSeparation", true, &status);
+    if (!status.error()) {
+      float half = (float) (separation.asDouble() * 0.5);
+      pose.eyeOffsets[0] = -half;
+      pose.eyeOffsets[1] = half;
+    }
+
+    pose.valid = pose.fovX > 0.0f && pose.fovY > 0.0f;
+    return pose;
+  }
+
+  /**
+   * Gives the panel back the renderer override it had before streaming, and
+   * drops the binding's own. On Maya's main thread, outside the lock.
+   */
+  static void detachRenderOverride(StereoBinding* binding) {
+    if (binding->overrideAttached) {
+      MGlobal::executeCommand("modelEditor -e -rendererOverrideName \"" +
+          binding->previousOverride + "\" " + binding->stereoPanel);
+      MHWRender::MRenderer* renderer = MHWRender::MRenderer::theRenderer();
+      if (renderer) {
+        renderer->deregisterOverride(binding->renderOverride.get());
+      }
+      binding->overrideAttached = false;
+    }
+    binding->renderOverride.reset();
+  }
+
+  /**
+   * Gives the head camera the square film back and 90 degree field of view
+   * that each panorama face needs, saving what it had, which
+   * restoreHeadCamera puts back when the panel stops streaming.
+   */
+  static void setPanoramaCamera(StereoBinding* binding) {
+    MDagPath cameraPath = binding->headDagPath;
+    if (!cameraPath.extendToShape() || !cameraPath.hasFn(MFn::kCamera)) {
+      MGlobal::displayWarning("The head isn't a camera; give its cameras a "
+          "square film back and a 90 degree field of view for -pn");
+      return;
+    }
+
+    MFnCamera camera(cameraPath);
+    binding->savedFilmAperture[0] = camera.horizontalFilmAperture();
+    binding->savedFilmAperture[1] = camera.verticalFilmAperture();
+    binding->savedFocalLength = camera.focalLength();
+    binding->cameraChanged = true;
+    camera.setAspectRatio(1.0);
+    camera.setHorizontalFieldOfView(PANORAMA_FOV);
+  }
+  /* Undoes setPanoramaCamera, unless the head has been deleted since. */
+  static void restoreHeadCamera(StereoBinding* binding) {
+    if (!binding->cameraChanged) {
+      return;
+    }
+    binding->cameraChanged = false;
+
+    MDagPath cameraPath = binding->headDagPath;
+    if (!cameraPath.isValid() || !cameraPath.extendToShape() ||
+        !cameraPath.hasFn(MFn::kCamera)) {
+      return;
+    }
+    MFnCamera camera(cameraPath);
+    camera.setHorizontalFilmAperture(binding->savedFilmAperture[0]);
+    camera.setVerticalFilmAperture(binding->savedFilmAperture[1]);
+    camera.setFocalLength(binding->savedFocalLength);
+  }
+
+  /* Turns the head to a device's rotation; on Maya's main thread. */
+  static void turnHead(StereoBinding* binding, const float* rotation) {
+    if (!binding->headDagPath.isValid()) {
+      return;
+    }
+    MStatus status;
+    MFnTransform xform(binding->headDagPath, &status);
+    if (!status.error()) {
+      xform.setRotationQuaternion(rotation[0], rotation[1], rotation[2],
+          rotation[3]);
+    }
+  }
+
+  static ImageUtils::EyeLayout toEyeLayout(const StereoBinding* binding) {
+    return binding->eyeLayout == MayaUsbDevice::EYE_LAYOUT_TOP_BOTTOM
+        ? ImageUtils::EyeLayout::TopBottom
+        : ImageUtils::EyeLayout::SideBySide;
+  }
+
+  /**
+   * Fits the stream to a device's measured link: the JPEG quality is lowered
+   * until a frame fits the link's share of a frame interval, then the stream
+   * scale, and if even that isn't enough, the device's frame rate. Like the
+   * capability fit, this only ever lowers the panel's settings, so a panel
+   * streams at what its slowest device can take. Runs on Maya's main thread
+   * (see refreshCallback) while the encoder is idle, and changes the encoder
+   * outside the lock, as that would wait for a frame being encoded.
+   */
+  static void seedFromProbe(StereoBinding* binding, MayaUsbDevice* device) {
+    LinkProbe probe = device->getLinkProbe();
+    if (!probe.valid) {
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock(_usbDeviceMutex);
+    double frameRate = device->getTargetFrameRate();
+    double budgetRate = frameRate > 0.0 ? frameRate : FRAME_RATE;
+    double budget = probe.bytesPerSecond * LINK_HEADROOM / budgetRate;
+
+    auto frameSize = [&](double scale, int quality) {
+      size_t eyeWidth = (size_t) (binding->renderWidth / 2 * scale);
+      size_t eyeHeight = (size_t) (binding->renderHeight / 2 * scale);
+      return (double) StereoEncoder::estimateJpegSize(2 * eyeWidth, eyeHeight,
+          quality);
+    };
+
+    int quality = binding->quality;
+    double scale = binding->streamScale;
+    while (quality > StereoEncoder::MIN_QUALITY &&
+        frameSize(scale, quality) > budget) {
+      quality = std::max(quality - QUALITY_STEP, StereoEncoder::MIN_QUALITY);
+    }
+    if (frameSize(scale, quality) > budget) {
+      // Size goes with the pixel count, so with the square of the scale.
+      double fit = std::sqrt(budget / frameSize(scale, quality));
+      scale = std::max(std::min(scale, MIN_SEED_SCALE), scale * fit);
+    }
+
+    std::ostringstream os;
+    os << "USB link to " << binding->stereoPanel.asChar() << " measured "
+       << std::fixed << std::setprecision(1)
+       << probe.bytesPerSecond / (1024.0 * 1024.0) << " MB/s";
+    bool changed = false;
+    bool lowered = quality < binding->quality || scale < binding->streamScale;
+    if (lowered) {
+      binding->quality = quality;
+      binding->streamScale = scale;
+      os << "; streaming at quality " << quality << ", "
+         << std::setprecision(2) << scale << "x";
+      changed = true;
+    }
+
+    double size = frameSize(scale, quality);
+    if (frameRate > 0.0 && size > budget) {
+      double rate = std::max(1.0, probe.bytesPerSecond * LINK_HEADROOM / size);
+      device->setTargetFrameRate(rate);
+      os << ", " << std::setprecision(1) << rate << "fps";
+      changed = true;
+    }
+    ImageUtils::EyeLayout eyeLayout = toEyeLayout(binding);
+    lock.unlock();
+
+    if (lowered) {
+      binding->encoder->setQuality(quality);
+      binding->encoder->setOutput(scale, eyeLayout);
+      binding->invalidate.store(true);
+    }
+    if (changed) {
+      MGlobal::displayWarning(os.str().c_str());
+    } else {
+      MGlobal::displayInfo(os.str().c_str());
+    }
+  }
+
+  /**
+   * Fits the stream to a device that just sent its capabilities. The first
+   * device of a panel picks the eye layout; the stream is shrunk if it's
+   * larger than any of its devices can decode, and each device's pacing is
+   * capped at its display's refresh rate. Returns false (after saying why)
+   * if the device can't show this stream at all.
+   */
+  static bool configureForDevice(StereoBinding* binding,
+      MayaUsbDevice* device, StreamSettings& settings) {
+    const DeviceCapabilities& caps = device->getCapabilities();
+    if (!(caps.codecs & MayaUsbDevice::CODEC_JPEG)) {
+      MGlobal::displayError("USB device can't decode JPEG; disconnected");
+      return false;
+    }
+    if (binding->panorama && !device->supportsPanorama()) {
+      MGlobal::displayError("USB device can't show panoramas; disconnected");
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(_usbDeviceMutex);
+    if (binding->slices > 1 && !device->supportsSlicedFrames()) {
+      binding->slices = 1;
+      binding->encoder->setSlices(1);
+      std::ostringstream os;
+      os << "USB device can't take sliced frames; streaming "
+         << binding->stereoPanel.asChar() << " in whole frames";
+      MGlobal::displayWarning(os.str().c_str());
+    }
+
+    bool first = true;
+    for (const auto& other : binding->devices) {
+      first &= other.get() == device || !other->isHandshakeComplete();
+    }
+
+    if (first) {
+      binding->eyeLayout =
+          (caps.eyeLayouts & (1 << caps.preferredEyeLayout)) &&
+          caps.preferredEyeLayout <= MayaUsbDevice::EYE_LAYOUT_TOP_BOTTOM
+          ? caps.preferredEyeLayout
+          : MayaUsbDevice::EYE_LAYOUT_SIDE_BY_SIDE;
+    }
+    if (!(caps.eyeLayouts & (1 << binding->eyeLayout))) {
+      MGlobal::displayError("USB device can't show this panel's eye layout; "
+          "disconnected");
+      return false;
+    }
+    bool topBottom =
+        binding->eyeLayout == MayaUsbDevice::EYE_LAYOUT_TOP_BOTTOM;
+
+    // Shrink the stream to fit the device's decoder, for all of the panel's
+    // devices since they share one encoder.
+    double eyeWidth = binding->renderWidth / 2 * binding->streamScale;
+    double eyeHeight = binding->renderHeight / 2 * binding->streamScale;
+    double imageWidth = topBottom ? eyeWidth : 2 * eyeWidth;
+    double imageHeight = topBottom ? 2 * eyeHeight : eyeHeight;
+    double fit = 1.0;
+    if (caps.maxDecodeWidth > 0 && caps.maxDecodeHeight > 0) {
+      fit = std::min({fit, caps.maxDecodeWidth / imageWidth,
+          caps.maxDecodeHeight / imageHeight});
+    }
+    if (fit < 1.0) {
+      binding->streamScale *= fit;
+      std::ostringstream os;
+      os << "USB device decodes at most " << caps.maxDecodeWidth << "x"
+         << caps.maxDecodeHeight << "; streaming "
+         << binding->stereoPanel.asChar() << " at " << binding->streamScale
+         << "x";
+      MGlobal::displayWarning(os.str().c_str());
+    }
+    binding->encoder->setOutput(binding->streamScale, toEyeLayout(binding));
+    binding->invalidate.store(true);
+
+    // Frames beyond the display's refresh rate would never be seen. An
+    // unpaced (-fr 0) device stays unpaced.
+    if (caps.refreshRate > 0.0f &&
+        device->getTargetFrameRate() > caps.refreshRate) {
+      device->setTargetFrameRate(caps.refreshRate);
+    }
+
+    settings.eyeLayout = binding->eyeLayout;
+    return true;
+  }
+
+  /**
+   * Motion-adaptive quality. While the head turns quickly, fine detail can't
+   * be seen anyway, so frames are sent small (at a lower quality and scale)
+   * to keep up the frame rate. Once it has been still for a moment the
+   * stream returns to its normal settings, and once a frame has been on
+   * screen for a while without a newer one, the encoder compresses it again
+   * at higher qualities, using link time that would otherwise go idle.
+   * Note: _usbDeviceMutex must be held, on Maya's main thread.
+   */
+  static void adaptQuality(StereoBinding* binding,
+      std::chrono::steady_clock::time_point now) {
+    struct RefineStep {
+      int quality;
+      bool fullChroma;
+    };
+    static const RefineStep steps[] = {
+      {90, false}, {StereoEncoder::MAX_QUALITY, true},
+    };
+    static const int stepCount = sizeof(steps) / sizeof(steps[0]);
+
+    if (binding->fastMotion.exchange(false)) {
+      binding->motionTime = now;
+    }
+
+    // Changing the encoder's settings would wait for the frame in progress,
+    // and Maya shouldn't.
+    if (binding->encoder->isBusy()) {
+      return;
+    }
+
+    bool moving = now - binding->motionTime < MOTION_SETTLE;
+    if (moving != (binding->refineLevel == REFINE_MOTION)) {
+      binding->refineLevel = moving ? REFINE_MOTION : 0;
+      binding->encoder->setQuality(moving
+          ? std::min(binding->quality, MOTION_QUALITY) : binding->quality);
+      binding->encoder->setOutput(
+          binding->streamScale * (moving ? MOTION_SCALE : 1.0),
+          toEyeLayout(binding));
+      // Coming to rest, the last frame is small and must be replaced.
+      binding->invalidate.store(true);
+      binding->refreshPending.store(true);
+      return;
+    } else if (moving) {
+      return;
+    }
+
+    // Every new frame is refined from scratch.
+    StereoEncoder::Stats stats = binding->encoder->getStats();
+    uint64_t captures = stats.frames - stats.unchangedFrames;
+    if (captures != binding->refineCaptures) {
+      binding->refineCaptures = captures;
+      binding->refineLevel = 0;
+      binding->refineTime = now;
+      return;
+    }
+
+    while (binding->refineLevel < stepCount &&
+        !steps[binding->refineLevel].fullChroma &&
+        steps[binding->refineLevel].quality <= binding->quality) {
+      binding->refineLevel++;
+    }
+    if (binding->refineLevel >= stepCount ||
+        binding->refreshPending.load() || binding->refreshInFlight ||
+        now - binding->refineTime < REFINE_DELAY) {
+      return;
+    }
+
+    const RefineStep& step = steps[binding->refineLevel];
+    if (binding->encoder->refine(step.quality, step.fullChroma)) {
+      binding->refineLevel++;
+      binding->refineTime = now;
+    }
+  }
+
+  /**
+   * Panorama mode. Rather than following the lead device's head, the head
+   * is turned to each face of a cube in turn, and each face's capture is
+   * sent to the devices, which then turn the view themselves. A sweep over
+   * the six faces only happens when the scene changes, or a device needs
+   * every face. Returns whether the panel should be redrawn to capture the
+   * next face. Note: _usbDeviceMutex must be held, on Maya's main thread.
+   */
+  static bool sweepPanorama(StereoBinding* binding,
+      std::chrono::steady_clock::time_point now) {
+    // Head rotations (x, y, z, w) in MayaUsbDevice::PANORAMA_MARKER's order:
+    // front, then yawed right, back and left, then pitched up and down.
+    static const double h = 0.70710678118654752; // sqrt(1/2)
+    static const double faces[JpegFrame::PANORAMA_FACES][4] = {
+      {0.0, 0.0, 0.0, 1.0}, {0.0, -h, 0.0, h}, {0.0, 1.0, 0.0, 0.0},
+      {0.0, h, 0.0, h}, {h, 0.0, 0.0, h}, {-h, 0.0, 0.0, h},
+    };
+
+    // A change during a sweep may have missed the faces already captured,
+    // so it gets another sweep once this one ends. So does a device that
+    // needs every face, unless the sweep's first face is yet to be captured
+    // (and will resend them all).
+    bool changed = binding->refreshPending.exchange(false);
+    if ((binding->invalidate.load() && binding->sweepFace != 0) || changed) {
+      binding->sweepPending = true;
+    }
+
+    MStatus status;
+    MFnTransform xform(binding->headDagPath, &status);
+    if (status.error()) {
+      return false;
+    }
+
+    if (binding->sweepFace >= JpegFrame::PANORAMA_FACES) {
+      // Every face was captured; put the head back where the user left it.
+      xform.setRotationQuaternion(binding->headRotation[0],
+          binding->headRotation[1], binding->headRotation[2],
+          binding->headRotation[3]);
+      binding->sweepFace = -1;
+      binding->headFace = -1;
+      return false;
+    } else if (binding->sweepFace < 0) {
+      if (!binding->sweepPending) {
+        return false;
+      }
+      binding->sweepPending = false;
+      binding->sweepFace = 0;
+      xform.getRotationQuaternion(binding->headRotation[0],
+          binding->headRotation[1], binding->headRotation[2],
+          binding->headRotation[3]);
+    }
+
+    // The devices queue one frame each, so a face must have gone out to
+    // all of them before the next one could replace it.
+    for (const auto& device : binding->devices) {
+      if (device->isHandshakeComplete() && !device->isSendIdle()) {
+        return false;
+      }
+    }
+
+    const double* rotation = faces[binding->sweepFace];
+    xform.setRotationQuaternion(rotation[0], rotation[1], rotation[2],
+        rotation[3]);
+    binding->headFace = binding->sweepFace;
+    return true;
+  }
 
 public:
-  static void createDevice() {
+  static void createDevice(const MString& stereoPanel,
+      const MDagPath& headDagPath, int renderWidth, int renderHeight,
+      ImageUtils::ColorTransform colorTransform, double streamScale,
+      int slices, bool adaptive, const ImageUtils::LensMask& lensMask,
+      bool panorama, double frameRate, bool lead) {
     std::lock_guard<std::mutex> lock(_usbDeviceMutex);
-    _usbDevice = std::make_shared<MayaUsbDevice>();
-    _usbDevice->waitHandshakeAsync([](bool success) {
+    auto device = std::make_shared<MayaUsbDevice>();
+    device->setTargetFrameRate(frameRate);
+
+    std::shared_ptr<StereoBinding> binding = findBinding(stereoPanel);
+    if (!binding) {
+      binding = std::make_shared<StereoBinding>(stereoPanel, headDagPath,
+          renderWidth, renderHeight, streamScale);
+      StereoBinding* bindingPtr = binding.get();
+      binding->encoder = std::make_shared<StereoEncoder>(
+        renderWidth,
+        renderHeight,
+        colorTransform,
+        streamScale,
+        [bindingPtr](SharedJpegFrame frame) {
+          fanOutFrame(bindingPtr, frame);
+        }
+      );
+      binding->slices = slices;
+      binding->encoder->setSlices(slices);
+      binding->adaptive = adaptive;
+      binding->lensMask = lensMask;
+      binding->encoder->setLensMask(lensMask);
+      binding->panorama = panorama;
+      binding->renderOverride.reset(new PanelRenderOverride(
+          MString(OVERRIDE_NAME_PREFIX) + stereoPanel, renderWidth,
+          renderHeight, colorTransform != ImageUtils::ColorTransform::Linear,
+          [stereoPanel](const MHWRender::MDrawContext& context) {
+            captureFrame(context, stereoPanel);
+          }));
+      if (panorama) {
+        setPanoramaCamera(binding.get());
+      }
+      _bindings.push_back(binding);
+    }
+
+    if (lead || binding->leadDevice.load() == nullptr) {
+      binding->leadDevice.store(device.get());
+    }
+    binding->devices.push_back(device);
+
+    // The binding outlives its devices, and each device joins its workers
+    // before it's destroyed, so the callbacks can safely hold raw pointers.
+    StereoBinding* bindingPtr = binding.get();
+    MayaUsbDevice* devicePtr = device.get();
+    devicePtr->waitHandshakeAsync([bindingPtr, devicePtr](bool success) {
+      StreamSettings settings;
+      if (success && !configureForDevice(bindingPtr, devicePtr, settings)) {
+        retireDevice(bindingPtr, devicePtr, nullptr);
+        return;
+      }
+
       if (success) {
-        _usbDevice->beginSendLoop([] {
-          cleanup();
-          MGlobal::displayError("Send error; USB device disconnected");
+        devicePtr->beginSendLoop(settings, [bindingPtr, devicePtr] {
+          retireDevice(bindingPtr, devicePtr,
+              "Send error; USB device disconnected");
+        }, [bindingPtr, devicePtr](const LinkProbe&) {
+          // Applied on the next refresh tick; see seedFromProbe.
+          std::lock_guard<std::mutex> lock(_usbDeviceMutex);
+          bindingPtr->probedDevices.push_back(devicePtr);
         });
-        _usbDevice->beginReadLoop([](const unsigned char* data) {
-          if (data == nullptr) {
-            cleanup();
-            MGlobal::displayError("Receive error; USB device disconnected");
-            return;
-          }
+        devicePtr->beginReadLoop(
+          [bindingPtr, devicePtr](const unsigned char* data) {
+            if (data == nullptr) {
+              retireDevice(bindingPtr, devicePtr,
+                  "Receive error; USB device disconnected");
+              return;
+            }
 
-          float floatData[4];
-          std::memcpy(floatData, data, 4 * sizeof(float));
-          for (int i = 0; i < 4; ++i) {
-            floatData[i] = EndianUtils::bigToNativeFloat(floatData[i]);
-          }
+            // Only the newest pose of each read arrives here, so the head is
+            // updated once per read. Only the lead device steers the head;
+            // the others just watch.
+            if (devicePtr != bindingPtr->leadDevice.load()) {
+              return;
+            }
 
-          std::cout << "Ack: ";
-          for (int i = 0; i < 4; ++i) {
-            std::cout << floatData[i] << " ";
-          }
-          std::cout << std::endl;
-
-          if (_headDagPath.isValid()) {
-            MStatus status;
-            MFnTransform xform(_headDagPath, &status);
-            if (!status.error()) {
-              xform.setRotationQuaternion(
-                floatData[0],
-                floatData[1],
-                floatData[2],
-                floatData[3]);
+            // A panorama is turned on the device, so the head stays put.
+            if (bindingPtr->panorama) {
+              return;
             }
-          }
-        }, 4 * sizeof(float));
-        M3dView::scheduleRefreshAllViews();
+
+            float floatData[4];
+            std::memcpy(floatData, data, 4 * sizeof(float));
+            for (int i = 0; i < 4; ++i) {
+              floatData[i] = EndianUtils::bigToNativeFloat(floatData[i]);
+            }
+
+            std::cout << "Ack: ";
+            for (int i = 0; i < 4; ++i) {
+              std::cout << floatData[i] << " ";
+            }
+            std::cout << std::endl;
+
+            // The angle between two unit quaternions is 2 acos(|q1 . q2|).
+            auto poseTime = std::chrono::steady_clock::now();
+            if (bindingPtr->adaptive && bindingPtr->lastPoseTime !=
+                std::chrono::steady_clock::time_point()) {
+              float dot = 0.0f;
+              for (int i = 0; i < 4; ++i) {
+                dot += floatData[i] * bindingPtr->lastRotation[i];
+              }
+              float angle = 2.0f * std::acos(std::min(std::abs(dot), 1.0f));
+              double elapsed = std::chrono::duration<double>(
+                  poseTime - bindingPtr->lastPoseTime).count();
+              if (elapsed > 0.0 && angle / elapsed > MOTION_THRESHOLD) {
+                bindingPtr->fastMotion.store(true);
+              }
+            }
+            bindingPtr->lastPoseTime = poseTime;
+
+            // Only redraw the panel if the head actually moved.
+            bool moved = false;
+            for (int i = 0; i < 4; ++i) {
+              moved |= std::abs(floatData[i] - bindingPtr->lastRotation[i]) >
+                  POSE_EPSILON;
+              bindingPtr->lastRotation[i] = floatData[i];
+            }
+            if (moved) {
+              // The camera moved, so there's no point comparing tiles.
+              bindingPtr->invalidate.store(true);
+              bindingPtr->refreshPending.store(true);
+            }
+
+            // Maya's API is for the main thread, so the head is turned
+            // before the next refresh; a newer pose replaces this one.
+            {
+              std::lock_guard<std::mutex> lock(_usbDeviceMutex);
+              std::memcpy(bindingPtr->pendingRotation, floatData,
+                  sizeof(floatData));
+              bindingPtr->rotationPending = true;
+            }
+          });
+        // The new device needs a whole frame even if nothing changed.
+        bindingPtr->invalidate.store(true);
+        bindingPtr->refreshPending.store(true);
       } else {
-        cleanup();
-        MGlobal::displayError("Handshake error; USB device disconnected");
+        retireDevice(bindingPtr, devicePtr,
+            "Handshake error; USB device disconnected");
       }
     });
   }
-  static std::shared_ptr<MayaUsbDevice> getDevice() { return _usbDevice; }
+  static const std::vector<std::shared_ptr<StereoBinding>>& getBindings() {
+    return _bindings;
+  }
   static std::mutex& getMutex() { return _usbDeviceMutex; }
-  static bool registerNotifications(const MString& stereoPanel,
-      const MDagPath& headDagPath) {
+  static bool registerNotifications() {
     MHWRender::MRenderer *renderer = MHWRender::MRenderer::theRenderer();
     if (renderer) {
-      renderer->addNotification(captureCallback,
-        CALLBACK_NAME,
-        MHWRender::MPassContext::kEndRenderSemantic,
-        nullptr);
-      renderer->setOutputTargetOverrideSize(RENDER_WIDTH, RENDER_HEIGHT);
-      _stereoPanel = stereoPanel;
-      _headDagPath = headDagPath;
+      if (!_notificationsRegistered) {
+        _refreshTimerId = MTimerMessage::addTimerCallback(REFRESH_PERIOD,
+          refreshCallback);
+        watchScene();
+        _notificationsRegistered = true;
+      }
       return true;
     }
     return false;
   }
-  static const MString getRegisteredStereoPanel() { return _stereoPanel; }
-  static bool isConnected() { return _usbDevice != nullptr; }
-  static void cleanup() {
-    MHWRender::MRenderer *renderer = MHWRender::MRenderer::theRenderer();
-    if (renderer) {
-      renderer->unsetOutputTargetOverrideSize();
-      renderer->removeNotification(CALLBACK_NAME,
-        MHWRender::MPassContext::kEndRenderSemantic);
+  static void unregisterNotifications() {
+    if (_notificationsRegistered) {
+      MMessage::removeCallback(_refreshTimerId);
+      for (MCallbackId id : _sceneCallbackIds) {
+        MMessage::removeCallback(id);
+      }
+      _sceneCallbackIds.clear();
+    }
+    _notificationsRegistered = false;
+  }
+  static bool isConnected() { return !_bindings.empty(); }
+  static bool isStreaming(const MString& stereoPanel) {
+    std::lock_guard<std::mutex> lock(_usbDeviceMutex);
+    return findBinding(stereoPanel) != nullptr;
+  }
+  /**
+   * Renders the panel through its binding's override, so that only it
+   * renders at the stream's size. Says why and returns false if the panel
+   * can't take an override (e.g. it isn't a model panel).
+   */
+  static bool attachRenderOverride(const MString& stereoPanel) {
+    std::shared_ptr<StereoBinding> binding;
+    {
+      std::lock_guard<std::mutex> lock(_usbDeviceMutex);
+      binding = findBinding(stereoPanel);
+    }
+    if (!binding || binding->overrideAttached) {
+      return binding != nullptr;
     }
 
+    MHWRender::MRenderer* renderer = MHWRender::MRenderer::theRenderer();
+    if (!renderer ||
+        !renderer->registerOverride(binding->renderOverride.get())) {
+      MGlobal::displayError("Could not register the VP2 render override");
+      return false;
+    }
+
+    MString previous;
+    MGlobal::executeCommand("modelEditor -q -rendererOverrideName " +
+        stereoPanel, previous);
+    if (!MGlobal::executeCommand("modelEditor -e -rendererOverrideName " +
+        binding->renderOverride->name() + " " + stereoPanel)) {
+      renderer->deregisterOverride(binding->renderOverride.get());
+      MGlobal::displayError("Could not render " + stereoPanel +
+          " through the plugin's override; is it a model panel?");
+      return false;
+    }
+    binding->previousOverride = previous;
+    binding->overrideAttached = true;
+    return true;
+  }
+  static std::shared_ptr<StereoBinding> getStreamingBinding(
+      const MString& stereoPanel) {
     std::lock_guard<std::mutex> lock(_usbDeviceMutex);
-    _usbDevice = nullptr;
+    std::shared_ptr<StereoBinding> binding = findBinding(stereoPanel);
+    if (binding) {
+      for (const auto& device : binding->devices) {
+        if (device->isHandshakeComplete()) {
+          return binding;
+        }
+      }
+    }
+    return nullptr;
+  }
+  /**
+   * Listens for edits that may change what the streaming panels show: the
+   * selection, the current time, commands (including undo and redo), the
+   * end of a manipulator drag, and nodes coming and going. The head's own
+   * moves are tracked by the lead device's read loop. Other panels' redraws
+   * aren't a sign of anything, as the refresh timer causes them too.
+   */
+  static void watchScene() {
+    static const char* const events[] = {
+      "SelectionChanged", "timeChanged", "RecentCommandChanged", "Undo",
+      "Redo", "DragRelease", "SceneOpened", "NewSceneOpened",
+    };
+    for (const char* event : events) {
+      _sceneCallbackIds.push_back(MEventMessage::addEventCallback(event,
+          [](void* clientData) { _sceneChanged.store(true); }));
+    }
+    auto nodeCallback = [](MObject& node, void* clientData) {
+      _sceneChanged.store(true);
+    };
+    _sceneCallbackIds.push_back(
+        MDGMessage::addNodeAddedCallback(nodeCallback));
+    _sceneCallbackIds.push_back(
+        MDGMessage::addNodeRemovedCallback(nodeCallback));
+  }
+  /**
+   * Refresh driver. Redraws only the streaming panels, and only when the head
+   * moved or the scene changed. A panel is refreshed at most once per encoded
+   * frame: not while its encoder is busy, and not again until its last
+   * refresh reached the capture callback.
+   */
+  static void refreshCallback(float elapsedTime, float lastTime,
+      void* clientData) {
+    removeRetiredDevices();
+
+    auto now = std::chrono::steady_clock::now();
+    std::vector<MString> panels;
+    std::vector<std::pair<std::shared_ptr<StereoBinding>,
+        std::shared_ptr<MayaUsbDevice>>> probed;
+    std::vector<std::pair<std::shared_ptr<StereoBinding>,
+        std::array<float, 4>>> rotations;
+    {
+      std::lock_guard<std::mutex> lock(_usbDeviceMutex);
+      bool sceneChanged = _sceneChanged.exchange(false);
+      for (const auto& binding : _bindings) {
+        if (sceneChanged) {
+          binding->refreshPending.store(true);
+        }
+
+        // Probes wait for an idle encoder, as changing it waits for the
+        // frame in progress; devices removed since their probe are skipped.
+        if (!binding->encoder->isBusy()) {
+          for (MayaUsbDevice* probedDevice : binding->probedDevices) {
+            for (const auto& device : binding->devices) {
+              if (device.get() == probedDevice) {
+                probed.emplace_back(binding, device);
+              }
+            }
+          }
+          binding->probedDevices.clear();
+        }
+
+        if (binding->rotationPending) {
+          std::array<float, 4> rotation;
+          std::copy(std::begin(binding->pendingRotation),
+              std::end(binding->pendingRotation), rotation.begin());
+          rotations.emplace_back(binding, rotation);
+          binding->rotationPending = false;
+        }
+
+        bool handshake = false;
+        for (const auto& device : binding->devices) {
+          handshake |= device->isHandshakeComplete();
+        }
+
+        // Don't wait forever on a refresh that never rendered (e.g. the panel
+        // is hidden).
+        if (binding->refreshInFlight &&
+            now - binding->refreshScheduled > REFRESH_TIMEOUT) {
+          binding->refreshInFlight = false;
+        }
+
+        if (handshake && binding->adaptive) {
+          adaptQuality(binding.get(), now);
+        }
+
+        if (handshake && !binding->refreshInFlight &&
+            !binding->encoder->isBusy() &&
+            (binding->panorama ? sweepPanorama(binding.get(), now)
+                               : binding->refreshPending.exchange(false))) {
+          binding->refreshInFlight = true;
+          binding->refreshScheduled = now;
+          panels.push_back(binding->stereoPanel);
+        }
+      }
+    }
+
+    for (const auto& entry : probed) {
+      seedFromProbe(entry.first.get(), entry.second.get());
+    }
+
+    // Before the refreshes below, so they render the new pose.
+    for (const auto& entry : rotations) {
+      turnHead(entry.first.get(), entry.second.data());
+    }
+
+    for (const MString& panel : panels) {
+      M3dView view;
+      if (M3dView::getM3dViewFromModelPanel(panel, view)) {
+        view.scheduleRefresh();
+      }
+    }
+  }
+  /**
+   * Called from a device's worker threads when it fails or is refused. Maya's
+   * API may only be called on the main thread, and destroying the device
+   * joins those very workers, so the device is only flagged here; the next
+   * refresh tick removes it and shows the error.
+   */
+  static void retireDevice(StereoBinding* binding, MayaUsbDevice* device,
+      const char* error) {
+    std::lock_guard<std::mutex> lock(_usbDeviceMutex);
+    _retiredDevices.push_back(
+        RetiredDevice{binding, device, error ? error : ""});
+  }
+  /* Removes the devices flagged by retireDevice; on Maya's main thread. */
+  static void removeRetiredDevices() {
+    std::vector<RetiredDevice> retired;
+    {
+      std::lock_guard<std::mutex> lock(_usbDeviceMutex);
+      retired.swap(_retiredDevices);
+    }
+
+    // A device whose send and read loops both failed is flagged twice, but
+    // only removed (and reported) once.
+    for (const RetiredDevice& entry : retired) {
+      if (removeDevice(entry.binding, entry.device) &&
+          !entry.error.empty()) {
+        MGlobal::displayError(entry.error.c_str());
+      }
+    }
+  }
+  /* Note: on Maya's main thread only; see retireDevice. */
+  static bool removeDevice(StereoBinding* binding, MayaUsbDevice* device) {
+    std::shared_ptr<MayaUsbDevice> removed;
+    std::shared_ptr<StereoBinding> removedBinding;
+    bool last = false;
+    {
+      std::lock_guard<std::mutex> lock(_usbDeviceMutex);
+      auto bindingIt = std::find_if(_bindings.begin(), _bindings.end(),
+          [=](const std::shared_ptr<StereoBinding>& b) {
+            return b.get() == binding;
+          });
+      if (bindingIt == _bindings.end()) {
+        return false;
+      }
+
+      auto& devices = binding->devices;
+      auto it = std::find_if(devices.begin(), devices.end(),
+          [=](const std::shared_ptr<MayaUsbDevice>& d) {
+            return d.get() == device;
+          });
+      if (it == devices.end()) {
+        return false;
+      }
+
+      removed = *it;
+      devices.erase(it);
+      if (binding->leadDevice.load() == device) {
+        binding->leadDevice.store(
+            devices.empty() ? nullptr : devices.front().get());
+      }
+
+      if (devices.empty()) {
+        removedBinding = *bindingIt;
+        _bindings.erase(bindingIt);
+        last = _bindings.empty();
+      }
+    }
+
+    if (last) {
+      unregisterNotifications();
+    }
+    if (removedBinding) {
+      detachRenderOverride(removedBinding.get());
+      restoreHeadCamera(removedBinding.get());
+    }
+
+    // Joins the encoder and device workers; must happen outside the lock.
+    removedBinding = nullptr;
+    removed = nullptr;
+    return true;
+  }
+  static bool removeBinding(const MString& stereoPanel) {
+    std::shared_ptr<StereoBinding> removedBinding;
+    bool last;
+    {
+      std::lock_guard<std::mutex> lock(_usbDeviceMutex);
+      removedBinding = findBinding(stereoPanel);
+      if (!removedBinding) {
+        return false;
+      }
+      _bindings.erase(
+          std::find(_bindings.begin(), _bindings.end(), removedBinding));
+      last = _bindings.empty();
+
+      // Its devices go with it, so there's nothing left to retire.
+      StereoBinding* binding = removedBinding.get();
+      _retiredDevices.erase(std::remove_if(_retiredDevices.begin(),
+          _retiredDevices.end(), [=](const RetiredDevice& entry) {
+            return entry.binding == binding;
+          }), _retiredDevices.end());
+    }
+
+    if (last) {
+      unregisterNotifications();
+    }
+    detachRenderOverride(removedBinding.get());
+    restoreHeadCamera(removedBinding.get());
+
+    removedBinding = nullptr;
+    return true;
+  }
+  static void cleanup() {
+    unregisterNotifications();
+
+    // Release the bindings outside the lock: their destructors join the worker
+    // threads, and a worker may itself be waiting on the lock in cleanup().
+    std::vector<std::shared_ptr<StereoBinding>> bindings;
+    {
+      std::lock_guard<std::mutex> lock(_usbDeviceMutex);
+      bindings.swap(_bindings);
+      _retiredDevices.clear();
+    }
+    for (const auto& binding : bindings) {
+      detachRenderOverride(binding.get());
+      restoreHeadCamera(binding.get());
+    }
+    bindings.clear();
   }
-  static void captureCallback(MHWRender::MDrawContext &context,
-      void* clientData);
+  static void captureFrame(const MHWRender::MDrawContext& context,
+      const MString& stereoPanel);
 };
 
 int MayaUsbStreamer::_debugFrameNum(0);
-std::shared_ptr<MayaUsbDevice> MayaUsbStreamer::_usbDevice(nullptr);
+std::vector<std::shared_ptr<StereoBinding>> MayaUsbStreamer::_bindings;
 std::mutex MayaUsbStreamer::_usbDeviceMutex;
-MString MayaUsbStreamer::_stereoPanel;
-MDagPath MayaUsbStreamer::_headDagPath;
+bool MayaUsbStreamer::_notificationsRegistered(false);
+MCallbackId MayaUsbStreamer::_refreshTimerId(0);
+std::vector<MCallbackId> MayaUsbStreamer::_sceneCallbackIds;
+std::atomic_bool MayaUsbStreamer::_sceneChanged(false);
+std::vector<MayaUsbStreamer::RetiredDevice> MayaUsbStreamer::_retiredDevices;
 
 class UsbConnectCommand : public MPxCommand {
 public:
@@ -145,8 +1127,87 @@ public:
   virtual MStatus doIt(const MArgList& args) {
     std::lock_guard<std::mutex> lock(MayaUsbStreamer::getMutex());
     if (MayaUsbStreamer::isConnected()) {
-      std::string desc = MayaUsbStreamer::getDevice()->getDescription();
-      MGlobal::displayInfo(desc.c_str());
+      for (const auto& binding : MayaUsbStreamer::getBindings()) {
+        std::ostringstream header;
+        header << binding->stereoPanel.asChar() << " ("
+               << binding->renderWidth << "x" << binding->renderHeight / 2
+               << ")";
+        if (binding->streamScale < 1.0) {
+          header << ", streamed at " << binding->streamScale << "x";
+        }
+        if (binding->eyeLayout == MayaUsbDevice::EYE_LAYOUT_TOP_BOTTOM) {
+          header << ", top-bottom";
+        }
+        if (binding->quality < StereoEncoder::MAX_QUALITY) {
+          header << ", quality " << binding->quality;
+        }
+        if (binding->slices > 1) {
+          header << ", " << binding->slices << " slices";
+        }
+        if (binding->lensMask.enabled()) {
+          header << ", lens mask " << binding->lensMask.radius;
+        }
+        StereoEncoder::Stats encoderStats = binding->encoder->getStats();
+        if (binding->panorama) {
+          header << ", panorama ("
+                 << (binding->sweepFace >= 0 ? "capturing" : "idle") << ", "
+                 << encoderStats.cachedFaces << " faces from cache)";
+        }
+        if (binding->adaptive) {
+          header << ", motion-adaptive ("
+                 << (binding->refineLevel == REFINE_MOTION ? "moving" : "still")
+                 << ", " << encoderStats.refinedFrames << " refinements)";
+        }
+        header << ", " << encoderStats.unchangedFrames << "/"
+               << encoderStats.frames << " captures unchanged, "
+               << (int) (encoderStats.changedTileRatio * 100.0 + 0.5)
+               << "% of tiles decomposed, " << encoderStats.untrackedFrames
+               << " without comparing tiles";
+        if (binding->unsupportedFrames > 0) {
+          header << ", skipped " << binding->unsupportedFrames
+                 << " frames in unsupported raster format "
+                 << binding->unsupportedFormat;
+        }
+        MGlobal::displayInfo(header.str().c_str());
+
+        for (const auto& device : binding->devices) {
+          std::ostringstream os;
+          os << "  " << device->getDescription()
+             << (device.get() == binding->leadDevice.load() ? " [lead]" : "")
+             << ", sent=" << device->getFramesSent()
+             << ", dropped=" << device->getFramesDropped()
+             << ", poses=" << device->getSamplesRead() << " in "
+             << device->getSampleReads() << " reads"
+             << ", creditWaits=" << device->getCreditWaits()
+             << ", creditResets=" << device->getCreditResets()
+             << ", tooLarge=" << device->getFramesTooLarge()
+             << ", aborted=" << device->getFramesAborted();
+
+          FramePacer::Stats pacing = device->getPacingStats();
+          os << std::fixed << std::setprecision(2)
+             << ", target=" << device->getTargetFrameRate() << "fps"
+             << ", interval=" << pacing.meanIntervalMs << "ms"
+             << ", jitter=" << pacing.jitterMs << "ms"
+             << ", maxDeviation=" << pacing.maxDeviationMs << "ms"
+             << ", late=" << pacing.lateFrames
+             << ", idleGaps=" << pacing.idleGaps;
+
+          LinkProbe probe = device->getLinkProbe();
+          if (probe.valid) {
+            os << ", link=" << probe.bytesPerSecond / (1024.0 * 1024.0)
+               << "MB/s, linkRoundTrip=" << probe.roundTripMs << "ms";
+          }
+
+          ClockSync::Estimate clock = device->getClockSync().getEstimate();
+          if (clock.valid) {
+            os << ", clockOffset=" << clock.offsetNs / 1e6 << "ms"
+               << ", drift=" << clock.driftPpm << "ppm"
+               << ", roundTrip=" << clock.roundTripNs / 1e6 << "ms"
+               << ", lostPings=" << clock.lostPings;
+          }
+          MGlobal::displayInfo(os.str().c_str());
+        }
+      }
       return MStatus::kSuccess;
     } else {
       MGlobal::displayError("No USB device connected");
@@ -159,11 +1220,29 @@ class UsbDisconnectCommand : public MPxCommand {
 public:
   UsbDisconnectCommand() {}
   static void* creator() { return new UsbDisconnectCommand(); }
-  static MSyntax newSyntax() { return MSyntax(); }
+  static MSyntax newSyntax() {
+    MSyntax syntax;
+    syntax.enableEdit(false);
+    syntax.enableQuery(false);
+    syntax.addFlag("-sp", "-stereoPanel", MSyntax::kString);
+    return syntax;
+  }
   virtual MStatus doIt(const MArgList& args) {
-    if (MayaUsbStreamer::isConnected()) {
+    MArgDatabase argData(syntax(), args);
+
+    if (argData.isFlagSet("-sp")) {
+      MString stereoPanel;
+      argData.getFlagArgument("-sp", 0, stereoPanel);
+      if (MayaUsbStreamer::removeBinding(stereoPanel)) {
+        MGlobal::displayInfo("USB devices disconnected");
+        return MStatus::kSuccess;
+      } else {
+        MGlobal::displayError("No USB device connected to stereo panel");
+        return MStatus::kFailure;
+      }
+    } else if (MayaUsbStreamer::isConnected()) {
       MayaUsbStreamer::cleanup();
-      MGlobal::displayInfo("USB device disconnected");
+      MGlobal::displayInfo("USB devices disconnected");
       return MStatus::kSuccess;
     } else {
       MGlobal::displayError("No USB device connected");
@@ -185,15 +1264,30 @@ MSyntax UsbConnectCommand::newSyntax() {
   syntax.addFlag("-id", "-deviceId", MSyntax::kString, MSyntax::kString);
   syntax.addFlag("-sp", "-stereoPanel", MSyntax::kString);
   syntax.addFlag("-h", "-head", MSyntax::kString);
+  syntax.addFlag("-ld", "-lead");
+  syntax.addFlag("-res", "-resolution", MSyntax::kLong, MSyntax::kLong);
+  syntax.addFlag("-fr", "-frameRate", MSyntax::kDouble);
+  syntax.addFlag("-cs", "-colorSpace", MSyntax::kString);
+  syntax.addFlag("-ss", "-streamScale", MSyntax::kDouble);
+  syntax.addFlag("-sl", "-slices", MSyntax::kLong);
+  syntax.addFlag("-ad", "-adaptive");
+  syntax.addFlag("-lm", "-lensMask", MSyntax::kDouble);
+  syntax.addFlag("-pn", "-panorama");
   return syntax;
 }
 
 MStatus UsbConnectCommand::doIt(const MArgList& args) {
   MArgDatabase argData(syntax(), args);
 
-  if (MayaUsbStreamer::isConnected()) {
-    MGlobal::displayError("Already connected");
-    return MStatus::kFailure;
+  bool lead = argData.isFlagSet("-ld");
+
+  double frameRate = FRAME_RATE;
+  if (argData.isFlagSet("-fr")) {
+    argData.getFlagArgument("-fr", 0, frameRate);
+    if (frameRate < 0.0) {
+      MGlobal::displayError("-fr must be zero (unpaced) or a positive rate");
+      return MStatus::kFailure;
+    }
   }
 
   MString vid;
@@ -214,19 +1308,100 @@ MStatus UsbConnectCommand::doIt(const MArgList& args) {
     return MStatus::kFailure;
   }
 
-  MString headObjName;
-  if (!argData.getFlagArgument("-h", 0, headObjName) != MStatus::kSuccess) {
-    MGlobal::displayError("Error getting -h head object name");
-    return MStatus::kFailure;
-  }
-  MSelectionList selList;
-  MGlobal::getSelectionListByName(headObjName, selList);
-  if (selList.isEmpty()) {
-    MGlobal::displayError("Head object does not exist");
-    return MStatus::kFailure;
-  }
+  // Additional devices on an already-streaming panel join its stream and
+  // ignore -h/-res/-cs/-ss/-sl/-ad/-lm/-pn.
+  bool joinStream = MayaUsbStreamer::isStreaming(stereoPanel);
+
   MDagPath headDagPath;
-  selList.getDagPath(0, headDagPath);
+  int renderWidth = RENDER_WIDTH;
+  int renderHeight = RENDER_HEIGHT;
+  ImageUtils::ColorTransform colorTransform = ImageUtils::ColorTransform::Linear;
+  double streamScale = 1.0;
+  int slices = 1;
+  bool adaptive = argData.isFlagSet("-ad");
+  ImageUtils::LensMask lensMask;
+  bool panorama = argData.isFlagSet("-pn");
+  if (!joinStream) {
+    MString headObjName;
+    if (!argData.getFlagArgument("-h", 0, headObjName) != MStatus::kSuccess) {
+      MGlobal::displayError("Error getting -h head object name");
+      return MStatus::kFailure;
+    }
+    MSelectionList selList;
+    MGlobal::getSelectionListByName(headObjName, selList);
+    if (selList.isEmpty()) {
+      MGlobal::displayError("Head object does not exist");
+      return MStatus::kFailure;
+    }
+    selList.getDagPath(0, headDagPath);
+
+    if (argData.isFlagSet("-res")) {
+      int width = 0;
+      int height = 0;
+      argData.getFlagArgument("-res", 0, width);
+      argData.getFlagArgument("-res", 1, height);
+      if (width <= 0 || height <= 0 || width % 2 != 0) {
+        MGlobal::displayError("-res must be a positive, even width and height");
+        return MStatus::kFailure;
+      }
+
+      // Render twice as tall so each eye keeps its aspect ratio.
+      renderWidth = width;
+      renderHeight = height * 2;
+    }
+
+    if (argData.isFlagSet("-cs")) {
+      MString colorSpace;
+      argData.getFlagArgument("-cs", 0, colorSpace);
+      colorSpace.toLowerCase();
+      if (colorSpace == "srgb") {
+        colorTransform = ImageUtils::ColorTransform::Srgb;
+      } else if (colorSpace != "linear") {
+        MGlobal::displayError("-cs must be \"linear\" or \"sRGB\"");
+        return MStatus::kFailure;
+      }
+    }
+
+    if (argData.isFlagSet("-ss")) {
+      argData.getFlagArgument("-ss", 0, streamScale);
+      if (!(streamScale > 0.0 && streamScale <= 1.0)) {
+        MGlobal::displayError("-ss must be greater than 0 and at most 1");
+        return MStatus::kFailure;
+      }
+    }
+
+    if (argData.isFlagSet("-sl")) {
+      argData.getFlagArgument("-sl", 0, slices);
+      if (slices < 1 || slices > (int) JpegFrame::MAX_SLICES) {
+        std::ostringstream os;
+        os << "-sl must be from 1 to " << JpegFrame::MAX_SLICES;
+        MGlobal::displayError(os.str().c_str());
+        return MStatus::kFailure;
+      }
+    }
+
+    if (argData.isFlagSet("-lm")) {
+      argData.getFlagArgument("-lm", 0, lensMask.radius);
+      if (!(lensMask.radius > 0.0 && lensMask.radius <= 1.0)) {
+        MGlobal::displayError("-lm must be greater than 0 and at most 1");
+        return MStatus::kFailure;
+      }
+    }
+
+    if (panorama) {
+      // Each face is one eye's view, so it must be square with a 90 degree
+      // field of view. Motion doesn't matter to a panorama, and the lenses
+      // see all of it as the device turns.
+      if (renderWidth != renderHeight) {
+        MGlobal::displayError("-pn needs square eyes, e.g. -res 1024 512");
+        return MStatus::kFailure;
+      }
+      if (adaptive || lensMask.enabled()) {
+        MGlobal::displayError("-pn can't be combined with -ad or -lm");
+        return MStatus::kFailure;
+      }
+    }
+  }
 
   int vidInt = std::stoi(vid.asChar(), 0, 16);
   int pidInt = std::stoi(pid.asChar(), 0, 16);
@@ -250,8 +1425,14 @@ MStatus UsbConnectCommand::doIt(const MArgList& args) {
       std::cout << err.what() << std::endl;
     }
 
-    MayaUsbStreamer::createDevice();
-    MayaUsbStreamer::registerNotifications(stereoPanel, headDagPath);
+    MayaUsbStreamer::createDevice(stereoPanel, headDagPath, renderWidth,
+        renderHeight, colorTransform, streamScale, slices, adaptive, lensMask,
+        panorama, frameRate, lead);
+    if (!MayaUsbStreamer::attachRenderOverride(stereoPanel)) {
+      MayaUsbStreamer::removeBinding(stereoPanel);
+      return MStatus::kFailure;
+    }
+    MayaUsbStreamer::registerNotifications();
 
     MGlobal::displayInfo("USB device connected!");
     return MStatus::kSuccess;
@@ -261,14 +1442,40 @@ MStatus UsbConnectCommand::doIt(const MArgList& args) {
   }
 }
 
-void MayaUsbStreamer::captureCallback(MHWRender::MDrawContext &context,
-    void* clientData) {
-  MString destName;
-  context.renderingDestination(destName);
-  std::cout << _debugFrameNum++ << " " << destName.asChar() << std::endl;
+/**
+ * Run by the panel's render override, right after it rendered the scene into
+ * the stream-size targets.
+ */
+void MayaUsbStreamer::captureFrame(const MHWRender::MDrawContext& context,
+    const MString& stereoPanel) {
+  std::cout << _debugFrameNum++ << " " << stereoPanel.asChar() << std::endl;
+
+  std::shared_ptr<StereoBinding> binding =
+      MayaUsbStreamer::getStreamingBinding(stereoPanel);
+  if (!binding) {
+    std::cout << "  -> no device yet" << std::endl;
+    return;
+  }
+
+  // Encode once for all of the panel's devices; the encoder fans it out.
+  binding->refreshInFlight = false;
+  std::shared_ptr<StereoEncoder> encoder = binding->encoder;
 
-  if (destName != MayaUsbStreamer::getRegisteredStereoPanel()) {
-    std::cout << "  -> skip (" << destName << ")" << std::endl;
+  // Between sweeps, a panorama panel has nothing to capture.
+  int face = binding->headFace;
+  if (binding->panorama && face < 0) {
+    std::cout << "  -> panorama idle" << std::endl;
+    return;
+  }
+
+  // Don't bother reading back the render target if it'd be dropped anyway.
+  // A sweep retries the same face by itself, as it only moves on once the
+  // face was submitted.
+  if (encoder->isBusy()) {
+    std::cout << "  -> encoder busy" << std::endl;
+    if (!binding->panorama) {
+      binding->refreshPending.store(true); // Try again once it's free.
+    }
     return;
   }
 
@@ -277,32 +1484,59 @@ void MayaUsbStreamer::captureCallback(MHWRender::MDrawContext &context,
     return;
   }
 
-  MHWRender::MTexture* colorTexture =
-      context.copyCurrentColorRenderTargetToTexture();
+  // User operations get a const context, but copying its target out doesn't
+  // change it.
+  auto captureTime = std::chrono::steady_clock::now();
+  MHWRender::MTexture* colorTexture = const_cast<MHWRender::MDrawContext&>(
+      context).copyCurrentColorRenderTargetToTexture();
   if (colorTexture) {
     MHWRender::MTextureDescription desc;
     colorTexture->textureDescription(desc);
 
-    if (MayaUsbDevice::supportsRasterFormat(desc.fFormat)) {
-      bool sent = false;
+    if (StereoEncoder::supportsRasterFormat(desc.fFormat)) {
       int row, slice;
       void* rawData = colorTexture->rawData(row, slice);
 
-      {
-        std::lock_guard<std::mutex> lock(MayaUsbStreamer::getMutex());
-        if (MayaUsbStreamer::isConnected() &&
-            MayaUsbStreamer::getDevice()->isHandshakeComplete()) {
-          sent = MayaUsbStreamer::getDevice()->sendStereo(rawData, desc);
+      // On success, the encoder thread decomposes the data and frees it, so
+      // the panels don't queue up behind each other on Maya's thread.
+      // A panorama's first face resends the rest, so it takes the
+      // invalidation; a device that joins later gets the next sweep.
+      bool invalidate = (face <= 0) && binding->invalidate.exchange(false);
+      // Panorama faces are rendered from fixed rotations, not the head's.
+      FramePose pose = face < 0 ? headPose(binding.get()) : FramePose();
+      if (face < 0) {
+        pose.captureTime = captureTime;
+      }
+      bool sent = encoder->submitStereo(rawData, desc, invalidate, pose,
+          face);
+      if (!sent) {
+        MHWRender::MTexture::freeRawData(rawData);
+        if (invalidate) {
+          binding->invalidate.store(true);
         }
+      } else if (face >= 0 && face == binding->sweepFace) {
+        binding->sweepFace++;
       }
 
       std::cout << "  -> format " << desc.fFormat << std::endl;
       std::cout << "  -> " << desc.fWidth << "x" << desc.fHeight << std::endl;
       std::cout << "  -> sent " << sent << std::endl;
-
-      MHWRender::MTexture::freeRawData(rawData);
     } else {
       std::cout << "  -> unsupported format " << desc.fFormat << std::endl;
+
+      // Say why the stream stalled, once per format change rather than once
+      // per frame.
+      binding->unsupportedFrames++;
+      if (binding->unsupportedFormat != (int) desc.fFormat) {
+        binding->unsupportedFormat = (int) desc.fFormat;
+        std::ostringstream os;
+        os << "Stereo panel " << stereoPanel.asChar()
+           << " renders in raster format " << desc.fFormat
+           << ", which cannot be streamed; frames are being skipped "
+           << "(supported: 32/16-bit float RGBA, 32-bit float RGB, 8-bit "
+           << "RGBA/BGRA, 10-bit RGB)";
+        MGlobal::displayWarning(os.str().c_str());
+      }
     }
 
     MHWRender::MTextureManager* textureManager = renderer->getTextureManager();
@@ -339,7 +1573,6 @@ MStatus initializePlugin(MObject obj) {
   }
 
   MayaUsbDevice::initUsb();
-  MayaUsbDevice::initJpeg();
 
   return status;
 }
@@ -369,7 +1602,6 @@ MStatus uninitializePlugin(MObject obj) {
   }
 
   MayaUsbDevice::exitUsb();
-  MayaUsbDevice::exitJpeg();
 
   return status;
 }
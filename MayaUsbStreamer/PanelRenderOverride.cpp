@@ -0,0 +1,195 @@
+#include "PanelRenderOverride.h"
+#include <maya/MDrawContext.h>
+
+namespace {
+
+/** Draws the panel's scene, with its usual clear, into the stream targets. */
+class StreamSceneRender : public MHWRender::MSceneRender {
+public:
+  StreamSceneRender(const MString& name, MHWRender::MRenderTarget** targets,
+      unsigned int targetCount)
+      : MHWRender::MSceneRender(name),
+        _targets(targets),
+        _targetCount(targetCount) {}
+
+  virtual MHWRender::MRenderTarget* const* targetOverrideList(
+      unsigned int& listSize) {
+    listSize = _targetCount;
+    return _targets;
+  }
+
+private:
+  MHWRender::MRenderTarget** _targets;
+  unsigned int _targetCount;
+};
+
+/** Hands the stream's color target to the capture callback. */
+class StreamCapture : public MHWRender::MUserRenderOperation {
+public:
+  StreamCapture(const MString& name, MHWRender::MRenderTarget** targets,
+      PanelRenderOverride::CaptureFunc capture)
+      : MHWRender::MUserRenderOperation(name),
+        _targets(targets),
+        _capture(capture) {}
+
+  virtual MStatus execute(const MHWRender::MDrawContext& drawContext) {
+    _capture(drawContext);
+    return MStatus::kSuccess;
+  }
+
+  virtual MHWRender::MRenderTarget* const* targetOverrideList(
+      unsigned int& listSize) {
+    listSize = 1;
+    return _targets;
+  }
+
+private:
+  MHWRender::MRenderTarget** _targets;
+  PanelRenderOverride::CaptureFunc _capture;
+};
+
+/** Scales the stream's color target into the panel's own target. */
+class PanelBlit : public MHWRender::MQuadRender {
+public:
+  PanelBlit(const MString& name, MHWRender::MShaderInstance** shader)
+      : MHWRender::MQuadRender(name),
+        _shader(shader) {
+    // The quad covers the whole panel, so there's nothing to clear.
+    mClearOperation.setMask(MHWRender::MClearOperation::kClearNone);
+  }
+
+  virtual const MHWRender::MShaderInstance* shader() {
+    return *_shader;
+  }
+
+private:
+  MHWRender::MShaderInstance** _shader;
+};
+
+} // namespace
+
+PanelRenderOverride::PanelRenderOverride(const MString& name,
+    unsigned int width, unsigned int height, bool floatTarget,
+    CaptureFunc capture)
+    : MHWRender::MRenderOverride(name),
+      _width(width),
+      _height(height),
+      _floatTarget(floatTarget),
+      _targets{nullptr, nullptr},
+      _blitShader(nullptr),
+      _currentOperation(-1) {
+  _operations[SCENE_OPERATION].reset(
+      new StreamSceneRender(name + "_scene", _targets, TARGET_COUNT));
+  _operations[CAPTURE_OPERATION].reset(
+      new StreamCapture(name + "_capture", _targets, capture));
+  _operations[BLIT_OPERATION].reset(
+      new PanelBlit(name + "_blit", &_blitShader));
+  _operations[HUD_OPERATION].reset(new MHWRender::MHUDRender());
+  _operations[PRESENT_OPERATION].reset(
+      new MHWRender::MPresentTarget(name + "_present"));
+}
+
+PanelRenderOverride::~PanelRenderOverride() {
+  MHWRender::MRenderer* renderer = MHWRender::MRenderer::theRenderer();
+  if (!renderer) {
+    return;
+  }
+
+  const MHWRender::MRenderTargetManager* targetManager =
+      renderer->getRenderTargetManager();
+  for (MHWRender::MRenderTarget*& target : _targets) {
+    if (target && targetManager) {
+      targetManager->releaseRenderTarget(target);
+    }
+    target = nullptr;
+  }
+
+  const MHWRender::MShaderManager* shaderManager =
+      renderer->getShaderManager();
+  if (_blitShader && shaderManager) {
+    shaderManager->releaseShader(_blitShader);
+  }
+  _blitShader = nullptr;
+}
+
+MHWRender::DrawAPI PanelRenderOverride::supportedDrawAPIs() const {
+  return MHWRender::kAllDevices;
+}
+
+bool PanelRenderOverride::startOperationIterator() {
+  _currentOperation = 0;
+  return true;
+}
+
+MHWRender::MRenderOperation* PanelRenderOverride::renderOperation() {
+  if (_currentOperation >= 0 && _currentOperation < OPERATION_COUNT) {
+    return _operations[_currentOperation].get();
+  }
+  return nullptr;
+}
+
+bool PanelRenderOverride::nextRenderOperation() {
+  _currentOperation++;
+  return _currentOperation < OPERATION_COUNT;
+}
+
+MStatus PanelRenderOverride::setup(const MString& destination) {
+  if (!acquireTargets()) {
+    return MStatus::kFailure;
+  }
+
+  if (!_blitShader) {
+    MHWRender::MRenderer* renderer = MHWRender::MRenderer::theRenderer();
+    const MHWRender::MShaderManager* shaderManager =
+        renderer ? renderer->getShaderManager() : nullptr;
+    if (!shaderManager) {
+      return MStatus::kFailure;
+    }
+    _blitShader = shaderManager->getEffectsFileShader("Copy", "");
+    if (!_blitShader) {
+      return MStatus::kFailure;
+    }
+  }
+
+  MHWRender::MRenderTargetAssignment assignment;
+  assignment.target = _targets[COLOR_TARGET];
+  _blitShader->setParameter("gInputTex", assignment);
+  return MStatus::kSuccess;
+}
+
+MStatus PanelRenderOverride::cleanup() {
+  _currentOperation = -1;
+  return MStatus::kSuccess;
+}
+
+MString PanelRenderOverride::uiName() const {
+  return "USB stream";
+}
+
+bool PanelRenderOverride::acquireTargets() {
+  if (_targets[COLOR_TARGET] && _targets[DEPTH_TARGET]) {
+    return true;
+  }
+
+  MHWRender::MRenderer* renderer = MHWRender::MRenderer::theRenderer();
+  const MHWRender::MRenderTargetManager* targetManager =
+      renderer ? renderer->getRenderTargetManager() : nullptr;
+  if (!targetManager) {
+    return false;
+  }
+
+  MHWRender::MRasterFormat colorFormat = _floatTarget
+      ? MHWRender::kR16G16B16A16_FLOAT
+      : MHWRender::kR8G8B8A8_UNORM;
+  MHWRender::MRenderTargetDescription color(name() + "_color", _width,
+      _height, 1, colorFormat, 0, false);
+  MHWRender::MRenderTargetDescription depth(name() + "_depth", _width,
+      _height, 1, MHWRender::kD24S8, 0, false);
+  if (!_targets[COLOR_TARGET]) {
+    _targets[COLOR_TARGET] = targetManager->acquireRenderTarget(color);
+  }
+  if (!_targets[DEPTH_TARGET]) {
+    _targets[DEPTH_TARGET] = targetManager->acquireRenderTarget(depth);
+  }
+  return _targets[COLOR_TARGET] && _targets[DEPTH_TARGET];
+}
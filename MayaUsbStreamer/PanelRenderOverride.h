@@ -0,0 +1,57 @@
+#pragma once
+
+#include <maya/MString.h>
+#include <maya/MViewport2Renderer.h>
+#include <maya/MRenderTargetManager.h>
+#include <maya/MShaderManager.h>
+#include <functional>
+#include <memory>
+
+/**
+ * A VP2 render override for one streaming panel. It renders the panel's scene
+ * into targets of the stream's size, hands them to the capture callback, and
+ * then draws them scaled into the panel with the usual HUD on top. Only the
+ * panel it's assigned to (see MayaUsbStreamer::attachRenderOverride) renders
+ * at the stream's size; every other viewport keeps its own size and cost.
+ *
+ * Float captures (for -cs sRGB) render into a half-float target, others into
+ * 8-bit RGBA, which the encoder decomposes tile by tile.
+ */
+class PanelRenderOverride : public MHWRender::MRenderOverride {
+public:
+  /** Called on Maya's main thread with the stream-size color target bound. */
+  using CaptureFunc = std::function<void(const MHWRender::MDrawContext&)>;
+
+  PanelRenderOverride(const MString& name, unsigned int width,
+      unsigned int height, bool floatTarget, CaptureFunc capture);
+  virtual ~PanelRenderOverride();
+
+  virtual MHWRender::DrawAPI supportedDrawAPIs() const;
+  virtual bool startOperationIterator();
+  virtual MHWRender::MRenderOperation* renderOperation();
+  virtual bool nextRenderOperation();
+  virtual MStatus setup(const MString& destination);
+  virtual MStatus cleanup();
+  virtual MString uiName() const;
+
+private:
+  enum {
+    SCENE_OPERATION,
+    CAPTURE_OPERATION,
+    BLIT_OPERATION,
+    HUD_OPERATION,
+    PRESENT_OPERATION,
+    OPERATION_COUNT
+  };
+  enum { COLOR_TARGET, DEPTH_TARGET, TARGET_COUNT };
+
+  unsigned int _width;
+  unsigned int _height;
+  bool _floatTarget;
+  MHWRender::MRenderTarget* _targets[TARGET_COUNT];
+  MHWRender::MShaderInstance* _blitShader;
+  std::unique_ptr<MHWRender::MRenderOperation> _operations[OPERATION_COUNT];
+  int _currentOperation;
+
+  bool acquireTargets();
+};
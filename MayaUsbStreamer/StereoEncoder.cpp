@@ -0,0 +1,670 @@
+#include "StereoEncoder.h"
+#include "ImageUtils.h"
+#include <algorithm>
+#include <stdexcept>
+#include <iostream>
+#include <atomic>
+#include <cstring>
+#include <iterator>
+
+StereoEncoder::StereoEncoder(size_t renderWidth, size_t renderHeight,
+    ImageUtils::ColorTransform colorTransform, double streamScale,
+    std::function<void(SharedJpegFrame)> frameSink)
+    : _jpegCompressor(tjInitCompress()),
+      _colorTransform(colorTransform),
+      _streamScale(streamScale),
+      _eyeLayout(ImageUtils::EyeLayout::SideBySide),
+      _quality(MAX_QUALITY),
+      _slices(1),
+      _refineQuality(MAX_QUALITY),
+      _refineSubsamp(JPEG_SUBSAMP),
+      _encodeWorker(nullptr),
+      _encodeReady(false),
+      _rawData(nullptr),
+      _rawInvalidate(false),
+      _rawFace(-1),
+      _encodeFailed(false),
+      _tileTracking(false),
+      _busyFrames(0),
+      _pausedFrames(0),
+      _rgbImageWidth(0),
+      _rgbImageHeight(0),
+      _rgbImageFace(-1),
+      _rgbImageHash(0),
+      _sentFaces(),
+      _frames(0),
+      _unchangedFrames(0),
+      _changedTiles(0),
+      _tiles(0),
+      _untrackedFrames(0),
+      _refinedFrames(0),
+      _cachedFaces(0) {
+  if (_jpegCompressor == nullptr) {
+    throw std::runtime_error("Could not initialize TurboJPEG");
+  }
+  std::cout << "TurboJPEG INIT" << std::endl;
+
+  for (size_t i = 0; i < INITIAL_FRAMES; ++i) {
+    _framePool.push_back(std::make_shared<JpegFrame>());
+  }
+
+  _encodeWorker = std::make_shared<InterruptibleThread>(
+    [=](const InterruptibleThread::SharedCancelToken cancel) {
+      // Allocate everything up front for the expected render size so that
+      // the loop doesn't touch the heap in steady state. Doing it here puts
+      // the buffers on this thread's NUMA node.
+      if (!reserveBuffers(renderWidth, renderHeight)) {
+        std::cout << "Could not allocate encoder buffers" << std::endl;
+      }
+
+      while (true) {
+        std::shared_ptr<JpegFrame> frame;
+        int quality;
+        int subsamp = JPEG_SUBSAMP;
+
+        {
+          std::unique_lock<std::mutex> lock(_encodeMutex);
+          _encodeCv.wait(lock, [&] {
+            return _encodeReady || cancel->isCancelled();
+          });
+
+          if (cancel->isCancelled()) {
+            break;
+          }
+
+          if (_rawData == nullptr) {
+            // A refinement: _rgbImage still holds the last frame.
+            quality = _refineQuality;
+            subsamp = _refineSubsamp;
+            _refinedFrames++;
+          } else {
+            ImageUtils::PixelFormat pixelFormat;
+            bool decomposed = false;
+            size_t changedTiles = 0;
+            int face = _rawFace;
+            uint64_t faceHash = 0;
+            bool unchangedFace = false;
+            SharedJpegFrame cachedFace;
+            if (!toPixelFormat(_rawDesc.fFormat, pixelFormat)) {
+              std::cout << "Skipping frame: unsupported raster format "
+                        << _rawDesc.fFormat << std::endl;
+            } else if (!reserveBuffers(_rawDesc.fWidth, _rawDesc.fHeight)) {
+              std::cout << "Skipping frame: could not allocate buffers for "
+                        << _rawDesc.fWidth << "x" << _rawDesc.fHeight
+                        << std::endl;
+            } else if (!configureKernel(pixelFormat, _rawDesc.fWidth,
+                _rawDesc.fHeight)) {
+              std::cout << "Skipping frame: cannot decompose "
+                        << _rawDesc.fWidth << "x" << _rawDesc.fHeight << " "
+                        << ImageUtils::formatName(pixelFormat)
+                        << " capture (dimensions must be even)" << std::endl;
+            } else {
+              if (face >= 0) {
+                // A face the devices already have, or one that was encoded
+                // before, needn't be decomposed at all.
+                if (_rawInvalidate) {
+                  std::fill(std::begin(_sentFaces), std::end(_sentFaces), 0);
+                }
+                faceHash = ImageUtils::hashImage(_rawData,
+                    (size_t) _rawDesc.fWidth * _rawDesc.fHeight *
+                    ImageUtils::bytesPerPixel(pixelFormat));
+                unchangedFace = _sentFaces[face] == faceHash;
+                if (!unchangedFace) {
+                  cachedFace = findCachedFace(face, faceHash);
+                }
+              }
+
+              if (!unchangedFace && !cachedFace) {
+                // _rgbImage still holds the previous frame, so only the
+                // tiles that changed since then need decomposing. A face
+                // has nothing in common with the previous one.
+                ImageUtils::DestImage image =
+                    _kernel.image(_rgbImage.data());
+                bool invalidate = face >= 0 || _rawInvalidate || _encodeFailed;
+                bool compare = !invalidate && compareTiles();
+                changedTiles = _kernel.runChanged(_rawData, &image, !compare);
+                if (compare) {
+                  countChangedTiles(changedTiles);
+                } else if (!invalidate) {
+                  _untrackedFrames++;
+                }
+                _encodeFailed = false;
+                decomposed = true;
+              }
+            }
+
+            MHWRender::MTexture::freeRawData(_rawData);
+            _rawData = nullptr;
+
+            if (unchangedFace) {
+              _frames++;
+              _unchangedFrames++;
+              _encodeReady = false;
+              continue;
+            } else if (cachedFace) {
+              // Hand out the earlier JPEG again, without the lock. Like any
+              // face, it keeps the encoder busy until the devices have it.
+              _frames++;
+              _cachedFaces++;
+              _sentFaces[face] = faceHash;
+              lock.unlock();
+              frameSink(cachedFace);
+              lock.lock();
+              _encodeReady = false;
+              continue;
+            } else if (!decomposed) {
+              _encodeReady = false;
+              continue;
+            }
+
+            _frames++;
+            _changedTiles += changedTiles;
+            _tiles += _kernel.tileCount();
+            if (changedTiles == 0) {
+              // The devices already have (or are about to get) this image.
+              _unchangedFrames++;
+              _encodeReady = false;
+              continue;
+            }
+
+            _rgbImageWidth = _kernel.imageWidth();
+            _rgbImageHeight = _kernel.imageHeight();
+            _rgbImageFace = face;
+            _rgbImageHash = faceHash;
+            _rgbImagePose = _rawPose;
+            quality = _quality;
+          }
+
+          frame = acquireFrame();
+          frame->width = _rgbImageWidth;
+          frame->height = _rgbImageHeight;
+          frame->face = _rgbImageFace;
+          frame->pose = _rgbImagePose;
+
+          // Faces are cached once compressed, so they're never sliced.
+          size_t sliceHeight = StereoEncoder::sliceHeight(_rgbImageHeight,
+              _rgbImageFace >= 0 ? 1 : _slices);
+          size_t slices = (_rgbImageHeight + sliceHeight - 1) / sliceHeight;
+
+          // reserveBuffers sized the pool for 4:2:0, so this only allocates
+          // the first time a frame is refined without subsampling.
+          if (!frame->reserve(jpegBound(_rgbImageWidth, _rgbImageHeight,
+              slices, subsamp))) {
+            std::cout << "Skipping frame: could not allocate JPEG buffer"
+                      << std::endl;
+            _encodeFailed = true;
+            _encodeReady = false;
+            continue;
+          }
+
+          if (slices > 1) {
+            // Compressed below, without the lock so that the devices (which
+            // may be reconfiguring the encoder) get the frame right away.
+            // _encodeReady stays set, so captures are skipped meanwhile just
+            // as they are while a whole frame is compressed.
+            frame->beginSlices(slices);
+          } else {
+            // The pooled buffer is sized by tjBufSize, so TurboJPEG never
+            // needs to reallocate it.
+            frame->beginSlices(1);
+            unsigned char* jpegData = frame->buffer.data();
+            unsigned long jpegSizeUlong = frame->capacity();
+            int status = tjCompress2(_jpegCompressor,
+              _rgbImage.data(),
+              _rgbImageWidth,
+              0,
+              _rgbImageHeight,
+              TJPF_RGBX,
+              &jpegData,
+              &jpegSizeUlong,
+              subsamp,
+              quality,
+              TJFLAG_NOREALLOC);
+
+            if (status != 0) {
+              std::cout << "tjCompress2: " << tjGetErrorStr() << std::endl;
+              _encodeFailed = true; // Don't skip the next one as unchanged.
+              _encodeReady = false;
+              continue;
+            }
+
+            frame->publishSlice(jpegSizeUlong);
+            if (_rgbImageFace >= 0) {
+              cacheFace(*frame, _rgbImageHash);
+              _sentFaces[_rgbImageFace] = _rgbImageHash;
+            }
+
+            // The encoder is free again once the frame is compressed, or
+            // for a face, once the devices have it. The panorama sweep waits
+            // for the devices to go idle, which they'd briefly be until then.
+            if (_rgbImageFace < 0) {
+              _encodeReady = false;
+            }
+          }
+        }
+
+        // Fan out without holding the lock so Maya can queue the next frame.
+        frameSink(frame);
+
+        if (frame->sliceCount > 1) {
+          // The devices send each slice as soon as it's published.
+          bool compressed = compressSlices(*frame, quality, subsamp);
+          std::lock_guard<std::mutex> lock(_encodeMutex);
+          if (!compressed) {
+            _encodeFailed = true;
+          }
+          _encodeReady = false;
+        } else if (frame->face >= 0) {
+          std::lock_guard<std::mutex> lock(_encodeMutex);
+          _encodeReady = false;
+        }
+      }
+
+      std::cout << "Encode loop ended" << std::endl;
+    }
+  );
+}
+
+StereoEncoder::~StereoEncoder() {
+  if (_encodeWorker) {
+    _encodeWorker->cancel();
+    { std::lock_guard<std::mutex> lock(_encodeMutex); }
+    _encodeCv.notify_one();
+    _encodeWorker->join();
+  }
+
+  // A capture may have been queued after the encode loop stopped.
+  if (_rawData != nullptr) {
+    MHWRender::MTexture::freeRawData(_rawData);
+  }
+
+  tjDestroy(_jpegCompressor);
+  std::cout << "TurboJPEG EXIT" << std::endl;
+}
+
+unsigned long StereoEncoder::jpegBound(size_t width, size_t height,
+    size_t slices, int subsamp) const {
+  // TurboJPEG assumes each slice has tjBufSize bytes of room left.
+  size_t sliceHeight = StereoEncoder::sliceHeight(height, slices);
+  unsigned long bound = 0;
+  for (size_t y = 0; y < height; y += sliceHeight) {
+    unsigned long size = tjBufSize(width, std::min(sliceHeight, height - y),
+        subsamp);
+    if (size == (unsigned long) -1) {
+      return size;
+    }
+    bound += size;
+  }
+  return bound;
+}
+
+bool StereoEncoder::reserveBuffers(size_t srcWidth, size_t srcHeight) {
+  // Decomposition turns each 2x2 source block into one pixel per eye. A
+  // stream scale below 1 only shrinks that, so this is an upper bound. The
+  // eyes may be side by side or top to bottom, which pad differently.
+  size_t width = srcWidth;
+  size_t height = srcHeight / 2;
+  size_t rgbSize = width * height * ImageUtils::DEST_COMPS;
+  unsigned long sideBySideSize = jpegBound(width, height, _slices,
+      JPEG_SUBSAMP);
+  unsigned long topBottomSize = jpegBound(width / 2, height * 2, _slices,
+      JPEG_SUBSAMP);
+  if (sideBySideSize == (unsigned long) -1 ||
+      topBottomSize == (unsigned long) -1) {
+    return false;
+  }
+  unsigned long jpegSize = std::max(sideBySideSize, topBottomSize);
+
+  if (rgbSize > _rgbImage.size()) {
+    if (!_rgbImage.allocate(rgbSize)) {
+      return false;
+    }
+    std::cout << "Allocated encoder buffers for " << width << "x" << height
+              << " (huge pages=" << _rgbImage.isHugePage()
+              << ", NUMA node=" << _rgbImage.numaNode() << ")" << std::endl;
+  }
+
+  for (const auto& frame : _framePool) {
+    if (!frame->reserve(jpegSize)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool StereoEncoder::configureKernel(ImageUtils::PixelFormat pixelFormat,
+    size_t srcWidth, size_t srcHeight) {
+  if (_kernel.isConfiguredFor(pixelFormat, srcWidth, srcHeight) &&
+      _kernel.config().scale == _streamScale &&
+      _kernel.config().eyeLayout == _eyeLayout &&
+      _kernel.config().lensMask == _lensMask) {
+    return true;
+  }
+
+  // Only happens for the first frame of a connection, if Maya changes the
+  // render target's format or size, or after setOutput.
+  ImageUtils::KernelConfig config;
+  config.source = pixelFormat;
+  config.transform = _colorTransform;
+  config.dest = ImageUtils::DestFormat::RGBX;
+  config.eyeLayout = _eyeLayout;
+  config.scale = _streamScale;
+  config.lensMask = _lensMask;
+  if (!_kernel.configure(config, srcWidth, srcHeight)) {
+    return false;
+  }
+
+  // Hashing reads the whole capture, so it only pays where it can save more
+  // than that: a kernel that decomposes tile by tile (RGBX at full size; the
+  // others decompose everything on any change), from a format that costs
+  // more to decompose than to hash. RGBA32F hashes about as slowly as it
+  // decomposes.
+  _tileTracking = _kernel.decomposesTiles() &&
+      pixelFormat != ImageUtils::PixelFormat::RGBA32F;
+  _busyFrames = 0;
+  _pausedFrames = 0;
+  std::cout << "Decomposing " << srcWidth << "x" << srcHeight << " "
+            << ImageUtils::formatName(pixelFormat) << " captures into "
+            << _kernel.imageWidth() << "x" << _kernel.imageHeight()
+            << (_tileTracking ? ", comparing tiles" : "") << std::endl;
+  return true;
+}
+
+/* Whether to compare this capture's tiles with the previous capture's. */
+bool StereoEncoder::compareTiles() {
+  if (!_tileTracking) {
+    return false;
+  }
+  if (_pausedFrames == 0) {
+    return true;
+  }
+  if (++_pausedFrames <= TILE_RETRY_FRAMES) {
+    return false;
+  }
+
+  // The first capture back only records its hashes, so it counts as busy;
+  // if the next one mostly changed as well, comparison pauses again.
+  _pausedFrames = 0;
+  _busyFrames = TILE_BUSY_FRAMES - 2;
+  return true;
+}
+
+/*
+ * Pauses tile comparison while most tiles keep changing (e.g. an animation
+ * is playing), since then hashing costs more than the decomposition it saves.
+ */
+void StereoEncoder::countChangedTiles(size_t changedTiles) {
+  if (changedTiles * 2 <= _kernel.tileCount()) {
+    _busyFrames = 0;
+  } else if (++_busyFrames >= TILE_BUSY_FRAMES) {
+    _busyFrames = 0;
+    _pausedFrames = 1;
+  }
+}
+
+SharedJpegFrame StereoEncoder::findCachedFace(int face, uint64_t hash) {
+  for (auto it = _faceCache.begin(); it != _faceCache.end(); ++it) {
+    if (it->face == face && it->hash == hash) {
+      CachedFace cached = *it;
+      _faceCache.erase(it);
+      _faceCache.push_back(cached);
+      return cached.frame;
+    }
+  }
+  return nullptr;
+}
+
+void StereoEncoder::cacheFace(const JpegFrame& frame, uint64_t hash) {
+  // A copy of just the JPEG, rather than a pooled frame with room for the
+  // largest possible one. Panoramas are only captured when the scene
+  // changes, so this allocation is rare.
+  auto copy = std::make_shared<JpegFrame>();
+  if (!copy->reserve(frame.size)) {
+    return;
+  }
+  std::memcpy(copy->data(), frame.data(), frame.size);
+  copy->width = frame.width;
+  copy->height = frame.height;
+  copy->face = frame.face;
+  copy->beginSlices(1);
+  copy->publishSlice(frame.size);
+
+  _faceCache.erase(std::remove_if(_faceCache.begin(), _faceCache.end(),
+      [&](const CachedFace& cached) {
+        return cached.face == frame.face && cached.hash == hash;
+      }), _faceCache.end());
+  if (_faceCache.size() >= FACE_CACHE_SIZE) {
+    _faceCache.erase(_faceCache.begin());
+  }
+  _faceCache.push_back(CachedFace{frame.face, hash, copy});
+}
+
+void StereoEncoder::forgetFaces() {
+  _faceCache.clear();
+  std::fill(std::begin(_sentFaces), std::end(_sentFaces), 0);
+}
+
+std::shared_ptr<JpegFrame> StereoEncoder::acquireFrame() {
+  // A frame whose only owner is the pool has been sent by (or dropped from)
+  // every device's queue. The acquire fence pairs with the release in the
+  // devices' shared_ptr decrements so we see their last reads of the data.
+  for (const auto& frame : _framePool) {
+    if (frame.use_count() == 1) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return frame;
+    }
+  }
+
+  // More frames are in flight than the pool anticipated (e.g. several slow
+  // devices); grow it once and keep the new frame around for reuse.
+  auto frame = std::make_shared<JpegFrame>();
+  frame->reserve(_framePool.front()->capacity());
+  _framePool.push_back(frame);
+  return frame;
+}
+
+bool StereoEncoder::toPixelFormat(MHWRender::MRasterFormat format,
+    ImageUtils::PixelFormat& pixelFormat) {
+  switch (format) {
+    case MHWRender::kR32G32B32A32_FLOAT:
+      pixelFormat = ImageUtils::PixelFormat::RGBA32F;
+      return true;
+    case MHWRender::kR16G16B16A16_FLOAT:
+      pixelFormat = ImageUtils::PixelFormat::RGBA16F;
+      return true;
+    case MHWRender::kR32G32B32_FLOAT:
+      pixelFormat = ImageUtils::PixelFormat::RGB32F;
+      return true;
+    case MHWRender::kR8G8B8A8_UNORM:
+    case MHWRender::kR8G8B8X8:
+      pixelFormat = ImageUtils::PixelFormat::RGBA8;
+      return true;
+    case MHWRender::kB8G8R8A8:
+    case MHWRender::kB8G8R8X8:
+      pixelFormat = ImageUtils::PixelFormat::BGRA8;
+      return true;
+    case MHWRender::kR10G10B10A2_UNORM:
+      pixelFormat = ImageUtils::PixelFormat::RGB10A2;
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool StereoEncoder::supportsRasterFormat(MHWRender::MRasterFormat format) {
+  ImageUtils::PixelFormat pixelFormat;
+  return toPixelFormat(format, pixelFormat);
+}
+
+bool StereoEncoder::isBusy() {
+  std::unique_lock<std::mutex> lock(_encodeMutex, std::try_to_lock);
+  return !lock.owns_lock() || _encodeReady;
+}
+
+bool StereoEncoder::submitStereo(void* data,
+    MHWRender::MTextureDescription desc, bool invalidate,
+    const FramePose& pose, int face) {
+  if (face >= JpegFrame::PANORAMA_FACES) {
+    return false;
+  }
+
+  if (!supportsRasterFormat(desc.fFormat)) {
+    return false;
+  }
+
+  // If the encode loop is busy, then skip this frame.
+  if (_encodeMutex.try_lock()) {
+    std::lock_guard<std::mutex> lock(_encodeMutex, std::adopt_lock);
+
+    if (!_encodeReady) {
+      // Decomposition and JPEG creation both happen in the encode loop to
+      // improve Maya performance.
+      _rawData = data;
+      _rawDesc = desc;
+      _rawInvalidate = invalidate;
+      _rawFace = face;
+      _rawPose = pose;
+
+      // Dispatch encode loop.
+      _encodeReady = true;
+      _encodeCv.notify_one();
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void StereoEncoder::setOutput(double streamScale,
+    ImageUtils::EyeLayout eyeLayout) {
+  // Waits for a frame in progress, which then keeps its own settings.
+  std::lock_guard<std::mutex> lock(_encodeMutex);
+  _streamScale = streamScale;
+  _eyeLayout = eyeLayout;
+  forgetFaces();
+}
+
+void StereoEncoder::setLensMask(const ImageUtils::LensMask& lensMask) {
+  std::lock_guard<std::mutex> lock(_encodeMutex);
+  _lensMask = lensMask;
+  forgetFaces();
+}
+
+void StereoEncoder::setQuality(int quality) {
+  std::lock_guard<std::mutex> lock(_encodeMutex);
+  _quality = std::max(1, std::min(quality, MAX_QUALITY));
+  forgetFaces();
+}
+
+int StereoEncoder::getQuality() {
+  std::lock_guard<std::mutex> lock(_encodeMutex);
+  return _quality;
+}
+
+bool StereoEncoder::compressSlices(JpegFrame& frame, int quality,
+    int subsamp) {
+  size_t sliceHeight = StereoEncoder::sliceHeight(frame.height,
+      frame.sliceCount);
+  size_t pitch = frame.width * ImageUtils::DEST_COMPS;
+  size_t offset = 0;
+  for (size_t y = 0; y < frame.height; y += sliceHeight) {
+    size_t height = std::min(sliceHeight, frame.height - y);
+    unsigned long jpegSizeUlong = frame.capacity() - offset;
+    if (jpegSizeUlong < tjBufSize(frame.width, height, subsamp)) {
+      std::cout << "Slice buffer too small" << std::endl;
+      frame.failSlices();
+      return false;
+    }
+
+    unsigned char* jpegData = frame.buffer.data() + offset;
+    int status = tjCompress2(_jpegCompressor,
+      _rgbImage.data() + y * pitch,
+      frame.width,
+      pitch,
+      height,
+      TJPF_RGBX,
+      &jpegData,
+      &jpegSizeUlong,
+      subsamp,
+      quality,
+      TJFLAG_NOREALLOC);
+
+    if (status != 0) {
+      std::cout << "tjCompress2: " << tjGetErrorStr() << std::endl;
+      frame.failSlices();
+      return false;
+    }
+
+    offset += jpegSizeUlong;
+    frame.publishSlice(offset);
+  }
+  return true;
+}
+
+bool StereoEncoder::refine(int quality, bool fullChroma) {
+  if (_encodeMutex.try_lock()) {
+    std::lock_guard<std::mutex> lock(_encodeMutex, std::adopt_lock);
+    if (!_encodeReady && _rgbImageWidth > 0) {
+      _refineQuality = std::max(1, std::min(quality, MAX_QUALITY));
+      _refineSubsamp = fullChroma ? TJSAMP_444 : JPEG_SUBSAMP;
+      _encodeReady = true;
+      _encodeCv.notify_one();
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t StereoEncoder::sliceHeight(size_t height, size_t slices) {
+  // Whole 16-row MCUs, so that 4:2:0 chroma never straddles two slices.
+  slices = std::max<size_t>(1, std::min(slices, JpegFrame::MAX_SLICES));
+  size_t sliceHeight = (height + slices - 1) / slices;
+  sliceHeight = (sliceHeight + 15) / 16 * 16;
+  return std::max<size_t>(sliceHeight, 16);
+}
+
+void StereoEncoder::setSlices(size_t slices) {
+  std::lock_guard<std::mutex> lock(_encodeMutex);
+  _slices = std::max<size_t>(1, std::min(slices, JpegFrame::MAX_SLICES));
+}
+
+size_t StereoEncoder::estimateJpegSize(size_t width, size_t height,
+    int quality) {
+  // Bits per pixel of 4:2:0 JPEGs of rendered scenes, which compress better
+  // than photos; interpolated between the measured qualities.
+  struct Point {
+    int quality;
+    double bitsPerPixel;
+  };
+  static const Point points[] = {
+    {1, 0.15}, {50, 0.55}, {60, 0.65}, {70, 0.75}, {80, 0.95}, {85, 1.1},
+    {90, 1.4}, {95, 2.0}, {100, 4.0},
+  };
+
+  quality = std::max(1, std::min(quality, MAX_QUALITY));
+  size_t i = 1;
+  while (points[i].quality < quality) {
+    ++i;
+  }
+  const Point& lo = points[i - 1];
+  const Point& hi = points[i];
+  double t = (double) (quality - lo.quality) / (hi.quality - lo.quality);
+  double bitsPerPixel =
+      lo.bitsPerPixel + t * (hi.bitsPerPixel - lo.bitsPerPixel);
+  return (size_t) (width * height * bitsPerPixel / 8.0);
+}
+
+StereoEncoder::Stats StereoEncoder::getStats() const {
+  Stats stats;
+  stats.frames = _frames.load();
+  stats.unchangedFrames = _unchangedFrames.load();
+  uint64_t tiles = _tiles.load();
+  stats.changedTileRatio =
+      tiles > 0 ? (double) _changedTiles.load() / tiles : 0.0;
+  stats.untrackedFrames = _untrackedFrames.load();
+  stats.refinedFrames = _refinedFrames.load();
+  stats.cachedFaces = _cachedFaces.load();
+  return stats;
+}
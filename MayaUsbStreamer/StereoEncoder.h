@@ -0,0 +1,312 @@
+#pragma once
+
+#include <maya/MTextureManager.h>
+#include <turbojpeg.h>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#include "InterruptibleThread.h"
+#include "FrameBuffer.h"
+#include "ImageUtils.h"
+
+/**
+ * The view a frame was rendered from, so that a device can reproject it to
+ * where the head has turned since, and when it was captured, so that the
+ * device can tell how long it took to arrive.
+ */
+struct FramePose {
+  bool valid;
+  float rotation[4]; /* The head's quaternion (x, y, z, w). */
+  float fovX; /* Each eye's horizontal field of view, in radians. */
+  float fovY;
+  float eyeOffsets[2]; /* Left and right eye along the head's x axis. */
+  /* Host steady clock; unset for panorama faces, which are resent as is. */
+  std::chrono::steady_clock::time_point captureTime;
+
+  FramePose()
+      : valid(false),
+        rotation{0.0f, 0.0f, 0.0f, 1.0f},
+        fovX(0.0f),
+        fovY(0.0f),
+        eyeOffsets{0.0f, 0.0f} {}
+};
+
+/**
+ * A compressed stereo frame, shared between the transmit queues of every
+ * connected device. A frame is one or more slices: independent JPEGs of
+ * horizontal bands, top to bottom, stored back to back in the buffer. A
+ * sliced frame is handed out as soon as its first slice is being encoded,
+ * and each slice is immutable once published; waitForSlice blocks until it
+ * is. A whole frame is a single slice, published before it's handed out.
+ */
+struct JpegFrame {
+  static constexpr size_t MAX_SLICES = 16;
+  static constexpr int PANORAMA_FACES = 6;
+
+  FrameBuffer buffer;
+  size_t size; /* Of the published slices. */
+  size_t width;
+  size_t height;
+  size_t sliceCount;
+  int face; /* Panorama cube face, 0 to PANORAMA_FACES - 1; -1 if none. */
+  FramePose pose;
+
+  JpegFrame()
+      : size(0),
+        width(0),
+        height(0),
+        sliceCount(1),
+        face(-1),
+        _slicesReady(0),
+        _slicesFailed(false) {}
+
+  JpegFrame(const JpegFrame&) = delete;
+  JpegFrame& operator=(const JpegFrame&) = delete;
+
+  unsigned char* data() const { return buffer.data(); }
+  size_t capacity() const { return buffer.size(); }
+  bool reserve(size_t bytes) {
+    return bytes <= buffer.size() || buffer.allocate(bytes);
+  }
+
+  /* Called by the encoder only, while it's the frame's only writer. */
+  void beginSlices(size_t count) {
+    std::lock_guard<std::mutex> lock(_sliceMutex);
+    sliceCount = count;
+    size = 0;
+    _slicesReady = 0;
+    _slicesFailed = false;
+  }
+  void publishSlice(size_t end) {
+    {
+      std::lock_guard<std::mutex> lock(_sliceMutex);
+      _sliceEnds[_slicesReady++] = end;
+      size = end;
+    }
+    _sliceCv.notify_all();
+  }
+  void failSlices() {
+    {
+      std::lock_guard<std::mutex> lock(_sliceMutex);
+      _slicesFailed = true;
+    }
+    _sliceCv.notify_all();
+  }
+
+  /**
+   * Waits for slice index and returns its byte range, or false if the
+   * encoder gave up on the frame first.
+   */
+  bool waitForSlice(size_t index, size_t& begin, size_t& end) const {
+    std::unique_lock<std::mutex> lock(_sliceMutex);
+    _sliceCv.wait(lock, [&] {
+      return _slicesReady > index || _slicesFailed;
+    });
+    if (_slicesReady <= index) {
+      return false;
+    }
+    begin = index > 0 ? _sliceEnds[index - 1] : 0;
+    end = _sliceEnds[index];
+    return true;
+  }
+
+private:
+  mutable std::mutex _sliceMutex;
+  mutable std::condition_variable _sliceCv;
+  size_t _sliceEnds[MAX_SLICES];
+  size_t _slicesReady;
+  bool _slicesFailed;
+};
+
+using SharedJpegFrame = std::shared_ptr<const JpegFrame>;
+
+/**
+ * Decomposes checkerboard stereo captures and compresses them on a worker
+ * thread. Each frame is encoded exactly once and handed to the frame sink,
+ * regardless of how many devices it is going to. Each stereo panel has its
+ * own encoder, so panels are processed in parallel.
+ */
+class StereoEncoder {
+  static constexpr int JPEG_SUBSAMP = TJSAMP_420;
+  static constexpr size_t INITIAL_FRAMES = 3; // Encoding, queued, sending.
+  static constexpr size_t FACE_CACHE_SIZE = 24; // Four whole panoramas.
+  /*
+   * Tile comparison pauses after this many captures in a row with most of
+   * their tiles changed, and is tried again after TILE_RETRY_FRAMES more.
+   */
+  static constexpr size_t TILE_BUSY_FRAMES = 8;
+  static constexpr size_t TILE_RETRY_FRAMES = 60;
+
+  /* An encoded panorama face, kept to be sent again if its capture recurs. */
+  struct CachedFace {
+    int face;
+    uint64_t hash; /* Of the raw capture. */
+    SharedJpegFrame frame;
+  };
+
+  tjhandle _jpegCompressor;
+  const ImageUtils::ColorTransform _colorTransform;
+  /* Output size relative to the capture's, and layout; see setOutput. */
+  double _streamScale;
+  ImageUtils::EyeLayout _eyeLayout;
+  ImageUtils::LensMask _lensMask; /* See setLensMask. */
+  int _quality; /* JPEG quality, 1 to 100; see setQuality. */
+  size_t _slices; /* Requested slices per frame; see setSlices. */
+  int _refineQuality; /* Of the refinement queued by refine, if any. */
+  int _refineSubsamp;
+
+  std::shared_ptr<InterruptibleThread> _encodeWorker;
+  bool _encodeReady; /* Note: doesn't have to be atomic because we lock. */
+  std::mutex _encodeMutex;
+  std::condition_variable _encodeCv;
+
+  /*
+   * Owned until decomposed; freed with freeRawData. Null while _encodeReady
+   * means the last frame is to be refined instead.
+   */
+  void* _rawData;
+  MHWRender::MTextureDescription _rawDesc;
+  bool _rawInvalidate;
+  int _rawFace;
+  FramePose _rawPose;
+
+  /* Reconfigured only when the capture format or size changes. */
+  ImageUtils::DecomposeKernel _kernel;
+  bool _encodeFailed; /* The devices may not have the last decomposition. */
+  /*
+   * Whether the kernel's configuration gains anything from runChanged (see
+   * configureKernel), and while it does, the captures in a row that mostly
+   * changed and those since comparison was paused (0 if it isn't).
+   */
+  bool _tileTracking;
+  size_t _busyFrames;
+  size_t _pausedFrames;
+
+  /* Allocated by the encode loop so it lives on the encoding thread's node. */
+  FrameBuffer _rgbImage;
+  size_t _rgbImageWidth;
+  size_t _rgbImageHeight;
+  int _rgbImageFace; /* Panorama face _rgbImage holds, or -1. */
+  uint64_t _rgbImageHash; /* Of that face's capture. */
+  FramePose _rgbImagePose;
+
+  /*
+   * Capture hashes of the faces last handed to the devices (0 if none), and
+   * recently encoded faces, least recently used first. Both are forgotten
+   * whenever the output settings change.
+   */
+  uint64_t _sentFaces[JpegFrame::PANORAMA_FACES];
+  std::vector<CachedFace> _faceCache;
+
+  /* Only touched by the encode loop. */
+  std::vector<std::shared_ptr<JpegFrame>> _framePool;
+
+  std::atomic<uint64_t> _frames;
+  std::atomic<uint64_t> _unchangedFrames;
+  std::atomic<uint64_t> _changedTiles;
+  std::atomic<uint64_t> _tiles;
+  std::atomic<uint64_t> _untrackedFrames;
+  std::atomic<uint64_t> _refinedFrames;
+  std::atomic<uint64_t> _cachedFaces;
+
+  bool reserveBuffers(size_t srcWidth, size_t srcHeight);
+  bool configureKernel(ImageUtils::PixelFormat pixelFormat, size_t srcWidth,
+      size_t srcHeight);
+  bool compareTiles();
+  void countChangedTiles(size_t changedTiles);
+  bool compressSlices(JpegFrame& frame, int quality, int subsamp);
+  unsigned long jpegBound(size_t width, size_t height, size_t slices,
+      int subsamp) const;
+  std::shared_ptr<JpegFrame> acquireFrame();
+  SharedJpegFrame findCachedFace(int face, uint64_t hash);
+  void cacheFace(const JpegFrame& frame, uint64_t hash);
+  void forgetFaces();
+
+public:
+  struct Stats {
+    uint64_t frames;          /* Captures decomposed. */
+    uint64_t unchangedFrames; /* Identical to the previous one; not sent. */
+    double changedTileRatio;  /* Share of tiles that had to be decomposed. */
+    uint64_t untrackedFrames; /* Decomposed whole without comparing tiles. */
+    uint64_t refinedFrames;   /* Frames compressed again by refine. */
+    uint64_t cachedFaces;     /* Panorama faces resent without encoding. */
+  };
+
+  StereoEncoder(size_t renderWidth, size_t renderHeight,
+      ImageUtils::ColorTransform colorTransform, double streamScale,
+      std::function<void(SharedJpegFrame)> frameSink);
+  ~StereoEncoder();
+  bool isBusy();
+  /**
+   * Queues a raw capture for encoding. On success the encoder takes ownership
+   * of data and releases it with MTexture::freeRawData; otherwise the caller
+   * still owns it. Where the kernel decomposes tile by tile, only the tiles
+   * that differ from the previous capture are decomposed, and an identical
+   * capture isn't sent at all; pass invalidate if the whole image has likely
+   * changed, or must be sent regardless.
+   *
+   * A capture of panorama face (0 to JpegFrame::PANORAMA_FACES - 1) is
+   * always decomposed whole, since it shares nothing with the previous
+   * face. It's skipped if it's identical to the capture last sent for that
+   * face, unless invalidate is set, and sent from a cache of encoded faces
+   * if it matches one of those.
+   *
+   * pose is the view the capture was rendered from, and goes with it (and
+   * any refinement of it) to the devices.
+   */
+  bool submitStereo(void* data, MHWRender::MTextureDescription desc,
+      bool invalidate, const FramePose& pose, int face = -1);
+  Stats getStats() const;
+  /**
+   * Changes the output size and eye layout from the next frame on, e.g. to
+   * suit a device's capabilities. streamScale is relative to the capture's
+   * size, in (0, 1].
+   */
+  void setOutput(double streamScale, ImageUtils::EyeLayout eyeLayout);
+  /**
+   * Blacks out the parts of each eye that the headset's lenses don't show
+   * from the next frame on, so that they're neither converted nor cost
+   * anything in the JPEG.
+   */
+  void setLensMask(const ImageUtils::LensMask& lensMask);
+  /** Changes the JPEG quality (1 to 100) from the next frame on. */
+  void setQuality(int quality);
+  int getQuality();
+  /**
+   * Roughly how large a JPEG of width x height is at quality, for typical
+   * rendered content. Meant for choosing settings before any frame has been
+   * encoded, not for reserving buffers.
+   */
+  static size_t estimateJpegSize(size_t width, size_t height, int quality);
+  /**
+   * Compresses the last frame again at quality and hands it to the frame
+   * sink, e.g. once the head and scene are still and the link is idle.
+   * fullChroma skips chroma subsampling, which is as close to lossless as
+   * the devices' JPEG decoders go. Returns false if the encoder is busy or
+   * hasn't encoded a frame yet.
+   */
+  bool refine(int quality, bool fullChroma);
+  /**
+   * Splits each frame into up to slices horizontal bands (at most
+   * JpegFrame::MAX_SLICES), each its own JPEG, from the next frame on. A
+   * sliced frame is handed to the frame sink before it's compressed, so the
+   * devices can send each slice while the next one is compressed. Each
+   * slice costs its own JPEG headers. 1 turns slicing off.
+   */
+  void setSlices(size_t slices);
+  /** Height in pixels of each slice but the last, a multiple of 16. */
+  static size_t sliceHeight(size_t height, size_t slices);
+  static constexpr int MAX_QUALITY = 100;
+  static constexpr int MIN_QUALITY = 50; /* Lower looks worse than shrinking. */
+  static bool supportsRasterFormat(MHWRender::MRasterFormat format);
+  /** Maps a VP2 raster format to the decomposition's source layout. */
+  static bool toPixelFormat(MHWRender::MRasterFormat format,
+      ImageUtils::PixelFormat& pixelFormat);
+};
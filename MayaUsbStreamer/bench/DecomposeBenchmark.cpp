@@ -0,0 +1,582 @@
+/*
+ * Maya-free benchmark for the checkerboard decomposition. Measures each source
+ * format with cached and streaming destination stores, plus a read of the
+ * output afterwards (standing in for the JPEG encoder), and isolates the
+ * write-allocate cost of the output buffer with plain fill passes. Then times
+ * each DecomposeKernel destination format at full size, half size (the 2x
+ * kernel) and three-quarter size (the general area filter), and with lens
+ * masks of a few sizes, which skip converting the eyes' corners. Finally
+ * compares a full decomposition with DecomposeKernel::runChanged when no
+ * tiles, about a ninth of them, or all of them changed, to check that hashing
+ * the tiles costs less than the decomposition it skips, both at full size
+ * (decomposed tile by tile) and at half size (decomposed whole on any change).
+ *
+ * Also times the sRGB encoding against the plain clamp on float captures.
+ *
+ * Before timing anything, checks that the SIMD and scalar paths clamp float
+ * captures alike (infinities, NaN and values far out of range), and that the
+ * sRGB encoding stays within one code of the 12-bit LUT it replaced, and
+ * fails if either doesn't.
+ *
+ *   make benchmark
+ *   ./DecomposeBenchmark [streamWidth streamHeight [iterations]]
+ */
+#include "../ImageUtils.h"
+#include "../FrameBuffer.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BENCHMARK_SSE2 1
+#include <emmintrin.h>
+#endif
+
+using Clock = std::chrono::steady_clock;
+using ImageUtils::PixelFormat;
+using ImageUtils::StoreMode;
+
+static double elapsedMs(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+static double gbPerSecond(size_t bytes, double ms) {
+  return bytes / (ms * 1e6);
+}
+
+/* Sums the output so the compiler can't drop the reads. */
+static uint64_t consume(const FrameBuffer& buffer) {
+  uint64_t sum = 0;
+  const uint64_t* words = reinterpret_cast<const uint64_t*>(buffer.data());
+  for (size_t i = 0; i < buffer.size() / sizeof(uint64_t); ++i) {
+    sum += words[i];
+  }
+  return sum;
+}
+
+static void fill(FrameBuffer& buffer, bool streaming) {
+#ifdef BENCHMARK_SSE2
+  __m128i value = _mm_set1_epi32(0x01020304);
+  __m128i* p = reinterpret_cast<__m128i*>(buffer.data());
+  size_t count = buffer.size() / sizeof(__m128i);
+  if (streaming) {
+    for (size_t i = 0; i < count; ++i) {
+      _mm_stream_si128(p + i, value);
+    }
+    _mm_sfence();
+  } else {
+    for (size_t i = 0; i < count; ++i) {
+      _mm_store_si128(p + i, value);
+    }
+  }
+#else
+  (void) streaming;
+  std::memset(buffer.data(), 1, buffer.size());
+#endif
+}
+
+static void fillSource(FrameBuffer& buffer, PixelFormat format) {
+  unsigned char* data = buffer.data();
+  size_t pixelBytes = ImageUtils::bytesPerPixel(format);
+  for (size_t i = 0; i < buffer.size() / pixelBytes; ++i) {
+    unsigned char* pixel = data + i * pixelBytes;
+    float value = (i % 997) / 997.0f;
+    switch (format) {
+      case PixelFormat::RGBA32F:
+      case PixelFormat::RGB32F:
+        for (size_t c = 0; c < pixelBytes / sizeof(float); ++c) {
+          std::memcpy(pixel + c * sizeof(float), &value, sizeof(float));
+        }
+        break;
+      case PixelFormat::RGBA16F: {
+        uint16_t half = 0x3800; // 0.5
+        for (size_t c = 0; c < 4; ++c) {
+          std::memcpy(pixel + c * sizeof(half), &half, sizeof(half));
+        }
+        break;
+      }
+      default:
+        std::memset(pixel, (int) (i % 251), pixelBytes);
+        break;
+    }
+  }
+}
+
+/*
+ * Configures kernel for side-by-side RGBX eyes at full size, the encoder's
+ * default, with the given transform and store mode.
+ */
+static bool configureDirect(ImageUtils::DecomposeKernel& kernel,
+    PixelFormat format, size_t srcWidth, size_t srcHeight,
+    ImageUtils::ColorTransform transform, StoreMode storeMode) {
+  ImageUtils::KernelConfig config;
+  config.source = format;
+  config.transform = transform;
+  config.storeMode = storeMode;
+  return kernel.configure(config, srcWidth, srcHeight);
+}
+
+/*
+ * Decomposes a row of five blocks per eye filled with one value, so that the
+ * SIMD path converts the first four and the scalar tail the fifth, and
+ * compares them. Returns false (after saying where) if they differ.
+ */
+static bool checkClamping() {
+  const size_t blocks = 5;
+  const size_t srcWidth = blocks * 2;
+  const size_t srcHeight = 2;
+  const float floats[] = {
+    INFINITY, -INFINITY, NAN, 3e9f, 1e38f, 65504.0f, 2.0f, -1.0f, 0.5f,
+  };
+  // The same values as halves; 1e38 and 3e9 saturate to infinity.
+  const uint16_t halves[] = {
+    0x7c00, 0xfc00, 0x7e00, 0x7c00, 0x7c00, 0x7bff, 0x4000, 0xbc00, 0x3800,
+  };
+  const PixelFormat formats[] = {PixelFormat::RGBA32F, PixelFormat::RGBA16F};
+  const ImageUtils::ColorTransform transforms[] = {
+    ImageUtils::ColorTransform::Linear, ImageUtils::ColorTransform::Srgb,
+  };
+
+  unsigned char src[srcWidth * srcHeight * 4 * sizeof(float)];
+  unsigned char dest[srcWidth * (srcHeight / 2) * ImageUtils::DEST_COMPS];
+  for (PixelFormat format : formats) {
+    for (size_t v = 0; v < sizeof(floats) / sizeof(floats[0]); ++v) {
+      for (size_t i = 0; i < srcWidth * srcHeight * 4; ++i) {
+        if (format == PixelFormat::RGBA32F) {
+          std::memcpy(src + i * sizeof(float), &floats[v], sizeof(float));
+        } else {
+          std::memcpy(src + i * sizeof(uint16_t), &halves[v],
+              sizeof(uint16_t));
+        }
+      }
+
+      for (ImageUtils::ColorTransform transform : transforms) {
+        ImageUtils::DecomposeKernel kernel;
+        if (!configureDirect(kernel, format, srcWidth, srcHeight, transform,
+            StoreMode::Cached) || kernel.imageSize() != sizeof(dest)) {
+          std::fprintf(stderr, "Could not decompose the clamping check\n");
+          return false;
+        }
+        ImageUtils::DestImage image = kernel.image(dest);
+        kernel.run(src, &image);
+
+        // Each eye's last pixel is the scalar tail's; X is undefined.
+        for (size_t eye = 0; eye < 2; ++eye) {
+          const unsigned char* pixels =
+              dest + eye * blocks * ImageUtils::DEST_COMPS;
+          const unsigned char* tail =
+              pixels + (blocks - 1) * ImageUtils::DEST_COMPS;
+          for (size_t b = 0; b + 1 < blocks; ++b) {
+            for (size_t c = 0; c < 3; ++c) {
+              unsigned char simd = pixels[b * ImageUtils::DEST_COMPS + c];
+              if (simd != tail[c]) {
+                std::fprintf(stderr, "%s %s %g: SIMD gives %d, scalar %d\n",
+                    ImageUtils::formatName(format),
+                    transform == ImageUtils::ColorTransform::Srgb ? "sRGB"
+                                                                  : "linear",
+                    floats[v], simd, tail[c]);
+                return false;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+/*
+ * The 12-bit LUT that the sRGB encoding used before it was evaluated in
+ * registers, kept here as the reference it has to match.
+ */
+static unsigned char srgbLutByte(float sum) {
+  static const size_t size = 4096;
+  static unsigned char lut[size];
+  static bool built = false;
+  if (!built) {
+    for (size_t i = 0; i < size; ++i) {
+      double linear = (double) i / (size - 1);
+      double encoded = linear <= 0.0031308
+          ? linear * 12.92
+          : 1.055 * std::pow(linear, 1.0 / 2.4) - 0.055;
+      lut[i] = (unsigned char) (encoded * 255.0 + 0.5);
+    }
+    built = true;
+  }
+  float index = sum * (0.5f * (size - 1));
+  if (!(index > 0.0f)) {
+    return lut[0];
+  }
+  if (index >= size - 1) {
+    return lut[size - 1];
+  }
+  return lut[(size_t) (index + 0.5f)];
+}
+
+/*
+ * Decomposes a ramp over the whole linear range with the sRGB transform and
+ * compares every output code, SIMD and scalar tail alike, with the LUT and
+ * with the exact curve. Returns false (after saying where) if any code is
+ * more than one off the LUT's.
+ */
+static bool checkSrgb() {
+  // Both eyes' samples of a block are equal, so each pixel encodes one step.
+  const size_t steps = 1 << 16;
+  const size_t blocks = 1021; // Odd, so every row has a scalar tail.
+  const size_t rows = (steps + blocks - 1) / blocks;
+  const size_t srcWidth = blocks * 2;
+  const size_t srcHeight = rows * 2;
+  std::vector<float> src(srcWidth * srcHeight * 4);
+  for (size_t y = 0; y < srcHeight; ++y) {
+    for (size_t x = 0; x < srcWidth; ++x) {
+      size_t step = std::min((y / 2) * blocks + x / 2, steps - 1);
+      float value = (float) step / (steps - 1);
+      for (size_t c = 0; c < 4; ++c) {
+        src[(y * srcWidth + x) * 4 + c] = value;
+      }
+    }
+  }
+
+  ImageUtils::KernelConfig config;
+  config.source = PixelFormat::RGBA32F;
+  config.transform = ImageUtils::ColorTransform::Srgb;
+  config.storeMode = StoreMode::Cached;
+  ImageUtils::DecomposeKernel kernel;
+  std::vector<unsigned char> out;
+  if (!kernel.configure(config, srcWidth, srcHeight)) {
+    std::fprintf(stderr, "Could not configure the sRGB check\n");
+    return false;
+  }
+  out.resize(kernel.imageSize());
+  ImageUtils::DestImage image = kernel.image(out.data());
+  kernel.run(src.data(), &image);
+
+  int maxLutError = 0;
+  double maxExactError = 0.0;
+  for (size_t step = 0; step < rows * blocks; ++step) {
+    float value = src[(step / blocks) * 2 * srcWidth * 4 +
+        (step % blocks) * 2 * 4];
+    double encoded = value <= 0.0031308
+        ? value * 12.92
+        : 1.055 * std::pow((double) value, 1.0 / 2.4) - 0.055;
+    int lut = srgbLutByte(value * 2.0f);
+    for (size_t eye = 0; eye < 2; ++eye) {
+      size_t x = eye * blocks + step % blocks;
+      int code = out[(step / blocks) * image.strides[0] +
+          x * ImageUtils::DEST_COMPS];
+      int lutError = std::abs(code - lut);
+      if (lutError > 1) {
+        std::fprintf(stderr, "sRGB %g: gives %d, the LUT %d\n", value, code,
+            lut);
+        return false;
+      }
+      maxLutError = std::max(maxLutError, lutError);
+      maxExactError = std::max(maxExactError,
+          std::fabs(code - encoded * 255.0));
+    }
+  }
+  std::printf("sRGB encoding: at most %d code(s) from the LUT, %.3f from "
+      "the exact curve\n\n", maxLutError, maxExactError);
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (!checkClamping()) {
+    return 1;
+  }
+  if (!checkSrgb()) {
+    return 1;
+  }
+
+  size_t streamWidth = argc > 2 ? std::strtoul(argv[1], nullptr, 10) : 1280;
+  size_t streamHeight = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 720;
+  int iterations = argc > 3 ? std::atoi(argv[3]) : 50;
+
+  // Maya renders the checkerboard at twice the stream height.
+  size_t srcWidth = streamWidth;
+  size_t srcHeight = streamHeight * 2;
+
+  FrameBuffer dest;
+  if (!dest.allocate(srcWidth * streamHeight * ImageUtils::DEST_COMPS)) {
+    std::fprintf(stderr, "Could not allocate the output buffer\n");
+    return 1;
+  }
+  std::printf("Stream %zux%zu, source %zux%zu, output %.1f MB "
+      "(huge pages=%d)\n\n", streamWidth, streamHeight, srcWidth, srcHeight,
+      dest.size() / 1e6, (int) dest.isHugePage());
+
+  // A cached fill reads every line before writing it (write-allocate); a
+  // streaming fill doesn't. The difference is the write-allocate cost.
+  uint64_t checksum = 0;
+  double fillMs[2];
+  for (int streaming = 0; streaming < 2; ++streaming) {
+    fill(dest, streaming != 0);
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < iterations; ++i) {
+      fill(dest, streaming != 0);
+    }
+    fillMs[streaming] = elapsedMs(start) / iterations;
+    checksum += consume(dest);
+  }
+  std::printf("Output fill: cached %.3f ms (%.1f GB/s), streaming %.3f ms "
+      "(%.1f GB/s)\n", fillMs[0], gbPerSecond(dest.size(), fillMs[0]),
+      fillMs[1], gbPerSecond(dest.size(), fillMs[1]));
+  std::printf("Write-allocate overhead: %.3f ms per frame\n\n",
+      fillMs[0] - fillMs[1]);
+
+  const PixelFormat formats[] = {
+    PixelFormat::RGBA32F,
+    PixelFormat::RGBA16F,
+    PixelFormat::RGB32F,
+    PixelFormat::RGBA8,
+    PixelFormat::BGRA8,
+    PixelFormat::RGB10A2,
+  };
+  const StoreMode storeModes[] = {StoreMode::Cached, StoreMode::Streaming};
+  const char* storeModeNames[] = {"cached", "streaming"};
+
+  std::printf("%-8s %-10s %10s %10s %12s\n", "format", "stores",
+      "decompose", "GB/s", "+read out");
+  for (PixelFormat format : formats) {
+    FrameBuffer src;
+    size_t srcBytes = srcWidth * srcHeight * ImageUtils::bytesPerPixel(format);
+    if (!src.allocate(srcBytes)) {
+      std::fprintf(stderr, "Could not allocate the source buffer\n");
+      return 1;
+    }
+    fillSource(src, format);
+
+    for (size_t m = 0; m < 2; ++m) {
+      ImageUtils::DecomposeKernel kernel;
+      if (!configureDirect(kernel, format, srcWidth, srcHeight,
+          ImageUtils::ColorTransform::Linear, storeModes[m])) {
+        std::fprintf(stderr, "Could not configure %s\n",
+            ImageUtils::formatName(format));
+        return 1;
+      }
+      ImageUtils::DestImage image = kernel.image(dest.data());
+
+      double decomposeMs = 0.0;
+      double totalMs = 0.0;
+      for (int i = 0; i < iterations; ++i) {
+        Clock::time_point start = Clock::now();
+        kernel.run(src.data(), &image);
+        decomposeMs += elapsedMs(start);
+        checksum += consume(dest);
+        totalMs += elapsedMs(start);
+      }
+      decomposeMs /= iterations;
+      totalMs /= iterations;
+      std::printf("%-8s %-10s %7.3f ms %10.1f %9.3f ms\n",
+          ImageUtils::formatName(format), storeModeNames[m], decomposeMs,
+          gbPerSecond(srcBytes + dest.size(), decomposeMs), totalMs);
+    }
+  }
+
+  // The specialized kernels, from the most common capture format.
+  const ImageUtils::DestFormat destFormats[] = {
+    ImageUtils::DestFormat::RGBX,
+    ImageUtils::DestFormat::RGB,
+    ImageUtils::DestFormat::I420,
+    ImageUtils::DestFormat::NV12,
+  };
+  const char* destFormatNames[] = {"RGBX", "RGB", "I420", "NV12"};
+
+  FrameBuffer src;
+  size_t srcBytes = srcWidth * srcHeight *
+      ImageUtils::bytesPerPixel(PixelFormat::RGBA32F);
+  if (!src.allocate(srcBytes)) {
+    std::fprintf(stderr, "Could not allocate the source buffer\n");
+    return 1;
+  }
+  fillSource(src, PixelFormat::RGBA32F);
+
+  const double scales[] = {1.0, 0.5, 0.75};
+
+  std::printf("\n%-8s %-6s %-6s %10s\n", "format", "dest", "scale",
+      "decompose");
+  for (size_t d = 0; d < sizeof(destFormats) / sizeof(destFormats[0]); ++d) {
+    for (double scale : scales) {
+      ImageUtils::KernelConfig config;
+      config.source = PixelFormat::RGBA32F;
+      config.dest = destFormats[d];
+      config.scale = scale;
+      config.storeMode = StoreMode::Cached;
+
+      ImageUtils::DecomposeKernel kernel;
+      FrameBuffer out;
+      if (!kernel.configure(config, srcWidth, srcHeight) ||
+          !out.allocate(kernel.imageSize())) {
+        std::printf("%-8s %-6s %-6.2f %10s\n", "RGBA32F", destFormatNames[d],
+            scale, "n/a");
+        continue;
+      }
+      ImageUtils::DestImage image = kernel.image(out.data());
+
+      Clock::time_point start = Clock::now();
+      for (int i = 0; i < iterations; ++i) {
+        kernel.run(src.data(), &image);
+      }
+      double ms = elapsedMs(start) / iterations;
+      checksum += consume(out);
+      std::printf("%-8s %-6s %-6.2f %7.3f ms\n", "RGBA32F", destFormatNames[d],
+          scale, ms);
+    }
+  }
+
+  // The sRGB encoding against the plain clamp, on the float formats.
+  const PixelFormat floatFormats[] = {PixelFormat::RGBA32F,
+      PixelFormat::RGBA16F};
+  std::printf("\n%-8s %-9s %10s\n", "format", "transform", "decompose");
+  for (PixelFormat format : floatFormats) {
+    FrameBuffer floatSrc;
+    if (!floatSrc.allocate(srcWidth * srcHeight *
+        ImageUtils::bytesPerPixel(format))) {
+      std::fprintf(stderr, "Could not allocate the source buffer\n");
+      return 1;
+    }
+    fillSource(floatSrc, format);
+
+    for (size_t t = 0; t < 2; ++t) {
+      ImageUtils::KernelConfig config;
+      config.source = format;
+      config.transform = t ? ImageUtils::ColorTransform::Srgb
+                           : ImageUtils::ColorTransform::Linear;
+      config.storeMode = StoreMode::Cached;
+
+      ImageUtils::DecomposeKernel kernel;
+      FrameBuffer out;
+      if (!kernel.configure(config, srcWidth, srcHeight) ||
+          !out.allocate(kernel.imageSize())) {
+        std::fprintf(stderr, "Could not configure %s\n",
+            ImageUtils::formatName(format));
+        return 1;
+      }
+      ImageUtils::DestImage image = kernel.image(out.data());
+
+      Clock::time_point start = Clock::now();
+      for (int i = 0; i < iterations; ++i) {
+        kernel.run(floatSrc.data(), &image);
+      }
+      double ms = elapsedMs(start) / iterations;
+      checksum += consume(out);
+      std::printf("%-8s %-9s %7.3f ms\n", ImageUtils::formatName(format),
+          t ? "sRGB" : "linear", ms);
+    }
+  }
+
+  const double radii[] = {0.0, 0.8, 0.7};
+
+  std::printf("\n%-8s %-6s %-6s %10s\n", "format", "dest", "mask",
+      "decompose");
+  for (double radius : radii) {
+    ImageUtils::KernelConfig config;
+    config.source = PixelFormat::RGBA32F;
+    config.storeMode = StoreMode::Cached;
+    config.lensMask.radius = radius;
+
+    ImageUtils::DecomposeKernel kernel;
+    FrameBuffer out;
+    if (!kernel.configure(config, srcWidth, srcHeight) ||
+        !out.allocate(kernel.imageSize())) {
+      std::printf("%-8s %-6s %-6.2f %10s\n", "RGBA32F", "RGBX", radius,
+          "n/a");
+      continue;
+    }
+    ImageUtils::DestImage image = kernel.image(out.data());
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < iterations; ++i) {
+      kernel.run(src.data(), &image);
+    }
+    double ms = elapsedMs(start) / iterations;
+    checksum += consume(out);
+    std::printf("%-8s %-6s %-6.2f %7.3f ms\n", "RGBA32F", "RGBX", radius,
+        ms);
+  }
+
+  // At full size the RGBX kernel decomposes only the changed tiles; at half
+  // size any change decomposes the whole frame, so only an unchanged capture
+  // gains anything there.
+  const double changedScales[] = {1.0, 0.5};
+  std::printf("\n%-8s %-6s %10s %10s %10s %10s\n", "format", "scale", "run",
+      "unchanged", "1/9 new", "all new");
+  for (PixelFormat format : formats) {
+    for (double scale : changedScales) {
+      ImageUtils::KernelConfig config;
+      config.source = format;
+      config.scale = scale;
+      config.storeMode = StoreMode::Cached;
+      ImageUtils::DecomposeKernel kernel;
+      FrameBuffer out;
+      if (!kernel.configure(config, srcWidth, srcHeight) ||
+          !out.allocate(kernel.imageSize())) {
+        std::fprintf(stderr, "Could not configure %s\n",
+            ImageUtils::formatName(format));
+        return 1;
+      }
+      ImageUtils::DestImage image = kernel.image(out.data());
+
+      // Captures alternate between a and one of the others, so each call sees
+      // the same change again.
+      size_t pixelBytes = ImageUtils::bytesPerPixel(format);
+      size_t srcBytes = srcWidth * srcHeight * pixelBytes;
+      FrameBuffer a;
+      FrameBuffer ninth;
+      FrameBuffer all;
+      if (!a.allocate(srcBytes) || !ninth.allocate(srcBytes) ||
+          !all.allocate(srcBytes)) {
+        std::fprintf(stderr, "Could not allocate the source buffers\n");
+        return 1;
+      }
+      fillSource(a, format);
+      std::memcpy(ninth.data(), a.data(), srcBytes);
+      std::memcpy(all.data(), a.data(), srcBytes);
+      for (size_t y = 0; y < srcHeight; ++y) {
+        for (size_t x = 0; x < srcWidth; ++x) {
+          size_t i = (y * srcWidth + x) * pixelBytes;
+          all.data()[i] ^= 1;
+          if (y >= srcHeight / 3 && y < 2 * srcHeight / 3 &&
+              x >= srcWidth / 3 && x < 2 * srcWidth / 3) {
+            ninth.data()[i] ^= 1;
+          }
+        }
+      }
+
+      const FrameBuffer* others[] = {&a, &ninth, &all};
+      double changedMs[3];
+      for (size_t o = 0; o < 3; ++o) {
+        kernel.runChanged(a.data(), &image, false);
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < iterations; ++i) {
+          kernel.runChanged((i % 2 ? a : *others[o]).data(), &image, false);
+        }
+        changedMs[o] = elapsedMs(start) / iterations;
+        checksum += consume(out);
+      }
+
+      Clock::time_point start = Clock::now();
+      for (int i = 0; i < iterations; ++i) {
+        kernel.run(a.data(), &image);
+      }
+      double runMs = elapsedMs(start) / iterations;
+      checksum += consume(out);
+
+      // An unchanged capture costs only the hashing.
+      std::printf("%-8s %-6.2f %7.3f ms %7.3f ms %7.3f ms %7.3f ms\n",
+          ImageUtils::formatName(format), scale, runMs, changedMs[0],
+          changedMs[1], changedMs[2]);
+    }
+  }
+
+  std::printf("\n(checksum %llu)\n", (unsigned long long) checksum);
+  return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Maya-free check of FramePacer's statistics. Feeds it synthetic transmits:
+ * steady runs at the target rate separated by a long pause (a still scene,
+ * where Maya renders nothing), and checks that the pause counts as an idle
+ * gap rather than as a late frame or a huge interval. Exits with an error if
+ * it doesn't.
+ *
+ *   make check
+ *   ./FramePacerCheck
+ */
+#include "../FramePacer.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+using Clock = FramePacer::Clock;
+
+static int failures = 0;
+
+static void expect(bool ok, const char* what, double value) {
+  std::printf("%-32s %10.3f  %s\n", what, value, ok ? "ok" : "FAILED");
+  if (!ok) {
+    failures++;
+  }
+}
+
+/** Sends count frames, each taking 2 ms, arriving every interval. */
+static Clock::time_point sendRun(FramePacer& pacer, Clock::time_point time,
+    Clock::duration interval, int count) {
+  for (int i = 0; i < count; ++i) {
+    pacer.frameSent(time - std::chrono::milliseconds(2), time);
+    time += interval;
+  }
+  return time;
+}
+
+static void checkPacing(double targetRate) {
+  std::printf("\ntarget rate %.0f fps\n", targetRate);
+  FramePacer pacer(targetRate);
+  Clock::duration interval = std::chrono::microseconds(16667);
+  Clock::time_point time = Clock::now();
+
+  time = sendRun(pacer, time, interval, 30);
+  time += std::chrono::seconds(5);
+  sendRun(pacer, time, interval, 30);
+
+  FramePacer::Stats stats = pacer.getStats();
+  expect(stats.frames == 60, "frames", (double) stats.frames);
+  expect(stats.idleGaps == 1, "idle gaps", (double) stats.idleGaps);
+  expect(stats.lateFrames == 0, "late frames", (double) stats.lateFrames);
+  expect(std::abs(stats.meanIntervalMs - 16.667) < 0.01,
+      "mean interval (ms)", stats.meanIntervalMs);
+  expect(stats.jitterMs < 0.01, "jitter (ms)", stats.jitterMs);
+  expect(stats.maxDeviationMs < 0.01, "max deviation (ms)",
+      stats.maxDeviationMs);
+}
+
+static void checkLateFrame() {
+  // A frame two intervals late is late, not a pause.
+  std::printf("\none late frame at 60 fps\n");
+  FramePacer pacer(60.0);
+  Clock::duration interval = std::chrono::microseconds(16667);
+  Clock::time_point time = Clock::now();
+
+  time = sendRun(pacer, time, interval, 30);
+  time += 2 * interval;
+  sendRun(pacer, time, interval, 30);
+
+  FramePacer::Stats stats = pacer.getStats();
+  expect(stats.idleGaps == 0, "idle gaps", (double) stats.idleGaps);
+  expect(stats.lateFrames == 1, "late frames", (double) stats.lateFrames);
+  expect(std::abs(stats.maxDeviationMs - 33.333) < 0.01,
+      "max deviation (ms)", stats.maxDeviationMs);
+}
+
+int main() {
+  checkPacing(60.0);
+  checkPacing(0.0);
+  checkLateFrame();
+
+  if (failures > 0) {
+    std::printf("\n%d checks failed\n", failures);
+    return 1;
+  }
+  std::printf("\nall checks passed\n");
+  return 0;
+}